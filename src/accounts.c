@@ -0,0 +1,944 @@
+/***
+ Copyright © 2015 Intel Corporation
+
+ Author: Auke-jan H. Kok <auke-jan.h.kok@intel.com>
+ Author: Julio Montes <julio.montes@intel.com>
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+/*
+ * accounts.c - in-process replacement for useradd, usermod, groupadd and
+ * passwd, for adding many users without a process and a rewrite of
+ * every account file each
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <shadow.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include <glib.h>
+
+#include "lib.h"
+#include "accounts.h"
+
+#define MOD "accounts: "
+
+/* the account files are where libc looks for them, whatever sysconfdir is */
+#define ETC_PATH "/etc"
+/* where stateless systems keep the defaults that /etc may override */
+#define DEFAULTS_PATH "/usr/share/defaults/etc"
+#define LOCK_FILE ".pwd.lock"
+/* most seconds to wait for the lock, as lckpwdf() does */
+#define LOCK_TIMEOUT 15
+
+enum {
+	DB_PASSWD,
+	DB_SHADOW,
+	DB_GROUP,
+	DB_GSHADOW,
+	DB_SUBUID,
+	DB_SUBGID,
+	DBS
+};
+
+static const gchar* db_names[DBS] = {
+	[DB_PASSWD] = "passwd",
+	[DB_SHADOW] = "shadow",
+	[DB_GROUP] = "group",
+	[DB_GSHADOW] = "gshadow",
+	[DB_SUBUID] = "subuid",
+	[DB_SUBGID] = "subgid",
+};
+
+/* one line of a database, split at the colons */
+struct entry {
+	gchar** f;
+};
+
+/*
+ * db: one account file, as read
+ * - lines: all its lines in order, comments and all, so that it is
+ *   written back the way it was, plus the new ones.
+ * - index: entries by name; ids: the uids or gids in use, for passwd and
+ *   group.
+ */
+struct db {
+	gchar* path;
+	bool exists;
+	bool dirty;
+	struct stat st;
+	GPtrArray* lines;
+	GHashTable* index;
+	GHashTable* ids;
+};
+
+/* a home directory to create once the user exists */
+struct home {
+	gchar* path;
+	uid_t uid;
+	gid_t gid;
+};
+
+struct accounts {
+	gchar* root;
+	int lock_fd;
+	bool locked;
+	struct db db[DBS];
+	GHashTable* defs;
+	GList* homes;
+};
+
+static void entry_free(gpointer data) {
+	struct entry* e = data;
+	g_strfreev(e->f);
+	g_free(e);
+}
+
+/* field i of e, "" if the line is too short */
+static const gchar* entry_get(const struct entry* e, guint i) {
+	return i < g_strv_length(e->f) ? e->f[i] : "";
+}
+
+static void entry_set(struct entry* e, guint i, const gchar* value) {
+	guint len = g_strv_length(e->f);
+	if (i >= len) {
+		e->f = g_renew(gchar*, e->f, i + 2);
+		for (guint n = len; n <= i; n++) {
+			e->f[n] = g_strdup("");
+		}
+		e->f[i + 1] = NULL;
+	}
+	g_free(e->f[i]);
+	e->f[i] = g_strdup(value);
+}
+
+/* a path under the root of a */
+static gchar* accounts_path(const struct accounts* a, const gchar* path) {
+	return g_build_filename(a->root, path, NULL);
+}
+
+static void db_add(struct db* d, struct entry* e, bool index) {
+	g_ptr_array_add(d->lines, e);
+	if (!index) {
+		return;
+	}
+	g_hash_table_insert(d->index, e->f[0], e);
+	if (d->ids) {
+		g_hash_table_add(d->ids, GUINT_TO_POINTER(strtoul(entry_get(e, 2), NULL, 10)));
+	}
+}
+
+/* a new entry from the given fields, marking d as changed */
+static struct entry* db_append(struct db* d, const gchar* const* fields) {
+	struct entry* e = g_new0(struct entry, 1);
+	e->f = g_strdupv((gchar**)fields);
+	db_add(d, e, true);
+	d->dirty = true;
+	return e;
+}
+
+static struct entry* db_find(struct db* d, const gchar* name) {
+	return d->exists ? g_hash_table_lookup(d->index, name) : NULL;
+}
+
+/*
+ * db_load() - read the file of d, or fallback if there is none
+ * - a stateless system ships its accounts under DEFAULTS_PATH only: they
+ *   are read from there, and written to the path of d once changed.
+ */
+static bool db_load(struct db* d, const gchar* fallback) {
+	const gchar* path = d->path;
+	gchar* contents = NULL;
+	GError* error = NULL;
+
+	d->lines = g_ptr_array_new_with_free_func(entry_free);
+	d->index = g_hash_table_new(g_str_hash, g_str_equal);
+
+	int r = stat(path, &d->st);
+	if (r != 0 && errno == ENOENT && fallback) {
+		path = fallback;
+		r = stat(path, &d->st);
+	}
+	if (r != 0) {
+		/* shadow files and subordinate ids are optional */
+		return errno == ENOENT;
+	}
+	if (!g_file_get_contents(path, &contents, NULL, &error)) {
+		LOG(MOD "Cannot read %s: %s\n", path, error->message);
+		g_error_free(error);
+		return false;
+	}
+	d->exists = true;
+
+	gchar** lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	for (gchar** line = lines; *line; line++) {
+		/* the split leaves an empty string after the last newline */
+		if (!line[1] && !**line) {
+			break;
+		}
+		struct entry* e = g_new0(struct entry, 1);
+		e->f = g_strsplit(*line, ":", -1);
+		/* comments and NIS lines are kept, but not looked up */
+		bool plain = **line && !strchr("#+-", **line) && !g_hash_table_contains(d->index, e->f[0]);
+		db_add(d, e, plain);
+	}
+	g_strfreev(lines);
+	return true;
+}
+
+/*
+ * db_write() - replace the file of d with its lines
+ * - the new file is written next to it with the same owner and mode,
+ *   synced, and renamed over it; the old one is kept with a "-" suffix,
+ *   as the shadow tools do.
+ */
+static bool db_write(struct db* d) {
+	gchar* tmp = g_strconcat(d->path, "+", NULL);
+	gchar* backup = g_strconcat(d->path, "-", NULL);
+	GString* data = g_string_new("");
+	bool result = false;
+
+	for (guint i = 0; i < d->lines->len; i++) {
+		struct entry* e = g_ptr_array_index(d->lines, i);
+		gchar* line = g_strjoinv(":", e->f);
+		g_string_append(data, line);
+		g_string_append_c(data, '\n');
+		g_free(line);
+	}
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, d->st.st_mode & 07777);
+	if (fd < 0) {
+		LOG(MOD "Cannot create %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if ((fchown(fd, d->st.st_uid, d->st.st_gid) != 0) ||
+	    (fchmod(fd, d->st.st_mode & 07777) != 0) ||
+	    (write(fd, data->str, data->len) != (ssize_t)data->len) ||
+	    (fsync(fd) != 0)) {
+		LOG(MOD "Cannot write %s: %s\n", tmp, strerror(errno));
+		close(fd);
+		(void) unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	(void) unlink(backup);
+	(void) link(d->path, backup);
+	if (rename(tmp, d->path) != 0) {
+		LOG(MOD "Cannot replace %s: %s\n", d->path, strerror(errno));
+		(void) unlink(tmp);
+		goto out;
+	}
+	d->dirty = false;
+	result = true;
+
+out:
+	g_string_free(data, true);
+	g_free(backup);
+	g_free(tmp);
+	return result;
+}
+
+static void db_free(struct db* d) {
+	if (d->index) {
+		g_hash_table_destroy(d->index);
+	}
+	if (d->ids) {
+		g_hash_table_destroy(d->ids);
+	}
+	if (d->lines) {
+		g_ptr_array_free(d->lines, true);
+	}
+	g_free(d->path);
+}
+
+/* read KEY VALUE or KEY=VALUE lines of the first of paths that exists */
+static void defs_load(struct accounts* a, const gchar* const* paths, const gchar* sep) {
+	for (; *paths; paths++) {
+		gchar* path = accounts_path(a, *paths);
+		gchar* contents = NULL;
+		bool found = g_file_get_contents(path, &contents, NULL, NULL);
+		g_free(path);
+		if (!found) {
+			continue;
+		}
+
+		gchar** lines = g_strsplit(contents, "\n", -1);
+		for (gchar** line = lines; *line; line++) {
+			gchar* l = g_strstrip(*line);
+			if (!*l || *l == '#') {
+				continue;
+			}
+			gchar** kv = g_strsplit_set(l, sep, 2);
+			if (kv[0] && kv[1]) {
+				g_hash_table_replace(a->defs, g_strdup(kv[0]), g_strdup(g_strstrip(kv[1])));
+			}
+			g_strfreev(kv);
+		}
+		g_strfreev(lines);
+		g_free(contents);
+		return;
+	}
+}
+
+static const gchar* defs_get(struct accounts* a, const gchar* key, const gchar* fallback) {
+	const gchar* value = g_hash_table_lookup(a->defs, key);
+	return value ? value : fallback;
+}
+
+static gulong defs_ulong(struct accounts* a, const gchar* key, gulong fallback) {
+	const gchar* value = g_hash_table_lookup(a->defs, key);
+	return value ? strtoul(value, NULL, 0) : fallback;
+}
+
+static bool defs_bool(struct accounts* a, const gchar* key, bool fallback) {
+	const gchar* value = g_hash_table_lookup(a->defs, key);
+	return value ? g_ascii_strcasecmp(value, "yes") == 0 : fallback;
+}
+
+/*
+ * accounts_lock() - take the lock the shadow tools and lckpwdf() use
+ * - for the running system, that is lckpwdf() itself; for another root,
+ *   the same kind of lock on its own lock file.
+ */
+static bool accounts_lock(struct accounts* a) {
+	if (g_strcmp0(a->root, "/") == 0) {
+		if (lckpwdf() != 0) {
+			LOG(MOD "Cannot lock the password files: %s\n", strerror(errno));
+			return false;
+		}
+		a->locked = true;
+		return true;
+	}
+
+	gchar* path = accounts_path(a, ETC_PATH "/" LOCK_FILE);
+	a->lock_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	g_free(path);
+	if (a->lock_fd < 0) {
+		LOG(MOD "Cannot open the lock file: %s\n", strerror(errno));
+		return false;
+	}
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	for (int i = 0; fcntl(a->lock_fd, F_SETLK, &fl) != 0; i++) {
+		if (i == LOCK_TIMEOUT || (errno != EAGAIN && errno != EACCES)) {
+			LOG(MOD "Cannot lock the password files: %s\n", strerror(errno));
+			return false;
+		}
+		sleep(1);
+	}
+	a->locked = true;
+	return true;
+}
+
+struct accounts* accounts_open(const gchar* root) {
+	struct accounts* a = g_new0(struct accounts, 1);
+	const gchar* login_defs[] = { ETC_PATH "/login.defs", DEFAULTS_PATH "/login.defs", NULL };
+	const gchar* useradd_defs[] = { ETC_PATH "/default/useradd", DEFAULTS_PATH "/default/useradd", NULL };
+
+	a->root = g_strdup(root);
+	a->lock_fd = -1;
+	a->defs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	if (!accounts_lock(a)) {
+		accounts_close(a);
+		return NULL;
+	}
+
+	for (int i = 0; i < DBS; i++) {
+		gchar* path = g_strdup_printf(ETC_PATH "/%s", db_names[i]);
+		a->db[i].path = accounts_path(a, path);
+		g_free(path);
+		/* there are no stateless defaults for subordinate ids */
+		gchar* fallback = NULL;
+		if (i != DB_SUBUID && i != DB_SUBGID) {
+			path = g_strdup_printf(DEFAULTS_PATH "/%s", db_names[i]);
+			fallback = accounts_path(a, path);
+			g_free(path);
+		}
+		if (i == DB_PASSWD || i == DB_GROUP) {
+			a->db[i].ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+		}
+		bool loaded = db_load(&a->db[i], fallback);
+		g_free(fallback);
+		if (!loaded) {
+			accounts_close(a);
+			return NULL;
+		}
+	}
+	if (!a->db[DB_PASSWD].exists || !a->db[DB_GROUP].exists) {
+		LOG(MOD "No passwd or group file under %s\n", root);
+		accounts_close(a);
+		return NULL;
+	}
+
+	defs_load(a, login_defs, " \t");
+	defs_load(a, useradd_defs, "=");
+	return a;
+}
+
+/*
+ * copy_tree() - copy the contents of directory src into dst, for uid:gid
+ * - directories, regular files and symlinks are copied; anything else in
+ *   a skeleton directory is skipped.
+ */
+static void copy_tree(int src, int dst, uid_t uid, gid_t gid) {
+	DIR* dir = fdopendir(src);
+	struct dirent* de;
+
+	if (!dir) {
+		close(src);
+		return;
+	}
+	while ((de = readdir(dir))) {
+		struct stat st;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		    fstatat(src, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (mkdirat(dst, de->d_name, st.st_mode & 07777) != 0) {
+				continue;
+			}
+			int from = openat(src, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			int to = openat(dst, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (from >= 0 && to >= 0) {
+				copy_tree(from, to, uid, gid);
+			} else if (from >= 0) {
+				close(from);
+			}
+			if (to >= 0) {
+				close(to);
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			int from = openat(src, de->d_name, O_RDONLY | O_CLOEXEC);
+			int to = openat(dst, de->d_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+			off_t off = 0;
+			while (from >= 0 && to >= 0 && off < st.st_size &&
+			       sendfile(to, from, &off, (size_t)(st.st_size - off)) > 0)
+				;
+			if (from >= 0) {
+				close(from);
+			}
+			if (to >= 0) {
+				close(to);
+			}
+		} else if (S_ISLNK(st.st_mode)) {
+			gchar target[PATH_MAX];
+			ssize_t len = readlinkat(src, de->d_name, target, sizeof(target) - 1);
+			if (len < 0) {
+				continue;
+			}
+			target[len] = 0;
+			if (symlinkat(target, dst, de->d_name) != 0) {
+				continue;
+			}
+		} else {
+			continue;
+		}
+		(void) fchownat(dst, de->d_name, uid, gid, AT_SYMLINK_NOFOLLOW);
+	}
+	closedir(dir);
+}
+
+/* create a home directory, filled from the skeleton directory, like useradd -m */
+static void create_home(struct accounts* a, const struct home* h) {
+	gchar* path = accounts_path(a, h->path);
+	gchar* parent = g_path_get_dirname(path);
+	mode_t mode = (mode_t)defs_ulong(a, "HOME_MODE", 0777 & ~defs_ulong(a, "UMASK", 077));
+
+	if (g_mkdir_with_parents(parent, 0755) != 0 || mkdir(path, 0700) != 0) {
+		LOG(MOD "Cannot create home directory %s: %s\n", h->path, strerror(errno));
+		goto out;
+	}
+
+	gchar* skel = accounts_path(a, defs_get(a, "SKEL", ETC_PATH "/skel"));
+	int src = open(skel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int dst = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	g_free(skel);
+	if (src >= 0 && dst >= 0) {
+		copy_tree(src, dst, h->uid, h->gid);
+	} else if (src >= 0) {
+		close(src);
+	}
+	if (dst >= 0) {
+		if ((fchown(dst, h->uid, h->gid) != 0) || (fchmod(dst, mode) != 0)) {
+			LOG(MOD "Cannot set owner of %s: %s\n", h->path, strerror(errno));
+		}
+		close(dst);
+	}
+
+out:
+	g_free(parent);
+	g_free(path);
+}
+
+bool accounts_commit(struct accounts* a) {
+	bool result = true;
+
+	/* the shadow files first, so no user ever shows up without a password entry */
+	const int order[DBS] = { DB_SHADOW, DB_GSHADOW, DB_GROUP, DB_PASSWD, DB_SUBUID, DB_SUBGID };
+	for (int i = 0; i < DBS; i++) {
+		struct db* d = &a->db[order[i]];
+		if (d->dirty && !db_write(d)) {
+			result = false;
+		}
+	}
+
+	gchar* dir = accounts_path(a, ETC_PATH);
+	int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	g_free(dir);
+	if (fd >= 0) {
+		(void) fsync(fd);
+		close(fd);
+	}
+
+	a->homes = g_list_reverse(a->homes);
+	for (GList* l = a->homes; l; l = l->next) {
+		struct home* h = l->data;
+		create_home(a, h);
+		g_free(h->path);
+		g_free(h);
+	}
+	g_list_free(a->homes);
+	a->homes = NULL;
+
+	return result;
+}
+
+void accounts_close(struct accounts* a) {
+	for (int i = 0; i < DBS; i++) {
+		db_free(&a->db[i]);
+	}
+	for (GList* l = a->homes; l; l = l->next) {
+		struct home* h = l->data;
+		g_free(h->path);
+		g_free(h);
+	}
+	g_list_free(a->homes);
+	if (a->locked && a->lock_fd < 0) {
+		(void) ulckpwdf();
+	}
+	if (a->lock_fd >= 0) {
+		close(a->lock_fd);
+	}
+	g_hash_table_destroy(a->defs);
+	g_free(a->root);
+	g_free(a);
+}
+
+/* whether value can go into a field of an account file */
+static bool valid_field(const gchar* value) {
+	return !value || !strpbrk(value, ":\n");
+}
+
+/* a name for a user or group: no separators, no leading dash */
+static bool valid_name(const gchar* name) {
+	return name && *name && *name != '-' && !strpbrk(name, ":,\n \t/");
+}
+
+static gchar* days_since_epoch(void) {
+	return g_strdup_printf("%ld", (long)(time(NULL) / (24 * 60 * 60)));
+}
+
+/*
+ * allocate_id() - pick a free uid or gid in the range for regular or
+ * system accounts, the way the shadow tools do
+ * - regular ids go up from the highest one in use, system ids down from
+ *   the lowest one; if that runs out of the range, the first free one is
+ *   taken.
+ * - prefer is taken if it is free and in range, for user private groups.
+ * - returns 0 if the range is full.
+ */
+static gulong allocate_id(struct accounts* a, GHashTable* ids, const gchar* kind, bool system, gulong prefer) {
+	gchar* key_min = g_strdup_printf(system ? "SYS_%s_MIN" : "%s_MIN", kind);
+	gchar* key_max = g_strdup_printf(system ? "SYS_%s_MAX" : "%s_MAX", kind);
+	gulong min = defs_ulong(a, key_min, system ? 101 : 1000);
+	gulong max = defs_ulong(a, key_max, system ? 999 : 60000);
+	g_free(key_min);
+	g_free(key_max);
+
+	if (prefer >= min && prefer <= max && !g_hash_table_contains(ids, GUINT_TO_POINTER(prefer))) {
+		return prefer;
+	}
+
+	gulong next = system ? max : min;
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, ids);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		gulong id = GPOINTER_TO_UINT(key);
+		if (id < min || id > max) {
+			continue;
+		}
+		if (system && id <= next) {
+			next = id - 1;
+		} else if (!system && id >= next) {
+			next = id + 1;
+		}
+	}
+	if (next >= min && next <= max && !g_hash_table_contains(ids, GUINT_TO_POINTER(next))) {
+		return next;
+	}
+
+	for (gulong id = min; id <= max; id++) {
+		if (!g_hash_table_contains(ids, GUINT_TO_POINTER(id))) {
+			return id;
+		}
+	}
+	return 0;
+}
+
+/* give a new regular user its subordinate ids in d, if the system uses them */
+static void allocate_subids(struct accounts* a, struct db* d, const gchar* kind, const gchar* name) {
+	if (!d->exists || db_find(d, name)) {
+		return;
+	}
+
+	gchar* key = g_strdup_printf("SUB_%s_MIN", kind);
+	gulong min = defs_ulong(a, key, 100000);
+	g_free(key);
+	key = g_strdup_printf("SUB_%s_MAX", kind);
+	gulong max = defs_ulong(a, key, 600100000);
+	g_free(key);
+	key = g_strdup_printf("SUB_%s_COUNT", kind);
+	gulong count = defs_ulong(a, key, 65536);
+	g_free(key);
+
+	/* after the last range handed out so far */
+	gulong start = min;
+	for (guint i = 0; i < d->lines->len; i++) {
+		struct entry* e = g_ptr_array_index(d->lines, i);
+		gulong end = strtoul(entry_get(e, 1), NULL, 10) + strtoul(entry_get(e, 2), NULL, 10);
+		if (end > start && end <= max) {
+			start = end;
+		}
+	}
+	if (count == 0 || start + count - 1 > max) {
+		LOG(MOD "No subordinate %s range left for %s\n", kind, name);
+		return;
+	}
+
+	gchar* first = g_strdup_printf("%lu", start);
+	gchar* size = g_strdup_printf("%lu", count);
+	const gchar* fields[] = { name, first, size, NULL };
+	db_append(d, fields);
+	g_free(first);
+	g_free(size);
+}
+
+/* the group called name, or with name as its number */
+static struct entry* find_group(struct accounts* a, const gchar* name) {
+	struct entry* e = db_find(&a->db[DB_GROUP], name);
+	if (e || !g_ascii_isdigit(*name)) {
+		return e;
+	}
+	for (guint i = 0; i < a->db[DB_GROUP].lines->len; i++) {
+		e = g_ptr_array_index(a->db[DB_GROUP].lines, i);
+		if (g_strcmp0(entry_get(e, 2), name) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* add a group with the given gid */
+static void add_group(struct accounts* a, const gchar* name, gulong gid) {
+	gchar* id = g_strdup_printf("%lu", gid);
+	const gchar* group[] = { name, a->db[DB_GSHADOW].exists ? "x" : "", id, "", NULL };
+	db_append(&a->db[DB_GROUP], group);
+	g_free(id);
+
+	if (a->db[DB_GSHADOW].exists) {
+		const gchar* gshadow[] = { name, "!", "", "", NULL };
+		db_append(&a->db[DB_GSHADOW], gshadow);
+	}
+}
+
+bool accounts_add_group(struct accounts* a, const gchar* name, bool system) {
+	if (!valid_name(name)) {
+		LOG(MOD "Invalid group name '%s'\n", name);
+		return false;
+	}
+	/* like groupadd -f: there already is one, fine */
+	if (db_find(&a->db[DB_GROUP], name)) {
+		return true;
+	}
+
+	gulong gid = allocate_id(a, a->db[DB_GROUP].ids, "GID", system, 0);
+	if (gid == 0) {
+		LOG(MOD "No free gid left for group %s\n", name);
+		return false;
+	}
+	add_group(a, name, gid);
+	return true;
+}
+
+/* append member to the comma separated list in field i of e */
+static void add_to_list(struct db* d, struct entry* e, guint i, const gchar* member) {
+	gchar** members = g_strsplit(entry_get(e, i), ",", -1);
+	bool found = false;
+	for (gchar** m = members; *m; m++) {
+		if (g_strcmp0(*m, member) == 0) {
+			found = true;
+		}
+	}
+	g_strfreev(members);
+	if (found) {
+		return;
+	}
+
+	const gchar* list = entry_get(e, i);
+	gchar* value = *list ? g_strconcat(list, ",", member, NULL) : g_strdup(member);
+	entry_set(e, i, value);
+	g_free(value);
+	d->dirty = true;
+}
+
+bool accounts_add_member(struct accounts* a, const gchar* group, const gchar* user) {
+	struct entry* g = db_find(&a->db[DB_GROUP], group);
+	if (!g) {
+		LOG(MOD "Group %s does not exist\n", group);
+		return false;
+	}
+	if (!db_find(&a->db[DB_PASSWD], user)) {
+		LOG(MOD "User %s does not exist\n", user);
+		return false;
+	}
+
+	add_to_list(&a->db[DB_GROUP], g, 3, user);
+	struct entry* gs = db_find(&a->db[DB_GSHADOW], group);
+	if (gs) {
+		add_to_list(&a->db[DB_GSHADOW], gs, 3, user);
+	}
+	return true;
+}
+
+bool accounts_has_user(struct accounts* a, const gchar* name) {
+	return db_find(&a->db[DB_PASSWD], name) != NULL;
+}
+
+/* days since the epoch of a YYYY-MM-DD date, "" for an empty one, NULL if invalid */
+static gchar* parse_date(const gchar* date) {
+	struct tm tm = { 0 };
+	if (!*date) {
+		return g_strdup("");
+	}
+	const gchar* end = strptime(date, "%Y-%m-%d", &tm);
+	if (!end || *end) {
+		return NULL;
+	}
+	return g_strdup_printf("%ld", (long)(timegm(&tm) / (24 * 60 * 60)));
+}
+
+/*
+ * accounts_add_user() - add a user, as useradd would
+ * - unless told otherwise, the user gets a group of its own, with the
+ *   same id if that is free, and subordinate ids if the system has them.
+ * - supplementary groups that don't exist are skipped.
+ * - the home directory, if one is to be made, is created on commit.
+ */
+bool accounts_add_user(struct accounts* a, const struct account_user* user) {
+	const gchar* name = user->name;
+
+	if (!valid_name(name) || !valid_field(user->gecos) || !valid_field(user->home) ||
+	    !valid_field(user->shell) || !valid_field(user->password)) {
+		LOG(MOD "Invalid settings for user '%s'\n", name);
+		return false;
+	}
+	if (db_find(&a->db[DB_PASSWD], name)) {
+		LOG(MOD "User %s already exists\n", name);
+		return false;
+	}
+
+	gchar* expire = parse_date(user->expiredate ? user->expiredate : defs_get(a, "EXPIRE", ""));
+	if (!expire) {
+		LOG(MOD "Invalid expiration date for user %s\n", name);
+		return false;
+	}
+
+	gulong uid = allocate_id(a, a->db[DB_PASSWD].ids, "UID", user->system, 0);
+	if (uid == 0) {
+		LOG(MOD "No free uid left for user %s\n", name);
+		g_free(expire);
+		return false;
+	}
+
+	gulong gid;
+	bool user_group = user->user_group >= 0 ? user->user_group : defs_bool(a, "USERGROUPS_ENAB", true);
+	if (user->primary_group) {
+		struct entry* g = find_group(a, user->primary_group);
+		if (!g) {
+			LOG(MOD "Group %s does not exist\n", user->primary_group);
+			g_free(expire);
+			return false;
+		}
+		gid = strtoul(entry_get(g, 2), NULL, 10);
+	} else if (user_group) {
+		if (db_find(&a->db[DB_GROUP], name)) {
+			LOG(MOD "Group %s exists already, cannot add user %s\n", name, name);
+			g_free(expire);
+			return false;
+		}
+		gid = allocate_id(a, a->db[DB_GROUP].ids, "GID", user->system, uid);
+		if (gid == 0) {
+			LOG(MOD "No free gid left for group %s\n", name);
+			g_free(expire);
+			return false;
+		}
+		add_group(a, name, gid);
+	} else {
+		struct entry* g = find_group(a, defs_get(a, "GROUP", "100"));
+		gid = g ? strtoul(entry_get(g, 2), NULL, 10) : 100;
+	}
+
+	gchar* home = user->home ? g_strdup(user->home) :
+		g_build_filename(defs_get(a, "HOME", "/home"), name, NULL);
+	gchar* uid_s = g_strdup_printf("%lu", uid);
+	gchar* gid_s = g_strdup_printf("%lu", gid);
+	const gchar* password = user->password ? user->password : "!";
+	bool shadow = a->db[DB_SHADOW].exists;
+
+	const gchar* passwd[] = { name, shadow ? "x" : password, uid_s, gid_s,
+		user->gecos ? user->gecos : "", home,
+		user->shell ? user->shell : defs_get(a, "SHELL", ""), NULL };
+	db_append(&a->db[DB_PASSWD], passwd);
+
+	if (shadow) {
+		gchar* lastchg = days_since_epoch();
+		const gchar* inactive = user->inactive ? user->inactive : defs_get(a, "INACTIVE", "-1");
+		const gchar* sp[] = { name, password, lastchg,
+			defs_get(a, "PASS_MIN_DAYS", ""), defs_get(a, "PASS_MAX_DAYS", ""),
+			defs_get(a, "PASS_WARN_AGE", ""),
+			strtol(inactive, NULL, 10) < 0 ? "" : inactive, expire, "", NULL };
+		db_append(&a->db[DB_SHADOW], sp);
+		g_free(lastchg);
+	}
+
+	if (user->groups) {
+		gchar** groups = g_strsplit(user->groups, ",", -1);
+		for (gchar** g = groups; *g; g++) {
+			gchar* group = g_strstrip(*g);
+			if (*group && !accounts_add_member(a, group, name)) {
+				LOG(MOD "Not adding %s to group %s\n", name, group);
+			}
+		}
+		g_strfreev(groups);
+	}
+
+	if (!user->system) {
+		allocate_subids(a, &a->db[DB_SUBUID], "UID", name);
+		allocate_subids(a, &a->db[DB_SUBGID], "GID", name);
+	}
+
+	bool create = user->create_home >= 0 ? user->create_home :
+		!user->system && defs_bool(a, "CREATE_HOME", false);
+	if (create) {
+		struct home* h = g_new0(struct home, 1);
+		h->path = home;
+		h->uid = (uid_t)uid;
+		h->gid = (gid_t)gid;
+		a->homes = g_list_prepend(a->homes, h);
+	} else {
+		g_free(home);
+	}
+
+	g_free(uid_s);
+	g_free(gid_s);
+	g_free(expire);
+	return true;
+}
+
+/* the entry holding the password of name: in shadow if there is one */
+static struct entry* password_entry(struct accounts* a, const gchar* name, struct db** d) {
+	*d = &a->db[DB_SHADOW];
+	struct entry* e = db_find(*d, name);
+	if (!e && db_find(&a->db[DB_PASSWD], name)) {
+		*d = &a->db[DB_PASSWD];
+		e = db_find(*d, name);
+	}
+	if (!e) {
+		LOG(MOD "User %s does not exist\n", name);
+	}
+	return e;
+}
+
+bool accounts_set_password(struct accounts* a, const gchar* name, const gchar* password) {
+	struct db* d;
+	struct entry* e = password_entry(a, name, &d);
+	if (!e || !valid_field(password)) {
+		return false;
+	}
+	entry_set(e, 1, password);
+	d->dirty = true;
+	return true;
+}
+
+/* like passwd -l: prefix the password with "!", so it no longer matches */
+bool accounts_lock_password(struct accounts* a, const gchar* name) {
+	struct db* d;
+	struct entry* e = password_entry(a, name, &d);
+	if (!e) {
+		return false;
+	}
+	if (entry_get(e, 1)[0] != '!') {
+		gchar* locked = g_strconcat("!", entry_get(e, 1), NULL);
+		entry_set(e, 1, locked);
+		g_free(locked);
+		d->dirty = true;
+	}
+	return true;
+}
+
+/* like usermod --expiredate: the account expires `days` after the epoch */
+bool accounts_set_expire(struct accounts* a, const gchar* name, long days) {
+	struct entry* e = db_find(&a->db[DB_SHADOW], name);
+	if (!e) {
+		LOG(MOD "User %s has no shadow entry\n", name);
+		return false;
+	}
+	gchar* value = g_strdup_printf("%ld", days);
+	entry_set(e, 7, value);
+	g_free(value);
+	a->db[DB_SHADOW].dirty = true;
+	return true;
+}
@@ -0,0 +1,91 @@
+/***
+ Copyright © 2015 Intel Corporation
+
+ Author: Julio Montes <julio.montes@intel.com>
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <glib.h>
+
+/*
+ * accounts: the passwd, shadow, group and gshadow databases, and the
+ * subordinate id ranges in subuid and subgid, edited in memory.
+ *
+ * accounts_open() takes the password file lock and loads them all; any
+ * number of changes can then be made without another process or file
+ * write. accounts_commit() writes each file that changed exactly once,
+ * atomically, and creates the new home directories. accounts_close()
+ * drops the lock again.
+ */
+struct accounts;
+
+/*
+ * account_user: what useradd would be told about a new user. NULL
+ * strings and -1 take the defaults of login.defs and default/useradd.
+ * - groups: supplementary groups, separated by commas.
+ * - password: already hashed; the account is locked if there is none.
+ * - expiredate: YYYY-MM-DD, or empty for none.
+ * - inactive: days after the password expired until the account is
+ *   disabled, "-1" to never disable it.
+ * - create_home, user_group: 1 or 0 to override the defaults.
+ */
+struct account_user {
+	const gchar* name;
+	const gchar* gecos;
+	const gchar* home;
+	const gchar* shell;
+	const gchar* primary_group;
+	const gchar* groups;
+	const gchar* password;
+	const gchar* expiredate;
+	const gchar* inactive;
+	bool system;
+	int create_home;
+	int user_group;
+};
+
+#define ACCOUNT_USER_INIT { .create_home = -1, .user_group = -1 }
+
+/* lock and load the databases of the system rooted at root, "/" for this one */
+struct accounts* accounts_open(const gchar* root);
+bool accounts_commit(struct accounts* a);
+void accounts_close(struct accounts* a);
+
+bool accounts_has_user(struct accounts* a, const gchar* name);
+bool accounts_add_user(struct accounts* a, const struct account_user* user);
+bool accounts_set_password(struct accounts* a, const gchar* name, const gchar* password);
+bool accounts_lock_password(struct accounts* a, const gchar* name);
+bool accounts_set_expire(struct accounts* a, const gchar* name, long days);
+bool accounts_add_group(struct accounts* a, const gchar* name, bool system);
+bool accounts_add_member(struct accounts* a, const gchar* group, const gchar* user);
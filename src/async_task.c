@@ -32,132 +32,667 @@
  files in the program, then also delete it here.
 ***/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
-#include <sys/sysinfo.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #include "async_task.h"
 #include "lib.h"
 
 #define MOD "async_task: "
 
+/* how often children are looked at when there is no pidfd, in milliseconds */
+#define ASYNC_TASK_POLL_INTERVAL 100
+
+/* ioprio_set(2), which the C library has no header for */
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS 1
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE 3
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+/* critical and normal tasks, the former first; and background tasks */
 static GThreadPool* thread_pool = NULL;
-static GMainLoop* main_loop = NULL;
-static guint tasks = 0;
+static GThreadPool* background_pool = NULL;
+/* threads the pool may have, 0 before async_task_init() and after async_task_finish() */
+static guint max_threads = 0;
+/* order of tasks of the same priority */
+static guint64 pushed = 0;
 
 G_LOCK_DEFINE(thread_pool);
+
+/*
+ * async_task: a function run in a thread of the pool, or a child process,
+ * and the handle to await it with
+ * - pid: the child, 0 for a function; pidfd: readable once the child
+ *   exits, -1 if the kernel has no pidfd_open().
+ * - deadline: when the child is sent the next of async_task_signals,
+ *   signals: how many of them it was sent.
+ * - detached: nobody awaits it, it is freed once done.
+ */
+struct async_task {
+	pid_t pid;
+	int pidfd;
+	gint64 deadline;
+	guint signals;
+	int result;
+	bool done;
+	bool detached;
+};
+
+/* what a child's process group is sent, in this order, once its time is up */
+static const int async_task_signals[] = { SIGTERM, SIGKILL };
+
+/*
+ * the event loop: one thread waiting for every child at once, on their
+ * pidfds, and signalling those that run too long
+ * - loop_fd: the epoll instance; wake_fd: an eventfd in it, written to
+ *   when a child is added or the loop is to stop.
+ * - children: the tasks of children that have not exited yet.
+ * - tasks: tasks not done yet, functions and children alike; what
+ *   async_task_finish() waits for.
+ */
+static GThread* loop_thread = NULL;
+static int loop_fd = -1;
+static int wake_fd = -1;
+static GPtrArray* children = NULL;
+static bool loop_stop = false;
+static guint tasks = 0;
+static GCond tasks_cond;
+
 G_LOCK_DEFINE(tasks);
 
+/*
+ * async_task_group: background jobs of one kind, that must not run at the
+ * same time as each other, like package manager runs
+ * - queue: jobs waiting for the running one; the thread of the running
+ *   job runs them next.
+ * - running: whether a job of the group runs or is queued, what
+ *   async_task_wait() waits for.
+ */
+struct async_task_group {
+	gchar* name;
+	GQueue queue;
+	bool running;
+};
+
+static GHashTable* groups = NULL;
+static guint running_groups = 0;
+static GCond groups_cond;
+
+G_LOCK_DEFINE(groups);
+
 struct async_task_data {
 	GThreadFunc func;
 	gpointer data;
+	enum async_task_priority priority;
+	guint64 order;
+	struct async_task_group* group;
+	struct async_task* task;
 };
 
-static void async_task_callback(GPid pid, gint status, __unused__ gpointer null) {
-	LOG("PID %d ends, exit status %d\n", pid, status);
+/* the scheduling of a thread, to restore after a background task */
+struct async_task_sched {
+	int policy;
+	struct sched_param param;
+	int ioprio;
+};
+
+/*
+ * async_task_idle() - let the calling thread only run and do I/O when
+ * nothing else wants to
+ * - if old is given, what it was before is kept there, and errors logged;
+ *   a forked child passes NULL.
+ */
+static void async_task_idle(struct async_task_sched* old) {
+	struct sched_param param = { .sched_priority = 0 };
+	int ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+
+	if (old) {
+		old->ioprio = -1;
+		if (pthread_getschedparam(pthread_self(), &old->policy, &old->param) != 0) {
+			old->policy = -1;
+		}
+#ifdef SYS_ioprio_get
+		old->ioprio = (int)syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+#endif
+	}
+
+	int r = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	if (r != 0 && old) {
+		LOG(MOD "Cannot set idle CPU scheduling: %s\n", strerror(r));
+	}
+#ifdef SYS_ioprio_set
+	/* 0 is the calling thread; the children it starts inherit it */
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) != 0 && old) {
+		LOG(MOD "Cannot set idle I/O priority: %s\n", strerror(errno));
+	}
+#endif
+}
+
+/* undo async_task_idle(): pool threads run tasks of any priority */
+static void async_task_restore(const struct async_task_sched* old) {
+	if (old->policy >= 0) {
+		(void) pthread_setschedparam(pthread_self(), old->policy, &old->param);
+	}
+#ifdef SYS_ioprio_set
+	if (old->ioprio >= 0) {
+		(void) syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, old->ioprio);
+	}
+#endif
+}
+
+static struct async_task* async_task_new(bool detached) {
+	struct async_task* task = g_malloc0(sizeof(struct async_task));
+	task->pidfd = -1;
+	task->detached = detached;
+
+	G_LOCK(tasks);
+	++tasks;
+	G_UNLOCK(tasks);
 
-	g_spawn_close_pid(pid);
+	return task;
+}
 
+/* mark task done with result, and wake whoever awaits it; tasks is locked */
+static void async_task_done_locked(struct async_task* task, int result) {
+	task->result = result;
+	task->done = true;
 	--tasks;
-	if (0 == tasks) {
-		LOG(MOD "Quit main loop\n");
-		g_main_loop_quit(main_loop);
+	g_cond_broadcast(&tasks_cond);
+	if (task->detached) {
+		g_free(task);
 	}
 }
 
-static void async_task_run_task(struct async_task_data* data, __unused__ gpointer null) {
-	if (data && data->func) {
-		data->func(data->data);
+static void async_task_done(struct async_task* task, int result) {
+	G_LOCK(tasks);
+	async_task_done_locked(task, result);
+	G_UNLOCK(tasks);
+}
+
+/* wait status of pid if it has exited, -2 if it has not, -1 on errors */
+static int async_task_reap(pid_t pid) {
+	int status = 0;
+	pid_t r;
+	while ((r = waitpid(pid, &status, WNOHANG)) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
 	}
+	return r == pid ? status : -2;
+}
 
-	g_free(data);
+/*
+ * async_task_check() - reap the children that exited, and signal those
+ * past their deadline; tasks is locked
+ * - returns how long the loop may wait for one of them, in milliseconds,
+ *   or -1 for as long as it takes.
+ */
+static int async_task_check(void) {
+	gint64 now = g_get_monotonic_time();
+	gint64 wait = -1;
+
+	for (guint i = children->len; i-- > 0;) {
+		struct async_task* child = g_ptr_array_index(children, i);
+		int status = async_task_reap(child->pid);
+		if (status != -2) {
+			LOG(MOD "PID %d ends, exit status %d\n", child->pid, status);
+			g_ptr_array_remove_index_fast(children, i);
+			if (child->pidfd >= 0) {
+				/* which takes it out of loop_fd too */
+				close(child->pidfd);
+			}
+			async_task_done_locked(child, status < 0 ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+			continue;
+		}
+
+		if (child->signals < G_N_ELEMENTS(async_task_signals) && now >= child->deadline) {
+			if (!child->signals) {
+				LOG(MOD "PID %d timed out after %d seconds\n", child->pid, EXEC_TIMEOUT);
+			}
+			/* the whole group: a shell's children don't die with it */
+			(void) kill(-child->pid, async_task_signals[child->signals++]);
+			child->deadline = now + EXEC_KILL_GRACE * G_USEC_PER_SEC;
+		}
+		if (child->signals < G_N_ELEMENTS(async_task_signals)) {
+			gint64 left = (child->deadline - now + 999) / 1000;
+			wait = wait < 0 || left < wait ? left : wait;
+		}
+		if (child->pidfd < 0 && (wait < 0 || wait > ASYNC_TASK_POLL_INTERVAL)) {
+			wait = ASYNC_TASK_POLL_INTERVAL;
+		}
+	}
+	return (int)wait;
 }
 
-bool async_task_init(void) {
-	main_loop = g_main_loop_new(NULL, 0);
-	if (!main_loop) {
-		LOG(MOD "Cannot create a new main loop\n");
-		return false;
+static gpointer async_task_loop(__unused__ gpointer null) {
+	struct epoll_event events[16];
+	guint64 count;
+
+	G_LOCK(tasks);
+	while (!loop_stop) {
+		int wait = async_task_check();
+		G_UNLOCK(tasks);
+
+		if (epoll_wait(loop_fd, events, G_N_ELEMENTS(events), wait) < 0 && errno != EINTR) {
+			LOG(MOD "Cannot wait for events: %s\n", strerror(errno));
+			g_usleep(ASYNC_TASK_POLL_INTERVAL * 1000);
+		}
+		while (read(wake_fd, &count, sizeof(count)) > 0) {
+			/* woken up, whatever for it is looked at next */
+		}
+
+		G_LOCK(tasks);
+	}
+	G_UNLOCK(tasks);
+
+	return NULL;
+}
+
+/* wake the loop up, to look at its children again or to stop; tasks is locked */
+static void async_task_wake(void) {
+	guint64 one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0) {
+		LOG(MOD "Cannot wake the event loop: %s\n", strerror(errno));
+	}
+}
+
+/* start the loop, if it isn't running yet; tasks is locked */
+static bool async_task_loop_start(void) {
+	GError *error = NULL;
+	struct epoll_event event = { .events = EPOLLIN };
+
+	if (loop_thread) {
+		return true;
 	}
 
-	thread_pool = g_thread_pool_new((GFunc)async_task_run_task, NULL, get_nprocs(), true, NULL);
-	if (!thread_pool) {
-		LOG(MOD "Cannot create a new thread pool\n");
-		g_main_loop_unref(main_loop);
-		main_loop = NULL;
-		return false;
+	loop_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	event.data.fd = wake_fd;
+	if (loop_fd < 0 || wake_fd < 0 || epoll_ctl(loop_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0) {
+		LOG(MOD "Cannot create the event loop: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	children = g_ptr_array_new();
+	loop_stop = false;
+	loop_thread = g_thread_try_new("async_task", async_task_loop, NULL, &error);
+	if (!loop_thread) {
+		LOG(MOD "Cannot start the event loop: %s\n", error->message);
+		g_error_free(error);
+		g_ptr_array_free(children, true);
+		children = NULL;
+		goto fail;
 	}
 
 	return true;
+
+fail:
+	if (loop_fd >= 0) {
+		close(loop_fd);
+	}
+	if (wake_fd >= 0) {
+		close(wake_fd);
+	}
+	loop_fd = wake_fd = -1;
+	return false;
 }
 
-bool async_task_run(GThreadFunc func, gpointer data) {
-	GError *error = NULL;
-	struct async_task_data* task_data = g_malloc(sizeof(struct async_task_data));
-	task_data->func = func;
-	task_data->data = data;
+/* the job of group to run after the one that just ended, if any */
+static struct async_task_data* async_task_group_next(struct async_task_group* group) {
+	G_LOCK(groups);
+	struct async_task_data* next = g_queue_pop_head(&group->queue);
+	if (!next) {
+		group->running = false;
+		--running_groups;
+		g_cond_broadcast(&groups_cond);
+	}
+	G_UNLOCK(groups);
+	return next;
+}
+
+static void async_task_run_task(struct async_task_data* data, __unused__ gpointer null) {
+	while (data) {
+		struct async_task_data* next = NULL;
+		struct async_task_sched sched;
+		gpointer result = NULL;
+		if (data->priority == ASYNC_TASK_BACKGROUND) {
+			async_task_idle(&sched);
+		}
+		if (data->func) {
+			result = data->func(data->data);
+		}
+		if (data->priority == ASYNC_TASK_BACKGROUND) {
+			async_task_restore(&sched);
+		}
+		if (data->task) {
+			async_task_done(data->task, GPOINTER_TO_INT(result));
+		}
+		if (data->group) {
+			next = async_task_group_next(data->group);
+		}
+		g_free(data);
+		data = next;
+	}
+}
+
+static void async_task_group_free(gpointer data) {
+	struct async_task_group* group = data;
+	g_free(group->name);
+	g_free(group);
+}
+
+bool async_task_init(guint threads) {
+	/* threads left without tasks go away instead of waiting for more */
+	g_thread_pool_set_max_idle_time(ASYNC_TASK_IDLE_TIME);
 
 	G_LOCK(thread_pool);
-	if (!thread_pool) {
-		LOG(MOD "Error finish task was called and thread pool is null \n");
-		G_UNLOCK(thread_pool);
-		return false;
+	max_threads = threads ? threads : ASYNC_TASK_MAX_THREADS;
+	G_UNLOCK(thread_pool);
+
+	groups = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, async_task_group_free);
+
+	return true;
+}
+
+/* whether async_task_init() was called, and async_task_finish() not yet */
+static bool async_task_running(void) {
+	G_LOCK(thread_pool);
+	bool running = max_threads != 0;
+	G_UNLOCK(thread_pool);
+	return running;
+}
+
+/* queued tasks by priority, then in the order they were pushed */
+static gint async_task_compare(gconstpointer a, gconstpointer b, __unused__ gpointer null) {
+	const struct async_task_data* x = a;
+	const struct async_task_data* y = b;
+
+	if (x->priority != y->priority) {
+		return x->priority < y->priority ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * async_task_push() - hand task_data to a thread of the pool
+ * - the pools are made on first use, and are not exclusive: a thread is
+ *   only started for a task no idle one can take, up to max_threads of
+ *   them; for background tasks, up to ASYNC_TASK_BACKGROUND_THREADS more.
+ * - returns false, and sets error if there was one, if there is no pool.
+ */
+static bool async_task_push(struct async_task_data* task_data, GError** error) {
+	bool background = task_data->priority == ASYNC_TASK_BACKGROUND;
+	GThreadPool** pool = background ? &background_pool : &thread_pool;
+	bool done = false;
+
+	G_LOCK(thread_pool);
+	if (!*pool && max_threads) {
+		gint threads = background ? (gint)MIN(max_threads, ASYNC_TASK_BACKGROUND_THREADS) : (gint)max_threads;
+		*pool = g_thread_pool_new((GFunc)async_task_run_task, NULL, threads, false, error);
+		if (*pool) {
+			g_thread_pool_set_sort_function(*pool, async_task_compare, NULL);
+		}
+	}
+	if (*pool) {
+		task_data->order = pushed++;
+		g_thread_pool_push(*pool, task_data, error);
+		done = !*error;
 	}
-	g_thread_pool_push(thread_pool, task_data, &error);
 	G_UNLOCK(thread_pool);
 
-	if (error) {
-		LOG(MOD "Error pushing a new thread: %s\n", error->message);
-		g_error_free(error);
-		return false;
+	return done;
+}
+
+/* run func(data) in a thread of the pool; a detached task may be gone once this returns */
+static struct async_task* async_task_queue(GThreadFunc func, gpointer data, enum async_task_priority priority, bool detached) {
+	GError *error = NULL;
+	struct async_task* task = async_task_new(detached);
+	struct async_task_data* task_data = g_malloc0(sizeof(struct async_task_data));
+	task_data->func = func;
+	task_data->data = data;
+	task_data->priority = priority;
+	task_data->task = task;
+
+	/* once pushed, task_data is the pool thread's to free */
+	if (!async_task_push(task_data, &error)) {
+		if (error) {
+			LOG(MOD "Error pushing a new thread: %s\n", error->message);
+			g_error_free(error);
+		} else {
+			LOG(MOD "Error finish task was called and thread pool is null \n");
+		}
+		task->detached = true;
+		async_task_done(task, -1);
+		g_free(task_data);
+		return NULL;
 	}
 
+	return task;
+}
+
+bool async_task_run(GThreadFunc func, gpointer data, enum async_task_priority priority) {
+	return async_task_queue(func, data, priority, true) != NULL;
+}
+
+struct async_task* async_task_start(GThreadFunc func, gpointer data, enum async_task_priority priority) {
+	return async_task_queue(func, data, priority, false);
+}
+
+/*
+ * async_task_run_group() - run func(data) in the background, after the
+ * jobs of group name that were started before it
+ * - each job runs at its own priority, in the thread of the first one.
+ * - without a thread pool, func runs right away, in this thread.
+ */
+bool async_task_run_group(const gchar* name, GThreadFunc func, gpointer data, enum async_task_priority priority) {
+	struct async_task_data* task_data = g_malloc0(sizeof(struct async_task_data));
+	task_data->func = func;
+	task_data->data = data;
+	task_data->priority = priority;
+
+	G_LOCK(groups);
+	struct async_task_group* group = groups ? g_hash_table_lookup(groups, name) : NULL;
+	if (!group && groups) {
+		group = g_malloc0(sizeof(struct async_task_group));
+		group->name = g_strdup(name);
+		g_queue_init(&group->queue);
+		g_hash_table_insert(groups, group->name, group);
+	}
+	if (group && group->running) {
+		/* the thread running the group's jobs takes it from here */
+		task_data->group = group;
+		g_queue_push_tail(&group->queue, task_data);
+		G_UNLOCK(groups);
+		return true;
+	}
+	if (group) {
+		task_data->group = group;
+		group->running = true;
+		++running_groups;
+	}
+	G_UNLOCK(groups);
+
+	if (group) {
+		GError *error = NULL;
+		if (async_task_push(task_data, &error)) {
+			LOG(MOD "Started %s job in the background\n", name);
+			return true;
+		}
+		if (error) {
+			LOG(MOD "Error pushing a new thread: %s\n", error->message);
+			g_error_free(error);
+		}
+	}
+
+	/* no pool to run it in; runs now, with whatever was queued after it */
+	async_task_run_task(task_data, NULL);
 	return true;
 }
 
-bool async_task_exec(const gchar* command) {
+void async_task_wait(const gchar* name) {
+	struct async_task_group* group;
+	bool waited = false;
+
+	G_LOCK(groups);
+	/* looked up again after each wakeup: async_task_finish() may free it */
+	while (groups && (group = g_hash_table_lookup(groups, name)) && group->running) {
+		if (!waited) {
+			LOG(MOD "Waiting for %s jobs\n", name);
+			waited = true;
+		}
+		g_cond_wait(&groups_cond, &G_LOCK_NAME(groups));
+	}
+	G_UNLOCK(groups);
+}
+
+/* put the child in a process group of its own, for async_task_check() to signal */
+static void async_task_child_setup(gpointer priority) {
+	(void) setpgid(0, 0);
+	if (GPOINTER_TO_INT(priority) == ASYNC_TASK_BACKGROUND) {
+		async_task_idle(NULL);
+	}
+}
+
+static struct async_task* async_task_child(const gchar* const* argv, enum async_task_priority priority, bool detached) {
 	GPid pid = 0;
 	GError *error = NULL;
-	gchar* command_line = g_strescape(command, NULL);
-	gchar* argvp[] = {SHELL_PATH, "-c", command_line, NULL };
 
-	g_spawn_async(NULL, argvp, NULL,
-	              G_SPAWN_DO_NOT_REAP_CHILD,
-				  NULL, NULL, &pid, &error);
+	if (!async_task_running()) {
+		LOG(MOD "Error finish task was called, cannot run %s\n", argv[0]);
+		return NULL;
+	}
 
+	G_LOCK(tasks);
+	bool started = async_task_loop_start();
+	G_UNLOCK(tasks);
+	if (!started) {
+		return NULL;
+	}
+
+	g_spawn_async(NULL, (gchar**)argv, NULL,
+	              G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
+	              async_task_child_setup, GINT_TO_POINTER(priority), &pid, &error);
 	if (error) {
 		LOG(MOD "Error running async command: %s\n", error->message);
 		g_error_free(error);
-		g_free(command_line);
-		return false;
+		return NULL;
+	}
+
+	gchar* command_line = g_strjoinv(" ", (gchar**)argv);
+	LOG(MOD "Executing [%d]: %s\n", pid, command_line);
+	g_free(command_line);
+
+	struct async_task* task = async_task_new(detached);
+	task->pid = pid;
+	/* the same limit as exec_task(): no command holds up the boot forever */
+	task->deadline = g_get_monotonic_time() + (gint64)EXEC_TIMEOUT * G_USEC_PER_SEC;
+#ifdef SYS_pidfd_open
+	task->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+	G_LOCK(tasks);
+	if (task->pidfd >= 0) {
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = task->pidfd };
+		if (epoll_ctl(loop_fd, EPOLL_CTL_ADD, task->pidfd, &event) != 0) {
+			close(task->pidfd);
+			task->pidfd = -1;
+		}
 	}
+	g_ptr_array_add(children, task);
+	async_task_wake();
+	G_UNLOCK(tasks);
 
-	g_child_watch_add(pid, async_task_callback, NULL);
+	return task;
+}
 
-	LOG(MOD "Executing [%d]: %s -c \"%s\"\n", pid, SHELL_PATH, command_line);
+struct async_task* async_task_spawn(const gchar* const* argv, enum async_task_priority priority) {
+	return async_task_child(argv, priority, false);
+}
+
+bool async_task_exec(const gchar* command, enum async_task_priority priority) {
+	gchar* command_line = g_strescape(command, NULL);
+	const gchar* argvp[] = { SHELL_PATH, "-c", command_line, NULL };
+
+	bool started = async_task_child(argvp, priority, true) != NULL;
 
 	g_free(command_line);
+	return started;
+}
 
+int async_task_await(struct async_task* task) {
 	G_LOCK(tasks);
-	++tasks;
+	while (!task->done) {
+		g_cond_wait(&tasks_cond, &G_LOCK_NAME(tasks));
+	}
 	G_UNLOCK(tasks);
 
-	return true;
+	int result = task->result;
+	g_free(task);
+	return result;
 }
 
 void async_task_finish(void) {
-	G_LOCK(thread_pool);
-	g_thread_pool_free(thread_pool, false, true);
-	thread_pool = NULL;
-	G_UNLOCK(thread_pool);
+	/* group jobs first, queued ones included; any started later run right away */
+	G_LOCK(groups);
+	while (running_groups) {
+		g_cond_wait(&groups_cond, &G_LOCK_NAME(groups));
+	}
+	if (groups) {
+		g_hash_table_destroy(groups);
+		groups = NULL;
+	}
+	G_UNLOCK(groups);
 
+	/* the final join: every task and child ends before the loop and pool go away */
 	G_LOCK(tasks);
 	if (tasks) {
-		LOG(MOD "Running main loop\n");
-		g_main_loop_run(main_loop);
+		LOG(MOD "Waiting for %u tasks\n", tasks);
+		while (tasks) {
+			g_cond_wait(&tasks_cond, &G_LOCK_NAME(tasks));
+		}
+	}
+	GThread* thread = loop_thread;
+	if (thread) {
+		loop_stop = true;
+		async_task_wake();
 	}
-	tasks = 0;
+	loop_thread = NULL;
 	G_UNLOCK(tasks);
 
-	g_main_loop_unref(main_loop);
-	main_loop = NULL;
+	if (thread) {
+		g_thread_join(thread);
+		close(loop_fd);
+		close(wake_fd);
+		loop_fd = wake_fd = -1;
+		g_ptr_array_free(children, true);
+		children = NULL;
+	}
+
+	G_LOCK(thread_pool);
+	if (thread_pool) {
+		g_thread_pool_free(thread_pool, false, true);
+		thread_pool = NULL;
+	}
+	if (background_pool) {
+		g_thread_pool_free(background_pool, false, true);
+		background_pool = NULL;
+	}
+	max_threads = 0;
+	G_UNLOCK(thread_pool);
 }
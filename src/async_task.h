@@ -39,7 +39,39 @@
 
 #include <glib.h>
 
-bool async_task_init(void);
-bool async_task_run(GThreadFunc func, gpointer data);
-bool async_task_exec(const gchar* command);
+/* threads run tasks in parallel, up to --max-threads */
+#define ASYNC_TASK_MAX_THREADS 8
+/* milliseconds a thread is kept around without tasks to run */
+#define ASYNC_TASK_IDLE_TIME 1000
+
+/* background tasks have threads of their own, at most this many */
+#define ASYNC_TASK_BACKGROUND_THREADS 2
+
+/*
+ * async_task_priority: what a task is queued behind
+ * - critical: what logging in needs, e.g. ssh keys, hostname and users.
+ * - background: bulk work, e.g. a filesystem resize or a package upgrade;
+ *   it has threads of its own, and only gets the CPU and disk when
+ *   nothing else wants them.
+ */
+enum async_task_priority {
+	ASYNC_TASK_CRITICAL,
+	ASYNC_TASK_NORMAL,
+	ASYNC_TASK_BACKGROUND
+};
+
+/* a function or command run in the background, see async_task_await() */
+struct async_task;
+
+bool async_task_init(guint max_threads);
+bool async_task_run(GThreadFunc func, gpointer data, enum async_task_priority priority);
+bool async_task_exec(const gchar* command, enum async_task_priority priority);
+/* like async_task_run() and async_task_exec(argv), but to be awaited */
+struct async_task* async_task_start(GThreadFunc func, gpointer data, enum async_task_priority priority);
+struct async_task* async_task_spawn(const gchar* const* argv, enum async_task_priority priority);
+/* wait until task is done, free it and return its result or exit status */
+int async_task_await(struct async_task* task);
+bool async_task_run_group(const gchar* name, GThreadFunc func, gpointer data, enum async_task_priority priority);
+/* wait until all jobs of group name started so far have ended */
+void async_task_wait(const gchar* name);
 void async_task_finish(void);
@@ -39,40 +39,52 @@
 
 #include "handlers.h"
 #include "cloud_config.h"
+#include "accounts.h"
 #include "lib.h"
 
 #define MOD "groups: "
-#define COMMAND_SIZE 256
 
-static void groups_item(GNode* node, gpointer data) {
-	gchar command_groupadd[COMMAND_SIZE];
-	gchar command_usermod[COMMAND_SIZE];
+struct groups_data {
+	struct accounts* accounts;
+	const gchar* group;
+};
 
+static void groups_item(GNode* node, gpointer data) {
+	struct groups_data* d = data;
 	if (!node->data) {
 		/* null placeholder */
 		g_node_children_foreach(node, G_TRAVERSE_ALL,
 			groups_item, data);
-	} else if (!data) {
+	} else if (!d->group) {
 		/* add new group */
 		LOG(MOD "Adding %s group...\n", (char*)node->data);
-		g_snprintf(command_groupadd, COMMAND_SIZE, GROUPADD_PATH " -f '%s'",
-			(char*)node->data);
-		exec_task(command_groupadd);
+		accounts_add_group(d->accounts, node->data, false);
+		d->group = node->data;
 		g_node_children_foreach(node, G_TRAVERSE_ALL,
-			groups_item, node->data);
+			groups_item, data);
+		d->group = NULL;
 	} else {
 		/* add user to new group */
-		LOG(MOD "Adding %s to %s group...\n", (char*)node->data, (char*)data);
-		g_snprintf(command_usermod, COMMAND_SIZE, USERMOD_PATH " -a -G  '%s' '%s'",
-			(char*)data, (char*)node->data);
-		exec_task(command_usermod);
+		LOG(MOD "Adding %s to %s group...\n", (char*)node->data, d->group);
+		accounts_add_member(d->accounts, d->group, node->data);
 	}
 }
 
 void groups_handler(GNode *node) {
+	struct groups_data data = { 0 };
+
 	LOG(MOD "Groups Handler running...\n");
+	data.accounts = accounts_open("/");
+	if (!data.accounts) {
+		LOG(MOD "Cannot open the account files\n");
+		return;
+	}
 	g_node_children_foreach(node, G_TRAVERSE_ALL,
-		groups_item, NULL);
+		groups_item, &data);
+	if (!accounts_commit(data.accounts)) {
+		LOG(MOD "Cannot write the account files\n");
+	}
+	accounts_close(data.accounts);
 }
 
 struct cc_module_handler_struct groups_cc_module = {
@@ -42,9 +42,9 @@
 #define MOD "hostname: "
 
 static gboolean hostname_item(GNode *node, __unused__ gpointer data) {
-	gchar command[LINE_MAX];
-	g_snprintf(command, LINE_MAX, HOSTNAMECTL_PATH " set-hostname '%s'", (char*)node->data);
-	exec_task(command);
+	if (!set_hostname(node->data, "/")) {
+		LOG(MOD "Cannot set hostname %s\n", (char*)node->data);
+	}
 	return true;
 }
 
@@ -39,12 +39,33 @@
 
 #include "handlers.h"
 #include "cloud_config.h"
+#include "async_task.h"
 #include "lib.h"
 
 extern void wait_for_network(void);
 
 #define MOD "package_upgrade: "
 
+/* whether the user data asked for an update, see package_upgrade_finish() */
+static bool package_upgrade_requested = false;
+
+/* with no deadline, as for the installs of the packages module */
+static gpointer package_upgrade_run(__unused__ gpointer data) {
+	wait_for_network();
+#if defined(PACKAGE_MANAGER_SWUPD)
+	exec_task_limits("/usr/bin/swupd update", &exec_no_limits);
+#elif defined(PACKAGE_MANAGER_YUM)
+	exec_task_limits("/usr/bin/yum update", &exec_no_limits);
+#elif defined(PACKAGE_MANAGER_DNF)
+	exec_task_limits("/usr/bin/dnf update --refresh", &exec_no_limits);
+#elif defined(PACKAGE_MANAGER_APT)
+	exec_task_limits("/usr/bin/apt-get upgrade", &exec_no_limits);
+#elif defined(PACKAGE_MANAGER_TDNF)
+	exec_task_limits("/usr/bin/tdnf update --refresh --assumeyes", &exec_no_limits);
+#endif
+	return NULL;
+}
+
 void package_upgrade_handler(GNode *node) {
 	bool do_upgrade;
 
@@ -59,25 +80,27 @@ void package_upgrade_handler(GNode *node) {
 	}
 	if (do_upgrade) {
 		LOG(MOD "Performing system software update.\n");
-		wait_for_network();
-#if defined(PACKAGE_MANAGER_SWUPD)
-		exec_task("/usr/bin/swupd update");
-#elif defined(PACKAGE_MANAGER_YUM)
-		exec_task("/usr/bin/yum update");
-#elif defined(PACKAGE_MANAGER_DNF)
-		exec_task("/usr/bin/dnf update --refresh");
-#elif defined(PACKAGE_MANAGER_APT)
-		exec_task("/usr/bin/apt-get upgrade");
-#elif defined(PACKAGE_MANAGER_TDNF)
-		exec_task("/usr/bin/tdnf update --refresh --assumeyes");
-#endif
+		package_upgrade_requested = true;
 	} else {
 		LOG(MOD "Skipping system software update.\n");
 	}
 }
 
+/*
+ * the update is queued once all of the user data was applied: after the
+ * installs of the packages module, whatever the order of the blocks, and
+ * once runcmd and service are done waiting for those
+ */
+static void package_upgrade_finish(void) {
+	if (package_upgrade_requested) {
+		package_upgrade_requested = false;
+		async_task_run_group(PACKAGES_TASKS, package_upgrade_run, NULL, ASYNC_TASK_BACKGROUND);
+	}
+}
+
 struct cc_module_handler_struct package_upgrade_cc_module = {
 	.name = "package_upgrade",
-	.handler = &package_upgrade_handler
+	.handler = &package_upgrade_handler,
+	.finish = &package_upgrade_finish
 };
 
@@ -39,41 +39,102 @@
 
 #include "handlers.h"
 #include "cloud_config.h"
+#include "async_task.h"
 #include "lib.h"
 
 extern void wait_for_network(void);
 
 #define MOD "packages: "
-#define COMMAND_SIZE 256
 
-static gboolean packages_item(GNode* node, __unused__ gpointer data) {
-	gchar command[COMMAND_SIZE];
-	g_snprintf(command, COMMAND_SIZE,
+/* the package manager command that the packages to install are added to */
+static const gchar* packages_install_command[] = {
 #if defined(PACKAGE_MANAGER_SWUPD)
-		"/usr/bin/swupd bundle-add %s",
+	"/usr/bin/swupd", "bundle-add",
 #elif defined(PACKAGE_MANAGER_YUM)
-		"/usr/bin/yum --assumeyes install %s",
+	"/usr/bin/yum", "--assumeyes", "install",
 #elif defined(PACKAGE_MANAGER_DNF)
-		"/usr/bin/dnf install %s",
+	"/usr/bin/dnf", "install",
 #elif defined(PACKAGE_MANAGER_APT)
-		"/usr/bin/apt-get install %s",
+	"/usr/bin/apt-get", "install",
 #elif defined(PACKAGE_MANAGER_TDNF)
-		"/usr/bin/tdnf --assumeyes install %s",
+	"/usr/bin/tdnf", "--assumeyes", "install",
 #endif
-		(char*)node->data);
-	wait_for_network();
-	LOG(MOD "Installing %s..\n", (char*)node->data);
-	exec_task(command);
+	NULL
+};
+
+static gboolean packages_item(GNode* node, gpointer data) {
+	/* a leaf may name several packages, separated by spaces */
+	gchar** names = g_strsplit_set(node->data, " \t", -1);
+	for (gchar** name = names; *name; name++) {
+		if (**name) {
+			g_ptr_array_add(data, g_strdup(*name));
+		}
+	}
+	g_strfreev(names);
 	return false;
 }
 
+/* install count packages starting at names in one package manager run */
+static bool packages_install(gchar** names, guint count) {
+	GPtrArray* argv = g_ptr_array_new();
+	bool result;
+
+	for (const gchar** arg = packages_install_command; *arg; arg++) {
+		g_ptr_array_add(argv, (gpointer)*arg);
+	}
+	for (guint i = 0; i < count; i++) {
+		g_ptr_array_add(argv, names[i]);
+	}
+	g_ptr_array_add(argv, NULL);
+
+	/* no deadline: a package manager killed mid-transaction may leave its database broken */
+	result = exec_task_argv_limits((const gchar* const*)argv->pdata, &exec_no_limits);
+	g_ptr_array_free(argv, true);
+	return result;
+}
+
+/* install the packages, in the background, then free them */
+static gpointer packages_install_all(GPtrArray* packages) {
+	gchar** names = (gchar**)packages->pdata;
+
+	wait_for_network();
+
+	/*
+	 * one transaction for all of them pays for the package manager's
+	 * start, metadata and lock only once; only if it fails are the
+	 * packages installed one by one, to find out which one can't be.
+	 */
+	LOG(MOD "Installing %u packages..\n", packages->len);
+	if (!packages_install(names, packages->len) && packages->len > 1) {
+		LOG(MOD "Installing the packages one by one..\n");
+		for (guint i = 0; i < packages->len; i++) {
+			LOG(MOD "Installing %s..\n", names[i]);
+			if (!packages_install(&names[i], 1)) {
+				LOG(MOD "Cannot install %s\n", names[i]);
+			}
+		}
+	}
+
+	g_ptr_array_free(packages, true);
+	return NULL;
+}
+
 void packages_handler(GNode *node) {
+	GPtrArray* packages = g_ptr_array_new_with_free_func(g_free);
+
 	LOG(MOD "Packages Handler running...\n");
 	/*
 	 * due to node possibly being a list of lists, just ignore all
 	 * non-leave nodes.
 	 */
-	g_node_traverse(node, G_IN_ORDER, G_TRAVERSE_LEAVES, -1, packages_item, NULL);
+	g_node_traverse(node, G_IN_ORDER, G_TRAVERSE_LEAVES, -1, packages_item, packages);
+	if (packages->len == 0) {
+		g_ptr_array_free(packages, true);
+		return;
+	}
+
+	/* the modules after this one don't wait, unless they need the packages */
+	async_task_run_group(PACKAGES_TASKS, (GThreadFunc)packages_install_all, packages, ASYNC_TASK_NORMAL);
 }
 
 struct cc_module_handler_struct packages_cc_module = {
@@ -36,13 +36,92 @@
 
 #include <glib.h>
 
+#include "cloud_config.h"
 #include "lib.h"
 #include "handlers.h"
+#include "async_task.h"
 
 #define MOD "runcmd: "
 
+/*
+ * runcmd_number() - read the whole number at path under node into *n
+ * - with size, a K, M or G suffix multiplies it by 1024, 1024² or 1024³.
+ * - anything else, zero, or more than max is logged and left out: *n
+ *   keeps what it had.
+ */
+static void runcmd_number(GNode* node, gchar** path, bool size, guint64 max, guint64* n) {
+	GNode* value = cloud_config_find(node, path);
+	gchar* end = NULL;
+	guint shift = 0;
+
+	if (!value || !value->data) {
+		return;
+	}
+	const gchar* data = value->data;
+	guint64 number = g_ascii_isdigit(*data) ? g_ascii_strtoull(data, &end, 10) : 0;
+	if (number && size && *end) {
+		switch (g_ascii_toupper(*end)) {
+		case 'K':
+			shift = 10;
+			end++;
+			break;
+		case 'M':
+			shift = 20;
+			end++;
+			break;
+		case 'G':
+			shift = 30;
+			end++;
+			break;
+		}
+	}
+	if (!number || *end || number > (max >> shift)) {
+		LOG(MOD "Invalid %s '%s', ignored\n", path[0], data);
+		return;
+	}
+	*n = number << shift;
+}
+
+static gboolean runcmd_word(GNode* node, gpointer command_line) {
+	g_string_append_printf((GString*)command_line, "%s ", (char*)node->data);
+	return false;
+}
+
+/*
+ * runcmd_limited() - run an item with limits:
+ *   - command: <string or list, as for other items>
+ *     timeout: <seconds, EXEC_TIMEOUT if not given>
+ *     cpu: <seconds of CPU time>
+ *     memory: <bytes of address space, K, M or G suffix allowed>
+ */
+static void runcmd_limited(GNode* node, GNode* command, GString* command_line) {
+	CLOUD_CONFIG_KEY(TIMEOUT, "timeout");
+	CLOUD_CONFIG_KEY(CPU, "cpu");
+	CLOUD_CONFIG_KEY(MEMORY, "memory");
+	struct exec_limits limits = { .timeout = EXEC_TIMEOUT };
+	guint64 timeout = EXEC_TIMEOUT;
+
+	runcmd_number(node, TIMEOUT, false, G_MAXUINT, &timeout);
+	limits.timeout = (guint)timeout;
+	runcmd_number(node, CPU, false, G_MAXUINT, &limits.cpu);
+	runcmd_number(node, MEMORY, true, G_MAXINT64, &limits.memory);
+
+	g_node_traverse(command, G_IN_ORDER, G_TRAVERSE_LEAVES, -1, runcmd_word, command_line);
+	if (!exec_task_limits(command_line->str, &limits)) {
+		LOG(MOD "Execute command failed\n");
+	}
+	g_string_set_size(command_line, 0);
+}
+
 static void runcmd_item(GNode* node, gpointer command_line) {
+	CLOUD_CONFIG_KEY(COMMAND, "command");
+
 	if (!node->data) {
+		GNode* command = cloud_config_find(node, COMMAND);
+		if (command) {
+			runcmd_limited(node, command->parent, command_line);
+			return;
+		}
 		g_node_children_foreach(node, G_TRAVERSE_ALL, runcmd_item, command_line);
 		if (!exec_task(((GString*)command_line)->str)) {
 			LOG(MOD "Execute command failed\n");
@@ -56,6 +135,8 @@ static void runcmd_item(GNode* node, gpointer command_line) {
 void runcmd_handler(GNode *node) {
 	GString* command_line = g_string_new("");
 	LOG(MOD "runcmd handler running...\n");
+	/* commands may well use what the packages module installs */
+	async_task_wait(PACKAGES_TASKS);
 	g_node_children_foreach(node, G_TRAVERSE_ALL, runcmd_item, command_line);
 	g_string_free(command_line, true);
 }
@@ -37,19 +37,35 @@
 #include <glib.h>
 
 #include "handlers.h"
+#include "async_task.h"
 #include "lib.h"
 
 #define MOD "service: "
-#define COMMAND_SIZE 2048
 
 
-static gboolean service_action(GNode* node, gpointer data) {
-	gchar c[COMMAND_SIZE];
-	g_snprintf(c, COMMAND_SIZE, SYSTEMCTL_PATH " %s %s", (char*)data, (char*)node->data);
-	exec_task(c);
+/* the units of an action, appended to units */
+static gboolean service_unit(GNode* node, gpointer units) {
+	g_ptr_array_add(units, node->data);
 	return false;
 }
 
+/* run systemctl action for count units starting at units */
+static bool service_run(const gchar* action, gchar** units, guint count) {
+	GPtrArray* argv = g_ptr_array_new();
+	bool result;
+
+	g_ptr_array_add(argv, SYSTEMCTL_PATH);
+	g_ptr_array_add(argv, (gpointer)action);
+	for (guint i = 0; i < count; i++) {
+		g_ptr_array_add(argv, units[i]);
+	}
+	g_ptr_array_add(argv, NULL);
+
+	result = exec_task_argv((const gchar* const*)argv->pdata);
+	g_ptr_array_free(argv, true);
+	return result;
+}
+
 static void service_item(GNode* node, __unused__ gpointer data) {
 	if (!node->data) {
 		node = node->children;
@@ -75,11 +91,30 @@ static void service_item(GNode* node, __unused__ gpointer data) {
 		return;
 	}
 
-	g_node_traverse(node, G_IN_ORDER, G_TRAVERSE_LEAVES, -1, service_action, node->data);
+	GPtrArray* units = g_ptr_array_new();
+	g_node_traverse(node, G_IN_ORDER, G_TRAVERSE_LEAVES, -1, service_unit, units);
+	gchar** names = (gchar**)units->pdata;
+
+	/*
+	 * one systemctl for all units reloads the daemon once for enable or
+	 * mask; but one missing unit fails them all, so then they are acted
+	 * on one by one, as they are for isolate, which takes a single unit
+	 */
+	if (g_strcmp0(node->data, "isolate") == 0 || units->len == 1 ||
+	    !service_run(node->data, names, units->len)) {
+		for (guint i = 0; i < units->len; i++) {
+			if (!service_run(node->data, &names[i], 1)) {
+				LOG(MOD "service action %s failed for %s\n", (char*)node->data, names[i]);
+			}
+		}
+	}
+	g_ptr_array_free(units, true);
 }
 
 void service_handler(GNode *node) {
 	LOG(MOD "Service Handler running...\n");
+	/* the units may come with the packages being installed */
+	async_task_wait(PACKAGES_TASKS);
 	g_node_children_foreach(node, G_TRAVERSE_ALL, service_item, NULL);
 }
 
@@ -39,89 +39,100 @@
 
 #include "handlers.h"
 #include "cloud_config.h"
+#include "accounts.h"
 #include "lib.h"
 
 #define MOD "users: "
 
-static void users_add_username(GNode* node, GString* command, gpointer format);
-static void users_add_groups(GNode* node, GString* command, gpointer data);
-static void users_add_option_format(GNode* node, GString* command, gpointer format);
-static void users_add_option(GNode* node, GString* command, gpointer data);
+/* a user as described by its cloud-config item */
+struct users_user {
+	struct account_user account;
+	GString* groups;
+};
+
+static void users_add_username(GNode* node, struct users_user* user, gpointer data);
+static void users_add_groups(GNode* node, struct users_user* user, gpointer data);
+static void users_add_option_string(GNode* node, struct users_user* user, gpointer offset);
+static void users_add_option_negated(GNode* node, struct users_user* user, gpointer offset);
+static void users_add_system(GNode* node, struct users_user* user, gpointer data);
 static gboolean users_sudo_item(GNode* node, gpointer data);
 static gboolean users_ssh_key_item(GNode* node, gpointer data);
 
 struct users_options_data {
 	const gchar* key;
-	void (*func)(GNode* node, GString* command, gpointer data);
+	void (*func)(GNode* node, struct users_user* user, gpointer data);
 	gpointer data;
 };
 
+#define USER_FIELD(field) GSIZE_TO_POINTER(G_STRUCT_OFFSET(struct account_user, field))
+
 static gchar users_current_username[LOGIN_NAME_MAX];
 
 static struct users_options_data users_options[] = {
-	{"name",                users_add_username,         " '%s' "    },
-	{"gecos",               users_add_option_format,    " -c '%s' " },
-	{"homedir",             users_add_option_format,    " -d '%s' " },
-	{"primary-group",       users_add_option_format,    " -g '%s' " },
-	{"groups",              users_add_groups,           NULL        },
-	{"lock-passwd",         NULL,                       NULL        },
-	{"inactive",            NULL,                       NULL        },
-	{"passwd",              users_add_option_format,    " -p '%s' " },
-	{"no-create-home",      users_add_option,           " -M , -m " },
-	{"no-user-group",       users_add_option,           " -N , -U " },
-	{"no-log-init",         users_add_option,           " -l ,"     },
-	{"expiredate",          users_add_option_format,    " -e '%s' " },
-	{"ssh-authorized-keys", NULL,                       NULL        },
-	{"sudo",                NULL,                       NULL        },
-	{"system",              users_add_option_format,    " -r "      },
+	{"name",                users_add_username,         NULL                       },
+	{"gecos",               users_add_option_string,    USER_FIELD(gecos)          },
+	{"homedir",             users_add_option_string,    USER_FIELD(home)           },
+	{"primary-group",       users_add_option_string,    USER_FIELD(primary_group)  },
+	{"groups",              users_add_groups,           NULL                       },
+	{"lock-passwd",         NULL,                       NULL                       },
+	{"inactive",            NULL,                       NULL                       },
+	{"passwd",              users_add_option_string,    USER_FIELD(password)       },
+	{"no-create-home",      users_add_option_negated,   USER_FIELD(create_home)    },
+	{"no-user-group",       users_add_option_negated,   USER_FIELD(user_group)     },
+	/* no lastlog or faillog entries are written in the first place */
+	{"no-log-init",         NULL,                       NULL                       },
+	{"expiredate",          users_add_option_string,    USER_FIELD(expiredate)     },
+	{"ssh-authorized-keys", NULL,                       NULL                       },
+	{"sudo",                NULL,                       NULL                       },
+	{"system",              users_add_system,           NULL                       },
 	{NULL}
 };
 
-static void users_add_username(GNode* node, GString* command, gpointer format) {
-	g_string_append_printf(command, format, node->data);
-
-	g_strlcpy(users_current_username, node->data, LOGIN_NAME_MAX);
+static void users_set_username(const gchar* name) {
+	g_strlcpy(users_current_username, name, LOGIN_NAME_MAX);
 
 	if (!cloud_config_get_global("first_user")) {
 		cloud_config_set_global("first_user", users_current_username);
 	}
 }
 
-static void users_add_groups(GNode* node, GString* command, __unused__ gpointer data) {
+static void users_add_username(GNode* node, struct users_user* user, __unused__ gpointer data) {
+	user->account.name = node->data;
+	users_set_username(node->data);
+}
+
+static void users_add_groups(GNode* node, struct users_user* user, __unused__ gpointer data) {
 	GNode* group;
 	if (node->data) {
-		users_add_option_format(node, command, " -G '%s' ");
+		g_string_assign(user->groups, node->data);
 	} else if (node->children) {
-		g_string_append(command, " -G '");
+		g_string_truncate(user->groups, 0);
 		for(group=node->children; group; group=group->next) {
-			g_string_append(command, group->data);
-			g_string_append(command, ",");
+			g_string_append(user->groups, group->data);
+			g_string_append(user->groups, ",");
 		}
-		/* remove last , and add '*/
-		g_string_truncate(command, command->len-1);
-		g_string_append(command, "' ");
+		/* remove last , */
+		g_string_truncate(user->groups, user->groups->len-1);
 	}
+	user->account.groups = user->groups->str;
 }
 
-static void users_add_option_format(GNode* node, GString* command, gpointer format) {
-	g_string_append_printf(command, format, node->data);
+static void users_add_option_string(GNode* node, struct users_user* user, gpointer offset) {
+	G_STRUCT_MEMBER(const gchar*, &user->account, GPOINTER_TO_SIZE(offset)) = node->data;
 }
 
-static void users_add_option(GNode* node, GString* command, gpointer data) {
+static void users_add_option_negated(GNode* node, struct users_user* user, gpointer offset) {
 	bool b;
-	gchar** tokens = g_strsplit(data, ",", 2);
-	guint len = g_strv_length(tokens);
-	cloud_config_bool(node, &b);
-	if (b) {
-		if (len > 0) {
-			g_string_append(command, tokens[0]);
-		}
-	} else {
-		if (len > 1) {
-			g_string_append(command, tokens[1]);
-		}
+	if (cloud_config_bool(node, &b)) {
+		G_STRUCT_MEMBER(int, &user->account, GPOINTER_TO_SIZE(offset)) = !b;
+	}
+}
+
+static void users_add_system(GNode* node, struct users_user* user, __unused__ gpointer data) {
+	bool b;
+	if (cloud_config_bool(node, &b)) {
+		user->account.system = b;
 	}
-	g_strfreev(tokens);
 }
 
 static gboolean users_sudo_item(GNode* node, gpointer data) {
@@ -135,102 +146,132 @@ static gboolean users_ssh_key_item(GNode* node, gpointer data) {
 	return false;
 }
 
-static void users_item(GNode* node, gpointer data) {
-	if (node->data) {
-		/* to avoid bugs with key(gecos, etc) as username */
-		if (node->children) {
-			for (size_t i = 0; users_options[i].key != NULL; ++i) {
-				if (0 == g_strcmp0(node->data, users_options[i].key)) {
-					if (users_options[i].func) {
-						users_options[i].func(node->children, data,
-							users_options[i].data);
-					}
-					return;
+static void users_option(GNode* node, gpointer data) {
+	/* to avoid bugs with key(gecos, etc) as username */
+	if (node->data && node->children) {
+		for (size_t i = 0; users_options[i].key != NULL; ++i) {
+			if (0 == g_strcmp0(node->data, users_options[i].key)) {
+				if (users_options[i].func) {
+					users_options[i].func(node->children, data,
+						users_options[i].data);
 				}
+				return;
 			}
-			LOG(MOD "No handler for %s.\n", (char*)node->data);
-			return;
-		}
-		users_add_username(node, data, "%s");
-	} else {
-		bool b;
-		GString* sudo_directives;
-		GString* ssh_keys;
-		GString* command = g_string_new(USERADD_PATH " ");
-		memset(users_current_username, 0, LOGIN_NAME_MAX);
-		g_node_children_foreach(node, G_TRAVERSE_ALL, users_item, command);
-		if (0 == strlen(users_current_username)) {
-			LOG(MOD "Missing username.\n");
-			return;
 		}
+		LOG(MOD "No handler for %s.\n", (char*)node->data);
+	}
+}
 
-		LOG(MOD "Adding %s user...\n", users_current_username);
-		exec_task(command->str);
-
-		CLOUD_CONFIG_KEY(LOCK_PASSWD, "lock-passwd");
-		CLOUD_CONFIG_KEY(INACTIVE, "inactive");
-		CLOUD_CONFIG_KEY(SSH_AUTH_KEYS, "ssh-authorized-keys");
-		CLOUD_CONFIG_KEY(SUDO, "sudo");
-
-		GNode *item = cloud_config_find(node, LOCK_PASSWD);
-		if (item) {
-			cloud_config_bool(item, &b);
-			if (b) {
-				LOG(MOD "Locking %s user.\n", users_current_username);
-				g_string_printf(command, PASSWD_PATH " -l '%s'",
-					users_current_username);
-				exec_task(command->str);
-			}
+/*
+ * users_add_item() - add the user of one item to the account databases
+ * - nothing is written until all users were added; the ssh keys and sudo
+ *   rules of users_access_item() need the users to be on disk.
+ */
+static void users_add_item(GNode* node, gpointer data) {
+	struct accounts* accounts = data;
+	struct users_user user = { .account = ACCOUNT_USER_INIT };
+	bool b;
+
+	if (node->data) {
+		users_set_username(node->data);
+		return;
+	}
+
+	memset(users_current_username, 0, LOGIN_NAME_MAX);
+	user.groups = g_string_new("");
+	g_node_children_foreach(node, G_TRAVERSE_ALL, users_option, &user);
+	if (0 == strlen(users_current_username)) {
+		LOG(MOD "Missing username.\n");
+		g_string_free(user.groups, true);
+		return;
+	}
+
+	LOG(MOD "Adding %s user...\n", users_current_username);
+	accounts_add_user(accounts, &user.account);
+	g_string_free(user.groups, true);
+
+	CLOUD_CONFIG_KEY(LOCK_PASSWD, "lock-passwd");
+	CLOUD_CONFIG_KEY(INACTIVE, "inactive");
+
+	GNode *item = cloud_config_find(node, LOCK_PASSWD);
+	if (item) {
+		cloud_config_bool(item, &b);
+		if (b) {
+			LOG(MOD "Locking %s user.\n", users_current_username);
+			accounts_lock_password(accounts, users_current_username);
 		}
+	}
 
-		item = cloud_config_find(node, INACTIVE);
-		if (item) {
-			cloud_config_bool(item, &b);
-			if (b) {
-				LOG(MOD "Deactivating %s user...\n", users_current_username);
-				g_string_printf(command, USERMOD_PATH " --expiredate 1 '%s'",
-					users_current_username);
-				exec_task(command->str);
-			}
+	item = cloud_config_find(node, INACTIVE);
+	if (item) {
+		cloud_config_bool(item, &b);
+		if (b) {
+			LOG(MOD "Deactivating %s user...\n", users_current_username);
+			accounts_set_expire(accounts, users_current_username, 1);
 		}
+	}
+}
 
-		g_string_free(command, true);
+static void users_access_item(GNode* node, __unused__ gpointer data) {
+	GString* sudo_directives;
+	GString* ssh_keys;
 
-		item = cloud_config_find(node, SSH_AUTH_KEYS);
-		if (item) {
-			ssh_keys = g_string_new("");
-			g_node_traverse(item->parent, G_IN_ORDER, G_TRAVERSE_LEAVES,
-				-1, users_ssh_key_item, ssh_keys);
-			if (!write_ssh_keys(ssh_keys, users_current_username)) {
-				LOG(MOD "Cannot write ssh keys\n");
-			}
-			g_string_free(ssh_keys, true);
+	CLOUD_CONFIG_KEY(NAME, "name");
+	CLOUD_CONFIG_KEY(SSH_AUTH_KEYS, "ssh-authorized-keys");
+	CLOUD_CONFIG_KEY(SUDO, "sudo");
+
+	GNode *item = node->data ? NULL : cloud_config_find(node, NAME);
+	if (!item || !item->data) {
+		return;
+	}
+	g_strlcpy(users_current_username, item->data, LOGIN_NAME_MAX);
+
+	item = cloud_config_find(node, SSH_AUTH_KEYS);
+	if (item) {
+		ssh_keys = g_string_new("");
+		g_node_traverse(item->parent, G_IN_ORDER, G_TRAVERSE_LEAVES,
+			-1, users_ssh_key_item, ssh_keys);
+		if (!write_ssh_keys(ssh_keys, users_current_username)) {
+			LOG(MOD "Cannot write ssh keys\n");
 		}
+		g_string_free(ssh_keys, true);
+	}
 
-		item = cloud_config_find(node, SUDO);
-		if (item) {
-			sudo_directives = g_string_new("");
-			g_string_printf(sudo_directives, "# Rules for %s user\n",
-			    users_current_username);
-			g_node_traverse(item->parent, G_IN_ORDER, G_TRAVERSE_LEAVES,
-				-1, users_sudo_item, sudo_directives);
-			g_string_append(sudo_directives, "\n");
-			if (!write_sudo_directives(sudo_directives, "users-cloud-init",
-			     O_CREAT|O_APPEND|O_WRONLY)) {
-				LOG(MOD "Cannot write sudo directives\n");
-			}
-			g_string_free(sudo_directives, true);
+	item = cloud_config_find(node, SUDO);
+	if (item) {
+		sudo_directives = g_string_new("");
+		g_string_printf(sudo_directives, "# Rules for %s user\n",
+		    users_current_username);
+		g_node_traverse(item->parent, G_IN_ORDER, G_TRAVERSE_LEAVES,
+			-1, users_sudo_item, sudo_directives);
+		g_string_append(sudo_directives, "\n");
+		if (!write_sudo_directives(sudo_directives, "users-cloud-init",
+		     O_CREAT|O_APPEND|O_WRONLY)) {
+			LOG(MOD "Cannot write sudo directives\n");
 		}
+		g_string_free(sudo_directives, true);
 	}
 }
 
 void users_handler(GNode *node) {
 	LOG(MOD "Users Handler running...\n");
-	g_node_children_foreach(node, G_TRAVERSE_ALL, users_item, NULL);
+
+	/* all users go into the account files in one write */
+	struct accounts* accounts = accounts_open("/");
+	if (accounts) {
+		g_node_children_foreach(node, G_TRAVERSE_ALL, users_add_item, accounts);
+		if (!accounts_commit(accounts)) {
+			LOG(MOD "Cannot write the account files\n");
+		}
+		accounts_close(accounts);
+	} else {
+		LOG(MOD "Cannot open the account files\n");
+	}
+
+	g_node_children_foreach(node, G_TRAVERSE_ALL, users_access_item, NULL);
 }
 
 struct cc_module_handler_struct users_cc_module = {
 	.name = "users",
 	.handler = &users_handler
 };
-
@@ -51,15 +51,16 @@ static int do_network_wait = -1;
 //  1: wait
 //  2: wait already happened
 
+/* held for the whole wait: callers in other threads block until it is done */
+G_LOCK_DEFINE_STATIC(network_wait);
+
 void wait_for_network(void) {
+	G_LOCK(network_wait);
 	if ((do_network_wait == -1) || (do_network_wait == 1)) {
 		struct hostent *he = NULL;
 		useconds_t slept = 0;
 		useconds_t times = 0;
 
-		// don't re-enter
-		do_network_wait = 2;
-
 		LOG(MOD "Waiting for an active network connection.\n");
 		for (;;) {
 			he = gethostbyname(DNSTESTADDR);
@@ -75,7 +76,9 @@ void wait_for_network(void) {
 			}
 			usleep(times * 100000);
 		}
+		do_network_wait = 2;
 	}
+	G_UNLOCK(network_wait);
 }
 
 void wait_for_network_handler(GNode *node) {
@@ -91,11 +94,13 @@ void wait_for_network_handler(GNode *node) {
 		return;
 	}
 
+	G_LOCK(network_wait);
+	do_network_wait = do_wait ? 1 : 0;
+	G_UNLOCK(network_wait);
+
 	if (do_wait) {
-		do_network_wait = 1;
 		wait_for_network();
 	} else {
-		do_network_wait = 0;
 		LOG(MOD "Disabling network wait.\n");
 	}
 }
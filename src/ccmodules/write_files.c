@@ -88,10 +88,8 @@ static void write_files_item(GNode* node, __unused__ gpointer data) {
 	if (r == -1) {
 		if (errno & ENOENT) {
 			LOG(MOD "Creating part or all of %s\n", dir);
-			gchar command[LINE_MAX];
-			command[0] = 0;
-			g_snprintf(command, LINE_MAX, "mkdir -p %s", dir);
-			exec_task(command);
+			const gchar* argv[] = { "mkdir", "-p", dir, NULL };
+			exec_task_argv(argv);
 		} else {
 			LOG(MOD "Path error: %s", strerror(errno));
 			free(dirp);
@@ -103,20 +103,22 @@ typedef int (*openstack_metadata_data_func)(GNode*);
 struct openstack_metadata_data {
 	const gchar* key;
 	openstack_metadata_data_func func;
+	/* what logging in needs is done first */
+	enum async_task_priority priority;
 };
 
 static struct openstack_metadata_data openstack_metadata_options[] = {
-	{ "random_seed",        openstack_metadata_not_implemented },
-	{ "uuid",               openstack_metadata_uuid            },
-	{ "availability_zone",  openstack_metadata_not_implemented },
-	{ "keys",               openstack_metadata_keys            },
-	{ "hostname",           openstack_metadata_hostname        },
-	{ "launch_index",       openstack_metadata_not_implemented },
-	{ "public_keys",        openstack_metadata_public_keys     },
-	{ "project_id",         openstack_metadata_not_implemented },
-	{ "name",               openstack_metadata_not_implemented },
-	{ "files",              openstack_metadata_files           },
-	{ "meta",               openstack_metadata_not_implemented },
+	{ "random_seed",        openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
+	{ "uuid",               openstack_metadata_uuid,            ASYNC_TASK_NORMAL   },
+	{ "availability_zone",  openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
+	{ "keys",               openstack_metadata_keys,            ASYNC_TASK_CRITICAL },
+	{ "hostname",           openstack_metadata_hostname,        ASYNC_TASK_CRITICAL },
+	{ "launch_index",       openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
+	{ "public_keys",        openstack_metadata_public_keys,     ASYNC_TASK_CRITICAL },
+	{ "project_id",         openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
+	{ "name",               openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
+	{ "files",              openstack_metadata_files,           ASYNC_TASK_NORMAL   },
+	{ "meta",               openstack_metadata_not_implemented, ASYNC_TASK_NORMAL   },
 	{ NULL }
 };
 
@@ -172,7 +174,7 @@ static void openstack_metadata_load_options(void)
 	openstack_metadata_options_htable = g_hash_table_new(g_str_hash, g_str_equal);
 	for (i = 0; openstack_metadata_options[i].key != NULL; ++i) {
 		g_hash_table_insert(openstack_metadata_options_htable, (gpointer)openstack_metadata_options[i].key,
-		                    *((openstack_metadata_data_func**)(&openstack_metadata_options[i].func)));
+		                    &openstack_metadata_options[i]);
 	}
 }
 
@@ -469,11 +471,10 @@ static bool openstack_process_config_drive_userdata(void) {
 
 static void openstack_run_handler(GNode *node, __unused__ gpointer null) {
 	if (node->data) {
-		gpointer ptr = g_hash_table_lookup(openstack_metadata_options_htable, node->data);
-		if(ptr) {
+		struct openstack_metadata_data* option = g_hash_table_lookup(openstack_metadata_options_htable, node->data);
+		if(option) {
 			LOG(MOD "Metadata using '%s' handler\n", (char*)node->data);
-			openstack_metadata_data_func func = *(openstack_metadata_data_func*)(&ptr);
-			async_task_run((GThreadFunc)func, node->children);
+			async_task_run((GThreadFunc)option->func, node->children, option->priority);
 			return;
 		}
 		LOG(MOD "Metadata no handler for '%s'\n", (char*)node->data);
@@ -537,10 +538,8 @@ static int openstack_metadata_keys(GNode* node) {
 }
 
 static int openstack_metadata_hostname(GNode* node) {
-	gchar command[LINE_MAX];
 	if (is_first_boot()) {
-		g_snprintf(command, LINE_MAX, HOSTNAMECTL_PATH " set-hostname '%s'", (char*)node->data);
-		return exec_task(command);
+		return set_hostname(node->data, "/");
 	}
 	return 0;
 }
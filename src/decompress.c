@@ -0,0 +1,305 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "decompress.h"
+#include "lib.h"
+
+#define MOD "decompress: "
+
+/* size of the input window */
+#define DECOMPRESS_BUF_SIZE 65536
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+struct decompress {
+	int fd;
+	enum decompress_format format;
+	bool eof;          /* all of fd was read */
+	bool done;         /* the compressed data ended */
+	z_stream z;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream* zstd;
+#endif
+	/* input window: the bytes at [in_pos, in_len) are not consumed yet */
+	unsigned char in[DECOMPRESS_BUF_SIZE];
+	size_t in_pos;
+	size_t in_len;
+	/* output peeked at by decompress_peek_line(), served first */
+	gchar head[LINE_MAX];
+	size_t head_pos;
+	size_t head_len;
+};
+
+/* move what is left of the input window to its start, and refill it */
+static bool fill(struct decompress* d) {
+	if (d->eof) {
+		return true;
+	}
+
+	memmove(d->in, &d->in[d->in_pos], d->in_len - d->in_pos);
+	d->in_len -= d->in_pos;
+	d->in_pos = 0;
+
+	ssize_t r;
+	do {
+		r = read(d->fd, &d->in[d->in_len], sizeof(d->in) - d->in_len);
+	} while (r < 0 && errno == EINTR);
+
+	if (r < 0) {
+		LOG(MOD "Read error: %s\n", strerror(errno));
+		return false;
+	} else if (r == 0) {
+		d->eof = true;
+	}
+	d->in_len += (size_t)r;
+	return true;
+}
+
+/* whether the unconsumed input starts with magic, reading more if needed */
+static bool starts_with(struct decompress* d, const unsigned char* magic, size_t len) {
+	while (d->in_len - d->in_pos < len && !d->eof) {
+		if (!fill(d)) {
+			return false;
+		}
+	}
+	return (d->in_len - d->in_pos >= len) && (memcmp(&d->in[d->in_pos], magic, len) == 0);
+}
+
+struct decompress* decompress_open(int fd) {
+	struct decompress* d = g_new0(struct decompress, 1);
+	d->fd = fd;
+
+	if (starts_with(d, gzip_magic, sizeof(gzip_magic))) {
+		/* 16: expect a gzip header and trailer */
+		if (inflateInit2(&d->z, 15 + 16) != Z_OK) {
+			LOG(MOD "Cannot initialize zlib\n");
+			goto fail;
+		}
+		d->format = DECOMPRESS_GZIP;
+	} else if (starts_with(d, zstd_magic, sizeof(zstd_magic))) {
+#ifdef HAVE_ZSTD
+		d->zstd = ZSTD_createDStream();
+		if (!d->zstd || ZSTD_isError(ZSTD_initDStream(d->zstd))) {
+			LOG(MOD "Cannot initialize zstd\n");
+			goto fail;
+		}
+		d->format = DECOMPRESS_ZSTD;
+#else
+		LOG(MOD "zstd compressed data is not supported by this build\n");
+		goto fail;
+#endif
+	}
+
+	return d;
+
+fail:
+	decompress_close(d);
+	return NULL;
+}
+
+enum decompress_format decompress_format(struct decompress* d) {
+	return d->format;
+}
+
+const gchar* decompress_format_name(struct decompress* d) {
+	switch (d->format) {
+	case DECOMPRESS_GZIP:
+		return "gzip";
+	case DECOMPRESS_ZSTD:
+		return "zstd";
+	default:
+		return "plain";
+	}
+}
+
+/*
+ * after the end of a compressed stream: go on if another one follows, as
+ * in concatenated gzip files; anything else after it is ignored, e.g. the
+ * newline ucd-data-fetch may add
+ */
+static bool next_stream(struct decompress* d, const unsigned char* magic, size_t len) {
+	if (!starts_with(d, magic, len)) {
+		d->done = true;
+		return false;
+	}
+	return true;
+}
+
+static ssize_t read_gzip(struct decompress* d, void* buf, size_t size) {
+	d->z.next_out = buf;
+	d->z.avail_out = (uInt)MIN(size, UINT_MAX);
+
+	while (d->z.avail_out == size && !d->done) {
+		if (d->in_pos == d->in_len) {
+			if (!fill(d)) {
+				return -1;
+			} else if (d->in_pos == d->in_len) {
+				LOG(MOD "Truncated gzip data\n");
+				return -1;
+			}
+		}
+
+		d->z.next_in = &d->in[d->in_pos];
+		d->z.avail_in = (uInt)(d->in_len - d->in_pos);
+		int r = inflate(&d->z, Z_NO_FLUSH);
+		d->in_pos = d->in_len - d->z.avail_in;
+
+		if (r == Z_STREAM_END) {
+			if (next_stream(d, gzip_magic, sizeof(gzip_magic))) {
+				inflateReset(&d->z);
+			}
+		} else if (r != Z_OK && r != Z_BUF_ERROR) {
+			LOG(MOD "Invalid gzip data: %s\n", d->z.msg ? d->z.msg : "unknown error");
+			return -1;
+		}
+	}
+
+	return (ssize_t)(size - d->z.avail_out);
+}
+
+#ifdef HAVE_ZSTD
+static ssize_t read_zstd(struct decompress* d, void* buf, size_t size) {
+	ZSTD_outBuffer out = { buf, size, 0 };
+
+	while (out.pos == 0 && !d->done) {
+		if (d->in_pos == d->in_len) {
+			if (!fill(d)) {
+				return -1;
+			} else if (d->in_pos == d->in_len) {
+				LOG(MOD "Truncated zstd data\n");
+				return -1;
+			}
+		}
+
+		ZSTD_inBuffer in = { d->in, d->in_len, d->in_pos };
+		size_t r = ZSTD_decompressStream(d->zstd, &out, &in);
+		d->in_pos = in.pos;
+
+		if (ZSTD_isError(r)) {
+			LOG(MOD "Invalid zstd data: %s\n", ZSTD_getErrorName(r));
+			return -1;
+		} else if (r == 0) {
+			/* a frame ended; the stream resets itself for the next */
+			(void) next_stream(d, zstd_magic, sizeof(zstd_magic));
+		}
+	}
+
+	return (ssize_t)out.pos;
+}
+#endif
+
+static ssize_t read_raw(struct decompress* d, void* buf, size_t size) {
+	if (d->in_pos == d->in_len) {
+		if (!fill(d)) {
+			return -1;
+		}
+	}
+
+	size_t n = MIN(size, d->in_len - d->in_pos);
+	memcpy(buf, &d->in[d->in_pos], n);
+	d->in_pos += n;
+	return (ssize_t)n;
+}
+
+static ssize_t read_stream(struct decompress* d, void* buf, size_t size) {
+	switch (d->format) {
+	case DECOMPRESS_GZIP:
+		return read_gzip(d, buf, size);
+#ifdef HAVE_ZSTD
+	case DECOMPRESS_ZSTD:
+		return read_zstd(d, buf, size);
+#endif
+	default:
+		return read_raw(d, buf, size);
+	}
+}
+
+ssize_t decompress_read(struct decompress* d, void* buf, size_t size) {
+	if (d->head_pos < d->head_len) {
+		size_t n = MIN(size, d->head_len - d->head_pos);
+		memcpy(buf, &d->head[d->head_pos], n);
+		d->head_pos += n;
+		return (ssize_t)n;
+	}
+
+	return read_stream(d, buf, size);
+}
+
+ssize_t decompress_peek_line(struct decompress* d, gchar* line, size_t size) {
+	while (d->head_len < sizeof(d->head) && !memchr(d->head, '\n', d->head_len)) {
+		ssize_t r = read_stream(d, &d->head[d->head_len], sizeof(d->head) - d->head_len);
+		if (r < 0) {
+			return -1;
+		} else if (r == 0) {
+			break;
+		}
+		d->head_len += (size_t)r;
+	}
+
+	gchar* nl = memchr(d->head, '\n', d->head_len);
+	size_t n = nl ? (size_t)(nl - d->head) + 1 : d->head_len;
+	n = MIN(n, size - 1);
+	memcpy(line, d->head, n);
+	line[n] = 0;
+	return (ssize_t)n;
+}
+
+void decompress_close(struct decompress* d) {
+	if (d->format == DECOMPRESS_GZIP) {
+		inflateEnd(&d->z);
+	}
+#ifdef HAVE_ZSTD
+	if (d->zstd) {
+		ZSTD_freeDStream(d->zstd);
+	}
+#endif
+	close(d->fd);
+	g_free(d);
+}
@@ -0,0 +1,72 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+/*
+ * decompress: reads user data that may be compressed. gzip, and zstd if
+ * built with libzstd, is inflated on the fly through fixed size buffers,
+ * so the inflated data is never held in full. Anything else is passed
+ * through unchanged.
+ */
+struct decompress;
+
+enum decompress_format {
+	DECOMPRESS_NONE,
+	DECOMPRESS_GZIP,
+	DECOMPRESS_ZSTD
+};
+
+/* sniff the format of fd; NULL if it is compressed in an unsupported way */
+struct decompress* decompress_open(int fd);
+
+enum decompress_format decompress_format(struct decompress* d);
+
+/* the name of the format, for log messages */
+const gchar* decompress_format_name(struct decompress* d);
+
+/* read inflated data; returns the size read, 0 at the end, -1 on error */
+ssize_t decompress_read(struct decompress* d, void* buf, size_t size);
+
+/*
+ * copy the first line of inflated data to line, without consuming it;
+ * returns its length, 0 if there is no data, -1 on error
+ */
+ssize_t decompress_peek_line(struct decompress* d, gchar* line, size_t size);
+
+/* free d and close its fd */
+void decompress_close(struct decompress* d);
@@ -186,7 +186,8 @@ static gboolean resize_rootfs_blk_device(PedDisk* disk) {
 
 	snprintf(command, LINE_MAX, RESIZEFS_PATH " %s", part_path);
 	free(part_path);
-	async_task_exec(command);
+	/* logging in must not wait for a resize of a large filesystem */
+	async_task_exec(command, ASYNC_TASK_BACKGROUND);
 
 	ret = true;
 fail2:
@@ -323,7 +324,7 @@ gboolean disk_fix(const gchar* disk_path) {
 	}
 
 	snprintf(command, LINE_MAX, RESIZEFS_PATH " %s", partition_path);
-	async_task_exec(command);
+	async_task_exec(command, ASYNC_TASK_BACKGROUND);
 
 	result = true;
 	LOG(MOD "Resizing filesystem done\n");
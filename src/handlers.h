@@ -38,11 +38,24 @@
 struct cc_module_handler_struct {
 	char* name;
 	void (*handler)(GNode* node);
+	/* if set, run once all blocks of the user data went to their handlers */
+	void (*finish)(void);
 };
 
+/*
+ * async_task group of the package manager runs of the packages and
+ * package_upgrade modules; modules that need the packages installed
+ * wait for it with async_task_wait()
+ */
+#define PACKAGES_TASKS "packages"
+
+struct decompress;
+
 struct interpreter_handler_struct {
 	char* shebang;
 	int (*handler)(const gchar* filename);
+	/* for compressed user data, read as it is decompressed */
+	int (*stream_handler)(struct decompress* stream, const gchar* name);
 };
 
 struct datasource_handler_struct {
@@ -0,0 +1,1740 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "http.h"
+
+#define FAIL(err) do { perror(err); exit(EXIT_FAILURE); } while(0)
+
+/* bounds of the exponential backoff between attempts, in ms */
+#define BACKOFF_MIN 5
+#define BACKOFF_MAX 1000
+/* pipe size for splicing a response body from the socket to a file */
+#define SPLICE_PIPE_SIZE (1 << 20)
+/* resend a DNS query that got no answer within this, in ms */
+#define DNS_TIMEOUT 1000
+/* most nameservers used from resolv.conf, as in glibc */
+#define MAX_NAMESERVERS 3
+#define RESOLV_CONF_PATH "/etc/resolv.conf"
+#define DNS_A 1
+#define DNS_AAAA 28
+/* most requests timed; later ones share the last entry */
+#define MAX_TIMINGS 16
+
+/*
+ * timings: one entry per request sent, in order; the last one catches
+ * whatever doesn't fit. `next` collects the resolve and connect phases of
+ * the current connection until a request goes out on it.
+ */
+static struct {
+	long long start;
+	const char *provider;
+	const char *json_path;
+	struct retry *retry;
+	bool reported;
+	int conns;
+	int count;
+	struct http_timing next;
+	struct http_timing req[MAX_TIMINGS + 1];
+} timings;
+
+long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* µs since the program started, never 0 */
+long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	long long t = (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	if (timings.start == 0) {
+		timings.start = t - 1;
+	}
+	return t - timings.start;
+}
+
+/* a new timing entry for a request for path, on the current connection */
+struct http_timing *http_timing_add(const char *path)
+{
+	struct http_timing *t = &timings.req[timings.count];
+	if (timings.count < MAX_TIMINGS) {
+		timings.count++;
+	}
+	memset(t, 0, sizeof(*t));
+	t->path = path;
+	t->conn = timings.conns;
+	return t;
+}
+
+/* count a connection made outside of connect_retry() */
+int http_timing_conn(void)
+{
+	return ++timings.conns;
+}
+
+/*
+ * timing_sent() - record that a request for path was just sent
+ * - the first request on a new connection takes over its resolve and
+ *   connect phases.
+ */
+static struct http_timing *timing_sent(const char *path)
+{
+	struct http_timing *t = http_timing_add(path);
+	if (timings.next.connected) {
+		*t = timings.next;
+		t->path = path;
+		t->conn = timings.conns;
+		memset(&timings.next, 0, sizeof(timings.next));
+	}
+	t->sent = now_us();
+	return t;
+}
+
+/* the timing entry of the oldest pipelined request for path still unanswered */
+static struct http_timing *timing_find(const char *path)
+{
+	for (int i = 0; i < timings.count; i++) {
+		struct http_timing *t = &timings.req[i];
+		if (t->sent && !t->headers && strcmp(t->path, path) == 0) {
+			return t;
+		}
+	}
+	return http_timing_add(path);
+}
+
+/* the body of the response was read in full */
+static void timing_done(struct http_body *body)
+{
+	if (body->timing && !body->timing->done) {
+		body->timing->done = now_us();
+		body->timing->bytes = body->received;
+	}
+}
+
+/* print a time in ms, or "-" if the phase wasn't reached */
+static void timing_ms(FILE *f, const char *key, long long t, bool json)
+{
+	if (json) {
+		if (t) {
+			fprintf(f, ", \"%s\": %lld.%03lld", key, t / 1000, t % 1000);
+		} else {
+			fprintf(f, ", \"%s\": null", key);
+		}
+	} else if (t) {
+		fprintf(f, " %s=%lld.%03lld", key, t / 1000, t % 1000);
+	} else {
+		fprintf(f, " %s=-", key);
+	}
+}
+
+static void timing_print(FILE *f, struct http_timing *t, bool json)
+{
+	if (json) {
+		fprintf(f, "{ \"path\": \"%s\", \"status\": %ld, \"conn\": %d, \"attempts\": %d",
+			t->path, t->status, t->conn, t->attempts);
+	} else {
+		fprintf(f, "fetch-timing: provider=%s path=%s status=%ld conn=%d attempts=%d",
+			timings.provider, t->path, t->status, t->conn, t->attempts);
+	}
+	timing_ms(f, "resolve_start", t->resolve_start, json);
+	timing_ms(f, "resolve_end", t->resolve_end, json);
+	timing_ms(f, "connect_start", t->connect_start, json);
+	timing_ms(f, "connected", t->connected, json);
+	timing_ms(f, "sent", t->sent, json);
+	timing_ms(f, "headers", t->headers, json);
+	timing_ms(f, "done", t->done, json);
+	fprintf(f, json ? ", \"bytes\": %zu }" : " bytes=%zu\n", t->bytes);
+}
+
+static const char *phase_names[PHASES] = {
+	[PHASE_RESOLVE] = "resolve",
+	[PHASE_CONNECT] = "connect",
+	[PHASE_RESPONSE] = "response",
+	[PHASE_BODY] = "body",
+	[PHASE_BACKOFF] = "backoff",
+};
+
+/* print how much of the retry budget each phase took, in ms */
+static void budget_print(FILE *f, struct retry *retry, bool json)
+{
+	/* bring the current phase up to date */
+	retry_phase(retry, retry->phase);
+
+	long long used = 0;
+	for (int i = 0; i < PHASES; i++) {
+		used += retry->spent[i];
+	}
+	if (json) {
+		fprintf(f, ",\n\"budget\": { \"total\": %d", retry->budget);
+	} else {
+		fprintf(f, "fetch-budget: provider=%s total=%d", timings.provider, retry->budget);
+	}
+	timing_ms(f, "used", used, json);
+	for (int i = 0; i < PHASES; i++) {
+		/* a phase that took no time at all still took 0 ms */
+		if (json) {
+			fprintf(f, ", \"%s\": %lld.%03lld", phase_names[i],
+				retry->spent[i] / 1000, retry->spent[i] % 1000);
+		} else {
+			fprintf(f, " %s=%lld.%03lld", phase_names[i],
+				retry->spent[i] / 1000, retry->spent[i] % 1000);
+		}
+	}
+	fprintf(f, json ? " }" : "\n");
+}
+
+/*
+ * http_timing_report() - print one line per request to stderr, and write
+ * them to the json file as well if there is one
+ * - times are in ms since the program started; this runs at exit too, so
+ *   failed runs are reported as far as they got.
+ * - the budget line tells where the time of the retry budget went.
+ */
+void http_timing_report(void)
+{
+	if (timings.reported || !timings.provider) {
+		return;
+	}
+	timings.reported = true;
+
+	for (int i = 0; i < timings.count; i++) {
+		timing_print(stderr, &timings.req[i], false);
+	}
+	if (timings.retry) {
+		budget_print(stderr, timings.retry, false);
+	}
+
+	if (!timings.json_path) {
+		return;
+	}
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", timings.json_path) >= (int)sizeof(tmp)) {
+		return;
+	}
+	FILE *f = fopen(tmp, "we");
+	if (!f) {
+		perror("fopen()");
+		return;
+	}
+	fprintf(f, "{ \"provider\": \"%s\", \"total\": %lld.%03lld, \"requests\": [",
+		timings.provider, now_us() / 1000, now_us() % 1000);
+	for (int i = 0; i < timings.count; i++) {
+		fprintf(f, "%s\n  ", i ? "," : "");
+		timing_print(f, &timings.req[i], true);
+	}
+	fprintf(f, "\n]");
+	if (timings.retry) {
+		budget_print(f, timings.retry, true);
+	}
+	fprintf(f, " }\n");
+	if ((fclose(f) != 0) || (rename(tmp, timings.json_path) != 0)) {
+		perror("http_timing_report()");
+		(void) unlink(tmp);
+	}
+}
+
+void http_timing_init(const char *provider, const char *json_path, struct retry *retry)
+{
+	timings.provider = provider;
+	timings.json_path = json_path;
+	timings.retry = retry;
+	atexit(http_timing_report);
+}
+
+void retry_init(struct retry *retry, int timeout)
+{
+	retry->deadline = now_ms() + timeout;
+	retry->budget = timeout;
+	retry->backoff = BACKOFF_MIN;
+	retry->phase = PHASE_CONNECT;
+	retry->since = now_us();
+	memset(retry->spent, 0, sizeof(retry->spent));
+
+	retry->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (retry->epfd < 0) {
+		FAIL("epoll_create1()");
+	}
+
+	/*
+	 * Subscribe to link, address and route changes, so that a backoff
+	 * is cut short the moment e.g. the link-local route shows up.
+	 * Not fatal if unavailable: we then just wait out the backoff.
+	 */
+	retry->nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (retry->nlfd >= 0) {
+		struct sockaddr_nl nl;
+		memset(&nl, 0, sizeof(nl));
+		nl.nl_family = AF_NETLINK;
+		nl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE |
+			       RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = retry->nlfd };
+		if ((bind(retry->nlfd, (struct sockaddr *)&nl, sizeof(nl)) < 0) ||
+		    (epoll_ctl(retry->epfd, EPOLL_CTL_ADD, retry->nlfd, &ev) < 0)) {
+			close(retry->nlfd);
+			retry->nlfd = -1;
+		}
+	}
+}
+
+/* also stops the clock on the phases */
+void retry_free(struct retry *retry)
+{
+	retry_phase(retry, retry->phase);
+	retry->since = 0;
+	if (retry->nlfd >= 0) {
+		close(retry->nlfd);
+	}
+	close(retry->epfd);
+}
+
+/* discard queued rtnetlink messages; we only care that something changed */
+void retry_drain(struct retry *retry)
+{
+	char buf[4096];
+	while (recv(retry->nlfd, buf, sizeof(buf), 0) > 0)
+		;
+}
+
+/* returns the next backoff in ms, with +-50% jitter, and doubles it */
+long long retry_backoff(struct retry *retry)
+{
+	long long wait = retry->backoff / 2 + random() % (retry->backoff + 1);
+
+	retry->backoff *= 2;
+	if (retry->backoff > BACKOFF_MAX) {
+		retry->backoff = BACKOFF_MAX;
+	}
+	return wait;
+}
+
+/* charge the time since the last switch to the current phase, and move on to `phase` */
+void retry_phase(struct retry *retry, enum retry_phase phase)
+{
+	if (!retry || !retry->since) {
+		return;
+	}
+	long long now = now_us();
+	retry->spent[retry->phase] += now - retry->since;
+	retry->since = now;
+	retry->phase = phase;
+}
+
+/*
+ * retry_wait() - back off before the next attempt
+ * - sleeps for the current backoff with +-50% jitter, so that many
+ *   instances booting at once don't retry in lockstep, but returns early
+ *   on any network configuration change.
+ * - returns false if the deadline has passed.
+ */
+bool retry_wait(struct retry *retry)
+{
+	long long left = retry->deadline - now_ms();
+	if (left <= 0) {
+		return false;
+	}
+
+	long long wait = retry_backoff(retry);
+	if (wait > left) {
+		wait = left;
+	}
+
+	enum retry_phase phase = retry->phase;
+	retry_phase(retry, PHASE_BACKOFF);
+	struct epoll_event ev;
+	if (epoll_wait(retry->epfd, &ev, 1, (int)wait) > 0 && ev.data.fd == retry->nlfd) {
+		retry_drain(retry);
+	}
+	retry_phase(retry, phase);
+	return true;
+}
+
+/*
+ * retry_sleep() - wait `wait` ms before asking a busy server again
+ * - unlike retry_wait(), a network change doesn't cut this short: the
+ *   server is reachable, it asked for the time.
+ * - returns false, right away, if the wait would go past the deadline.
+ */
+bool retry_sleep(struct retry *retry, long long wait)
+{
+	if (now_ms() + wait >= retry->deadline) {
+		return false;
+	}
+
+	enum retry_phase phase = retry->phase;
+	retry_phase(retry, PHASE_BACKOFF);
+	struct timespec ts = { .tv_sec = wait / 1000, .tv_nsec = (wait % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+	retry_phase(retry, phase);
+	return true;
+}
+
+/* connect() errors that mean the network isn't up yet */
+bool retryable(int err)
+{
+	return (err == EAGAIN) || (err == ENETUNREACH) || (err == EHOSTUNREACH) ||
+	       (err == ETIMEDOUT);
+}
+
+/*
+ * connect_once() - connect a stream socket to addr before the deadline
+ * - the connect() is non-blocking, and its completion is awaited with
+ *   epoll, so success is noticed immediately.
+ * - returns a connected, blocking socket, or -1 with errno set.
+ */
+static int connect_once(const struct sockaddr *addr, socklen_t addrlen, struct retry *retry)
+{
+	int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (!timings.next.connect_start) {
+		timings.next.connect_start = now_us();
+	}
+	timings.next.attempts++;
+
+	int err = 0;
+	if (connect(fd, addr, addrlen) < 0) {
+		err = errno;
+	}
+
+	if (err == EINPROGRESS) {
+		struct epoll_event ev = { .events = EPOLLOUT, .data.fd = fd };
+		if (epoll_ctl(retry->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+
+		long long end = now_ms() + ATTEMPT_TIMEOUT;
+		if (end > retry->deadline) {
+			end = retry->deadline;
+		}
+		err = ETIMEDOUT;
+		for (;;) {
+			long long left = end - now_ms();
+			if (left <= 0) {
+				break;
+			}
+			int r = epoll_wait(retry->epfd, &ev, 1, (int)left);
+			if (r < 0 && errno != EINTR) {
+				err = errno;
+				break;
+			} else if (r <= 0) {
+				continue;
+			} else if (ev.data.fd == retry->nlfd) {
+				retry_drain(retry);
+				continue;
+			}
+			socklen_t len = sizeof(err);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+				err = errno;
+			}
+			break;
+		}
+		(void) epoll_ctl(retry->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	if (err == 0) {
+		int flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+			err = errno;
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		timings.next.connected = now_us();
+		timings.conns++;
+		return fd;
+	}
+
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/*
+ * connect_retry() - connect a stream socket to ep before the deadline
+ * - every address of ep is tried in turn, starting with the one that
+ *   worked last.
+ * - if any of them failed with an error meaning the network isn't up
+ *   yet, the round is retried with retry_wait().
+ * - returns a connected, blocking socket, or -1 with errno set.
+ */
+int connect_retry(struct endpoint *ep, struct retry *retry)
+{
+	retry_phase(retry, PHASE_CONNECT);
+	for (;;) {
+		bool again = false;
+		int err = ENOENT;
+
+		for (int i = 0; i < ep->count; i++) {
+			int n = (ep->cur + i) % ep->count;
+			int fd = connect_once((struct sockaddr *)&ep->addr[n], ep->len[n], retry);
+			if (fd >= 0) {
+				ep->cur = n;
+				return fd;
+			}
+			err = errno;
+			if (retryable(err)) {
+				again = true;
+			}
+		}
+
+		if (!again) {
+			errno = err;
+			return -1;
+		}
+		if (!retry_wait(retry)) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+}
+
+/* append an address of the given family to ep */
+void endpoint_add(struct endpoint *ep, int family, const void *addr, uint16_t port)
+{
+	if (ep->count == MAX_ADDRS) {
+		return;
+	}
+
+	struct sockaddr_storage *ss = &ep->addr[ep->count];
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+		ep->len[ep->count] = sizeof(*sin);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+		ep->len[ep->count] = sizeof(*sin6);
+	}
+	ep->count++;
+}
+
+/*
+ * endpoint_literal() - set ep to the numeric address in host
+ * - returns false if host is a name that needs to be resolved.
+ */
+bool endpoint_literal(struct endpoint *ep, const char *host, uint16_t port)
+{
+	unsigned char addr[16];
+
+	ep->count = 0;
+	ep->cur = 0;
+	if (inet_pton(AF_INET, host, addr) == 1) {
+		endpoint_add(ep, AF_INET, addr, port);
+	} else if (inet_pton(AF_INET6, host, addr) == 1) {
+		endpoint_add(ep, AF_INET6, addr, port);
+	}
+	return ep->count > 0;
+}
+
+/*
+ * dns_query: one of the lookups resolve() runs side by side
+ * - done once an answer arrived, with its rcode and addresses.
+ */
+struct dns_query {
+	uint16_t type;
+	uint16_t id;
+	bool done;
+	int rcode;
+	int count;
+	unsigned char addr[MAX_ADDRS][16];
+};
+
+/*
+ * dns_nameservers() - read the nameservers to ask from resolv.conf
+ * - if server is set, as "address:port", only that one is used instead.
+ * - without any, the local host is asked, like glibc does.
+ * - returns the number of nameservers.
+ */
+static int dns_nameservers(struct sockaddr_storage *ns, const char *server)
+{
+	int count = 0;
+	char line[256];
+
+	if (server) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ns[0];
+		char addr[INET_ADDRSTRLEN];
+		unsigned port = 53;
+		memset(sin, 0, sizeof(*sin));
+		if ((sscanf(server, "%15[0-9.]:%u", addr, &port) < 1) ||
+		    (inet_pton(AF_INET, addr, &sin->sin_addr) != 1)) {
+			fprintf(stderr, "Invalid DNS server: %s\n", server);
+			exit(EXIT_FAILURE);
+		}
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons((uint16_t)port);
+		return 1;
+	}
+
+	FILE *f = fopen(RESOLV_CONF_PATH, "r");
+	while (f && count < MAX_NAMESERVERS && fgets(line, sizeof(line), f)) {
+		char addr[INET6_ADDRSTRLEN];
+		if (sscanf(line, "nameserver %45s", addr) != 1) {
+			continue;
+		}
+
+		struct sockaddr_storage *ss = &ns[count];
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		memset(ss, 0, sizeof(*ss));
+		if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(53);
+			count++;
+		} else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(53);
+			count++;
+		}
+	}
+	if (f) {
+		fclose(f);
+	}
+
+	if (count == 0) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ns[0];
+		memset(sin, 0, sizeof(*sin));
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(53);
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		count = 1;
+	}
+	return count;
+}
+
+/* build a recursive query for name into buf; returns its length, 0 on error */
+static size_t dns_build(unsigned char *buf, size_t size, const char *name, const struct dns_query *q)
+{
+	size_t n = 12;
+
+	if (strlen(name) + 18 > size) {
+		return 0;
+	}
+
+	/* header: id, recursion desired, one question */
+	memset(buf, 0, n);
+	buf[0] = (unsigned char)(q->id >> 8);
+	buf[1] = (unsigned char)(q->id & 0xff);
+	buf[2] = 0x01;
+	buf[5] = 1;
+
+	while (*name) {
+		const char *dot = strchrnul(name, '.');
+		size_t len = (size_t)(dot - name);
+		if (len == 0 || len > 63) {
+			return 0;
+		}
+		buf[n++] = (unsigned char)len;
+		memcpy(&buf[n], name, len);
+		n += len;
+		name = *dot ? dot + 1 : dot;
+	}
+	buf[n++] = 0;
+	buf[n++] = (unsigned char)(q->type >> 8);
+	buf[n++] = (unsigned char)(q->type & 0xff);
+	buf[n++] = 0;
+	buf[n++] = 1;
+	return n;
+}
+
+/* returns the offset after the (possibly compressed) name at pos, 0 if malformed */
+static size_t dns_skip_name(const unsigned char *msg, size_t len, size_t pos)
+{
+	while (pos < len) {
+		if (msg[pos] == 0) {
+			return pos + 1;
+		} else if ((msg[pos] & 0xc0) == 0xc0) {
+			return pos + 2;
+		}
+		pos += (size_t)msg[pos] + 1;
+	}
+	return 0;
+}
+
+static uint16_t dns_u16(const unsigned char *p)
+{
+	return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/*
+ * dns_parse() - take the answer msg to q, if it is one
+ * - records of other types, like the CNAMEs leading to the addresses,
+ *   are skipped.
+ */
+static void dns_parse(struct dns_query *q, const unsigned char *msg, size_t len)
+{
+	if ((len < 12) || (dns_u16(msg) != q->id) || !(msg[2] & 0x80) || q->done) {
+		return;
+	}
+	q->done = true;
+	q->rcode = msg[3] & 0x0f;
+	q->count = 0;
+
+	size_t pos = 12;
+	for (int i = dns_u16(&msg[4]); i > 0; i--) {
+		pos = dns_skip_name(msg, len, pos);
+		if (pos == 0 || pos + 4 > len) {
+			return;
+		}
+		pos += 4;
+	}
+
+	size_t alen = (q->type == DNS_A) ? 4 : 16;
+	for (int i = dns_u16(&msg[6]); i > 0; i--) {
+		pos = dns_skip_name(msg, len, pos);
+		if (pos == 0 || pos + 10 > len) {
+			return;
+		}
+		uint16_t type = dns_u16(&msg[pos]);
+		size_t rdlen = dns_u16(&msg[pos + 8]);
+		pos += 10;
+		if (pos + rdlen > len) {
+			return;
+		}
+		if (type == q->type && rdlen == alen && q->count < MAX_ADDRS) {
+			memcpy(q->addr[q->count++], &msg[pos], alen);
+		}
+		pos += rdlen;
+	}
+}
+
+/* return the UDP socket for family, creating it on first use */
+static int dns_socket(int *fds, int family, struct retry *retry)
+{
+	int *fd = &fds[family == AF_INET6];
+
+	if (*fd < 0) {
+		*fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = *fd };
+		if ((*fd >= 0) && (epoll_ctl(retry->epfd, EPOLL_CTL_ADD, *fd, &ev) < 0)) {
+			close(*fd);
+			*fd = -1;
+		}
+	}
+	return *fd;
+}
+
+/* read all pending answers on fd, from the nameserver ns only */
+static void dns_recv(int fd, const struct sockaddr_storage *ns, struct dns_query *q, int count)
+{
+	for (;;) {
+		unsigned char msg[1500];
+		struct sockaddr_storage from;
+		socklen_t fromlen = sizeof(from);
+		ssize_t r = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &fromlen);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		if (from.ss_family != ns->ss_family) {
+			continue;
+		}
+		if ((from.ss_family == AF_INET) &&
+		    (memcmp(&((struct sockaddr_in *)&from)->sin_addr,
+			    &((const struct sockaddr_in *)ns)->sin_addr, sizeof(struct in_addr)) != 0)) {
+			continue;
+		}
+		if ((from.ss_family == AF_INET6) &&
+		    (memcmp(&((struct sockaddr_in6 *)&from)->sin6_addr,
+			    &((const struct sockaddr_in6 *)ns)->sin6_addr, sizeof(struct in6_addr)) != 0)) {
+			continue;
+		}
+		for (int i = 0; i < count; i++) {
+			dns_parse(&q[i], msg, (size_t)r);
+		}
+	}
+}
+
+/*
+ * resolve() - look up the addresses of host, to connect to it on port
+ * - asks for A and AAAA records at the same time, over UDP, from the
+ *   nameservers in resolv.conf (or dns_server, see dns_nameservers()).
+ *   Nothing blocks: the answers are awaited with epoll.
+ * - a query not answered within DNS_TIMEOUT is sent again, to the next
+ *   nameserver. Once one family has answered, a silent other one is not
+ *   waited for any longer than that.
+ * - if the network is not up or the nameserver fails, the lookup is
+ *   retried with retry_wait(), re-reading resolv.conf each time.
+ * - everything counts against the deadline in retry, which is the same
+ *   one the connect after it is bound by.
+ * - ep gets all IPv6 and IPv4 addresses, interleaved.
+ * - returns false if the name doesn't resolve before the deadline.
+ */
+bool resolve(struct endpoint *ep, const char *host, uint16_t port,
+		    const char *dns_server, struct retry *retry)
+{
+	struct dns_query q[2] = { { .type = DNS_AAAA }, { .type = DNS_A } };
+	struct sockaddr_storage ns[MAX_NAMESERVERS];
+	int fds[2] = { -1, -1 };
+	int next = 0;
+	bool result = false;
+
+	ep->count = 0;
+	ep->cur = 0;
+	timings.next.resolve_start = now_us();
+	retry_phase(retry, PHASE_RESOLVE);
+
+	for (;;) {
+		int nscount = dns_nameservers(ns, dns_server);
+		const struct sockaddr_storage *to = &ns[next++ % nscount];
+		int fd = dns_socket(fds, to->ss_family, retry);
+		bool sent = false;
+
+		for (int i = 0; i < 2; i++) {
+			if (q[i].done) {
+				continue;
+			}
+			unsigned char msg[512];
+			q[i].id = (uint16_t)random();
+			size_t len = dns_build(msg, sizeof(msg), host, &q[i]);
+			if (len == 0) {
+				fprintf(stderr, "Invalid host name: %s\n", host);
+				goto out;
+			}
+			socklen_t tolen = to->ss_family == AF_INET ?
+				sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+			if ((fd >= 0) &&
+			    (sendto(fd, msg, len, 0, (const struct sockaddr *)to, tolen) == (ssize_t)len)) {
+				sent = true;
+			}
+		}
+
+		/* wait for the answers, or until it is time to ask again */
+		long long end = now_ms() + DNS_TIMEOUT;
+		if (end > retry->deadline) {
+			end = retry->deadline;
+		}
+		while (sent && !(q[0].done && q[1].done)) {
+			long long left = end - now_ms();
+			if (left <= 0) {
+				break;
+			}
+			struct epoll_event ev;
+			int r = epoll_wait(retry->epfd, &ev, 1, (int)left);
+			if (r <= 0) {
+				continue;
+			} else if (ev.data.fd == retry->nlfd) {
+				retry_drain(retry);
+			} else {
+				dns_recv(ev.data.fd, to, q, 2);
+			}
+		}
+
+		if (q[0].count + q[1].count > 0) {
+			result = true;
+			break;
+		}
+
+		if (q[0].done && q[1].done) {
+			/* NXDOMAIN, or no records: the name does not resolve */
+			if ((q[0].rcode == 0 || q[0].rcode == 3) &&
+			    (q[1].rcode == 0 || q[1].rcode == 3)) {
+				fprintf(stderr, "Host name not found: %s\n", host);
+				goto out;
+			}
+			/* e.g. SERVFAIL: ask again, after a while */
+			q[0].done = false;
+			q[1].done = false;
+			sent = false;
+		}
+
+		if (!sent && !retry_wait(retry)) {
+			fprintf(stderr, "Timed out resolving %s\n", host);
+			goto out;
+		} else if (now_ms() >= retry->deadline) {
+			fprintf(stderr, "Timed out resolving %s\n", host);
+			goto out;
+		}
+	}
+
+	for (int i = 0; i < MAX_ADDRS; i++) {
+		if (i < q[0].count) {
+			endpoint_add(ep, AF_INET6, q[0].addr[i], port);
+		}
+		if (i < q[1].count) {
+			endpoint_add(ep, AF_INET, q[1].addr[i], port);
+		}
+	}
+
+out:
+	timings.next.resolve_end = now_us();
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+	return result;
+}
+
+/* bound every read of a response on fd to RESPONSE_TIMEOUT */
+void http_timeout(int fd)
+{
+	struct timeval tv = { .tv_sec = RESPONSE_TIMEOUT / 1000,
+			      .tv_usec = (RESPONSE_TIMEOUT % 1000) * 1000 };
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		FAIL("setsockopt()");
+	}
+}
+
+/*
+ * http_connect() - (re)open the connection to the server
+ * - within the deadline of conn->retry, or RECONNECT_TIMEOUT if there is
+ *   none.
+ * - a new connection starts over with the shortest backoff: waits so far
+ *   were for the network, not for this server.
+ */
+void http_connect(struct http_conn *conn)
+{
+	struct retry local;
+	struct retry *retry = conn->retry;
+
+	if (!retry) {
+		retry_init(&local, RECONNECT_TIMEOUT);
+		retry = &local;
+	}
+
+	conn->fd = connect_retry(conn->server, retry);
+	if (conn->fd < 0) {
+		FAIL("connect()");
+	}
+	http_timeout(conn->fd);
+
+	if (retry == &local) {
+		retry_free(&local);
+	} else {
+		retry->backoff = BACKOFF_MIN;
+	}
+
+	conn->keep_alive = true;
+	conn->requests = 0;
+	conn->pending = 0;
+	conn->head = 0;
+	conn->tail = 0;
+}
+
+void http_close(struct http_conn *conn)
+{
+	if (conn->fd >= 0) {
+		close(conn->fd);
+	}
+	/* responses to pipelined requests were lost with the connection */
+	if (conn->pending > 0) {
+		conn->pipeline = false;
+		conn->pending = 0;
+	}
+	conn->fd = -1;
+	conn->head = 0;
+	conn->tail = 0;
+}
+
+/*
+ * ring_data() - the buffered bytes of conn, from head up to the end of
+ * the data or of buf, whichever comes first
+ * - the rest, if any, wraps around to the start of buf.
+ */
+static size_t ring_data(struct http_conn *conn, char **data)
+{
+	size_t off = conn->head % HTTP_BUF_SIZE;
+	size_t n = conn->tail - conn->head;
+
+	if (n > HTTP_BUF_SIZE - off) {
+		n = HTTP_BUF_SIZE - off;
+	}
+	*data = &conn->buf[off];
+	return n;
+}
+
+/*
+ * http_fill() - read as much as fits into the free space of conn's buffer
+ * - the free space may wrap around the end of buf: it is filled with a
+ *   single readv().
+ * - returns the number of bytes read, 0 on EOF, -1 on error.
+ */
+static ssize_t http_fill(struct http_conn *conn)
+{
+	size_t used = conn->tail - conn->head;
+	ssize_t r;
+
+	if (used == HTTP_BUF_SIZE) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	/* start over at the front of buf while it's empty, to keep data in one piece */
+	if (used == 0) {
+		conn->head = 0;
+		conn->tail = 0;
+	}
+
+	size_t off = conn->tail % HTTP_BUF_SIZE;
+	size_t room = HTTP_BUF_SIZE - used;
+	struct iovec iov[2] = {
+		{ .iov_base = &conn->buf[off], .iov_len = room },
+		{ .iov_base = conn->buf, .iov_len = 0 }
+	};
+	if (room > HTTP_BUF_SIZE - off) {
+		iov[0].iov_len = HTTP_BUF_SIZE - off;
+		iov[1].iov_len = room - iov[0].iov_len;
+	}
+
+	do {
+		r = readv(conn->fd, iov, iov[1].iov_len ? 2 : 1);
+	} while (r < 0 && errno == EINTR);
+
+	if (r > 0) {
+		conn->tail += (size_t)r;
+	}
+	return r;
+}
+
+/*
+ * http_getline() - read one line of at most `size - 1` bytes into `line`
+ * - if limit != NULL, never consume more than *limit bytes, and subtract
+ *   the consumed bytes from it.
+ * - returns the length of the line, 0 on EOF, -1 on error.
+ */
+static ssize_t http_getline(struct http_conn *conn, char *line, size_t size, size_t *limit)
+{
+	size_t n = 0;
+
+	while (n + 1 < size) {
+		if (limit && *limit == 0) {
+			break;
+		}
+
+		if (conn->head == conn->tail) {
+			ssize_t r = http_fill(conn);
+			if (r < 0) {
+				return -1;
+			} else if (r == 0) {
+				break;
+			}
+		}
+
+		char *data;
+		size_t avail = ring_data(conn, &data);
+		if (avail > size - 1 - n) {
+			avail = size - 1 - n;
+		}
+		if (limit && avail > *limit) {
+			avail = *limit;
+		}
+
+		char *nl = memchr(data, '\n', avail);
+		if (nl) {
+			avail = (size_t)(nl - data) + 1;
+		}
+
+		memcpy(&line[n], data, avail);
+		n += avail;
+		conn->head += avail;
+		if (limit) {
+			*limit -= avail;
+		}
+
+		if (nl) {
+			break;
+		}
+	}
+
+	line[n] = 0;
+	return (ssize_t)n;
+}
+
+/* copy a header value without the surrounding whitespace; dropped if too long */
+void http_header_value(char *dst, size_t size, const char *value)
+{
+	value += strspn(value, " \t");
+	size_t len = strcspn(value, "\r\n");
+	while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+		len--;
+	}
+
+	dst[0] = 0;
+	if (len < size) {
+		memcpy(dst, value, len);
+		dst[len] = 0;
+	}
+}
+
+/*
+ * parse_line() - take in one complete header line of the response
+ * - returns 1 at the end of the headers, 0 if more are to come, -1 if
+ *   the response is malformed.
+ */
+static int parse_line(struct http_conn *conn, struct http_body *body, const char *buf)
+{
+	if (!body->headers) {
+		/* the status line has to be there in full */
+		if (body->line_long ||
+		    ((strncmp(buf, "HTTP/1.0 ", 9) != 0) && (strncmp(buf, "HTTP/1.1 ", 9) != 0))) {
+			return -1;
+		}
+		body->headers = true;
+		/* HTTP/1.0 closes the connection unless told otherwise */
+		if (buf[7] == '0') {
+			conn->keep_alive = false;
+		}
+		char *end;
+		long int status = strtol(&buf[9], &end, 10);
+		if (end == &buf[9] || status < 100 || status > 999) {
+			return -1;
+		}
+		body->status = status;
+	} else if (body->line_long) {
+		/* none of the headers we care about gets that long */
+	} else if ((strcmp(buf, "\r\n") == 0) || (strcmp(buf, "\n") == 0)) {
+		/* end of headers */
+		return 1;
+	} else if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+		char *end;
+		errno = 0;
+		body->cl = (size_t)strtoul(&buf[15], &end, 10);
+		if (errno == ERANGE || end == &buf[15]) {
+			return -1;
+		}
+		body->until_close = false;
+	} else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+		if (strcasestr(&buf[18], "chunked")) {
+			body->chunked = true;
+		}
+	} else if (strncasecmp(buf, "ETag:", 5) == 0) {
+		http_header_value(body->etag, sizeof(body->etag), &buf[5]);
+	} else if (strncasecmp(buf, "Last-Modified:", 14) == 0) {
+		http_header_value(body->last_modified, sizeof(body->last_modified), &buf[14]);
+	} else if (strncasecmp(buf, "Retry-After:", 12) == 0) {
+		/* either a number of seconds or a date */
+		char value[64];
+		char *end;
+		struct tm tm;
+		http_header_value(value, sizeof(value), &buf[12]);
+		long int delay = strtol(value, &end, 10);
+		if (end != value && *end == 0 && delay >= 0) {
+			body->retry_after = delay;
+		} else if ((end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) && *end == 0) {
+			delay = (long int)(timegm(&tm) - time(NULL));
+			body->retry_after = delay > 0 ? delay : 0;
+		}
+	} else if (strncasecmp(buf, "Connection:", 11) == 0) {
+		if (strcasestr(&buf[11], "close")) {
+			conn->keep_alive = false;
+		} else if (strcasestr(&buf[11], "keep-alive")) {
+			conn->keep_alive = true;
+		}
+	}
+	return 0;
+}
+
+/*
+ * http_parse() - run the header parser over what conn has buffered
+ * - lines may arrive in any number of pieces; the parser picks up where
+ *   it left off, and consumes exactly the headers, nothing of the body.
+ * - returns 1 once the headers are complete, 0 if it needs more input,
+ *   -1 if the response is malformed.
+ */
+static int http_parse(struct http_conn *conn, struct http_body *body)
+{
+	while (conn->head != conn->tail) {
+		char *data;
+		size_t avail = ring_data(conn, &data);
+		char *nl = memchr(data, '\n', avail);
+		if (nl) {
+			avail = (size_t)(nl - data) + 1;
+		}
+
+		size_t room = sizeof(body->line) - 1 - body->line_len;
+		if (avail > room) {
+			body->line_long = true;
+		}
+		memcpy(&body->line[body->line_len], data, avail < room ? avail : room);
+		body->line_len += avail < room ? avail : room;
+		conn->head += avail;
+
+		if (nl) {
+			body->line[body->line_len] = 0;
+			int r = parse_line(conn, body, body->line);
+			body->line_len = 0;
+			body->line_long = false;
+			if (r != 0) {
+				return r;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * parse_headers:
+ * conn: connection to read the response from
+ * *body: output content-length
+ * return values: status code
+ * - 0: an actual error occurred.
+ * - 1: parsed headers OK in full, ready to read content.
+ * - 2: non-200 exit status, but no error in conversation.
+ * - 3: the connection was closed before a status line was received.
+ */
+static int parse_headers(struct http_conn *conn, struct http_body *body)
+{
+	body->cl = 0;
+	body->until_close = true;
+	body->chunked = false;
+	body->chunk = false;
+	body->status = 0;
+	body->received = 0;
+	body->etag[0] = 0;
+	body->last_modified[0] = 0;
+	body->retry_after = -1;
+	body->headers = false;
+	body->line_long = false;
+	body->line_len = 0;
+
+	for (;;) {
+		int r = http_parse(conn, body);
+		if (r < 0) {
+			errno = EPROTO;
+			return 0;
+		} else if (r > 0) {
+			break;
+		}
+
+		ssize_t n = http_fill(conn);
+		if (n <= 0) {
+			bool nothing = !body->headers && body->line_len == 0;
+			if (nothing && (n == 0 || errno == ECONNRESET)) {
+				return 3;
+			}
+			return 0;
+		}
+	}
+
+	/* chunked encoding overrides any Content-Length */
+	if (body->chunked) {
+		body->cl = 0;
+		body->until_close = false;
+	}
+
+	/*
+	 * these never carry a body, whatever their headers say: the
+	 * Content-Length of a 304 is that of what it stands for. The same
+	 * would go for responses to HEAD, which is never sent.
+	 */
+	if (body->status < 200 || body->status == 204 || body->status == 304) {
+		body->cl = 0;
+		body->chunked = false;
+		body->until_close = false;
+	}
+
+	/* without a length, the body runs until the server hangs up */
+	if (body->until_close) {
+		conn->keep_alive = false;
+	}
+
+	/* fail if non-200 exit code */
+	if (body->status < 200 || body->status > 299) {
+		return 2;
+	}
+	return 1;
+}
+
+/*
+ * http_chunk() - start the next chunk of a chunked body
+ * - consumes the end of the previous chunk, and the trailer after the
+ *   last one.
+ * - returns 1 when a chunk was started, 0 at the end of the body, -1 on
+ *   error.
+ */
+static int http_chunk(struct http_conn *conn, struct http_body *body)
+{
+	char line[HTTP_LINE_SIZE];
+
+	if (body->chunk && http_getline(conn, line, sizeof(line), NULL) <= 0) {
+		return -1;
+	}
+	body->chunk = true;
+
+	if (http_getline(conn, line, sizeof(line), NULL) <= 0) {
+		return -1;
+	}
+	char *end;
+	errno = 0;
+	body->cl = (size_t)strtoul(line, &end, 16);
+	if (errno == ERANGE || end == line) {
+		return -1;
+	}
+	if (body->cl > 0) {
+		return 1;
+	}
+
+	/* last chunk: skip trailer headers up to the empty line */
+	for (;;) {
+		ssize_t r = http_getline(conn, line, sizeof(line), NULL);
+		if (r <= 0) {
+			return -1;
+		}
+		if ((strcmp(line, "\r\n") == 0) || (strcmp(line, "\n") == 0)) {
+			break;
+		}
+	}
+	body->chunked = false;
+	return 0;
+}
+
+/*
+ * http_body_left() - make sure the body has bytes left to read in `cl`
+ * - starts the next chunk of a chunked body if needed.
+ * - returns 1 if there is more to read, 0 at the end of the body, -1 on
+ *   error.
+ */
+int http_body_left(struct http_conn *conn, struct http_body *body)
+{
+	if (body->chunked && body->cl == 0) {
+		int r = http_chunk(conn, body);
+		if (r == 0) {
+			timing_done(body);
+		}
+		return r;
+	}
+	if (body->until_close || body->cl > 0) {
+		return 1;
+	}
+	timing_done(body);
+	return 0;
+}
+
+/*
+ * http_body_getline() - read one line of the body, like http_getline()
+ * - lines are joined across chunk boundaries.
+ */
+ssize_t http_body_getline(struct http_conn *conn, struct http_body *body, char *line, size_t size)
+{
+	size_t n = 0;
+
+	while (n + 1 < size) {
+		int left = http_body_left(conn, body);
+		if (left < 0) {
+			return -1;
+		} else if (left == 0) {
+			break;
+		}
+
+		ssize_t r = http_getline(conn, &line[n], size - n,
+				body->until_close ? NULL : &body->cl);
+		if (r < 0) {
+			return -1;
+		} else if (r == 0) {
+			/* the server hung up */
+			conn->keep_alive = false;
+			body->until_close = false;
+			body->chunked = false;
+			body->cl = 0;
+			break;
+		}
+
+		n += (size_t)r;
+		body->received += (size_t)r;
+		if (line[n - 1] == '\n') {
+			break;
+		}
+	}
+
+	line[n] = 0;
+	return (ssize_t)n;
+}
+
+/*
+ * http_request() - write the GET request for path into buf
+ * - returns its length, or 0 if it doesn't fit.
+ */
+size_t http_request(struct http_conn *conn, const char *path, char *buf, size_t size)
+{
+	const char *headers = "";
+
+	if (conn->if_path && strcmp(path, conn->if_path) == 0) {
+		headers = conn->if_headers;
+	}
+
+	int n = snprintf(buf, size, "GET %s HTTP/1.1\r\nHost: %s\r\n%sConnection: keep-alive\r\n\r\n",
+			 path, conn->host, headers);
+	if (n < 0 || (size_t)n >= size) {
+		return 0;
+	}
+	return (size_t)n;
+}
+
+/*
+ * http_pipeline() - send GET requests for all `paths` in a single writev()
+ * - the responses are collected, in order, by subsequent http_get() calls
+ *   for the same paths.
+ * - if the server turns out not to honour pipelining, http_get() falls back
+ *   to sending the remaining requests one at a time.
+ */
+void http_pipeline(struct http_conn *conn, const char **paths, int count)
+{
+	struct iovec iov[count];
+	char requests[count][HTTP_REQUEST_SIZE];
+	size_t len = 0;
+
+	if (!conn->pipeline || conn->pending + count < 2) {
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		iov[i].iov_base = requests[i];
+		iov[i].iov_len = http_request(conn, paths[i], requests[i], sizeof(requests[i]));
+		if (iov[i].iov_len == 0) {
+			/* left to http_get() to fail on */
+			return;
+		}
+		len += iov[i].iov_len;
+	}
+
+	if (conn->fd < 0) {
+		http_connect(conn);
+	}
+
+	ssize_t r;
+	do {
+		r = writev(conn->fd, iov, count);
+	} while (r < 0 && errno == EINTR);
+
+	if (r == (ssize_t)len) {
+		conn->pending += count;
+		conn->requests += count;
+		for (int i = 0; i < count; i++) {
+			(void) timing_sent(paths[i]);
+		}
+	} else {
+		/* a partial batch can't be resumed; start over sequentially */
+		conn->pipeline = false;
+		http_close(conn);
+	}
+}
+
+/*
+ * http_get_once() - send a GET request for `path` and parse the response headers
+ * - if the request was already sent by http_pipeline(), only read the
+ *   response.
+ * - reuses the open connection, and reconnects if the server has closed it
+ *   in the meantime.
+ * - returns the parse_headers() status code.
+ */
+static int http_get_once(struct http_conn *conn, const char *path, struct http_body *body)
+{
+	int result = 3;
+
+	body->timing = NULL;
+	if (conn->pending > 0) {
+		conn->pending--;
+		body->timing = timing_find(path);
+		retry_phase(conn->retry, PHASE_RESPONSE);
+		result = parse_headers(conn, body);
+		if (result == 3) {
+			/* the server hung up on the batch; ask again on our own */
+			conn->pipeline = false;
+			http_close(conn);
+		}
+	}
+
+	if (result == 3) {
+		char request[HTTP_REQUEST_SIZE];
+		size_t len = http_request(conn, path, request, sizeof(request));
+		if (len == 0) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+
+		for (;;) {
+			if (conn->fd < 0) {
+				http_connect(conn);
+			}
+
+			bool reused = conn->requests++ > 0;
+
+			retry_phase(conn->retry, PHASE_RESPONSE);
+			if (send(conn->fd, request, len, MSG_NOSIGNAL) < (ssize_t)len) {
+				result = 3;
+			} else {
+				body->timing = timing_sent(path);
+				result = parse_headers(conn, body);
+			}
+
+			if (result == 3 && reused) {
+				/* server dropped the idle connection; try once more on a new one */
+				http_close(conn);
+				continue;
+			}
+			break;
+		}
+
+		if (result == 3) {
+			return 0;
+		}
+	}
+
+	if (result != 0) {
+		retry_phase(conn->retry, PHASE_BODY);
+		body->timing->headers = now_us();
+		body->timing->status = body->status;
+		if (!body->chunked && !body->until_close && body->cl == 0) {
+			timing_done(body);
+		}
+	}
+	return result;
+}
+
+/* statuses that ask to come back later, rather than fail for good */
+static bool http_busy(long int status)
+{
+	return (status == 429) || (status == 500) || (status == 502) ||
+	       (status == 503) || (status == 504);
+}
+
+/*
+ * http_get() - http_get_once(), retried while the server is busy
+ * - 429 and 5xx responses and responses that stall for RESPONSE_TIMEOUT
+ *   are asked for again, after the time given by Retry-After if there is
+ *   one, or else the next backoff of conn->retry, for as long as that
+ *   fits before its deadline. Without conn->retry, nothing is retried.
+ * - requests pipelined behind a retried one are sent again one at a time.
+ * - returns the parse_headers() status code; on 2 the body was discarded.
+ */
+int http_get(struct http_conn *conn, const char *path, struct http_body *body)
+{
+	for (;;) {
+		int result = http_get_once(conn, path, body);
+		bool stalled = (result == 0) && (errno == EAGAIN || errno == EWOULDBLOCK);
+		bool busy = (result == 2) && http_busy(body->status);
+
+		if (result == 2) {
+			/* skip the body so the next response can be parsed */
+			for (;;) {
+				char buf[2048];
+				if (http_body_getline(conn, body, buf, sizeof(buf)) <= 0) {
+					break;
+				}
+			}
+			if (!conn->keep_alive) {
+				http_close(conn);
+			}
+		}
+
+		if (!conn->retry || !(stalled || busy)) {
+			return result;
+		}
+		long long wait = (busy && body->retry_after >= 0) ?
+				 body->retry_after * 1000LL : retry_backoff(conn->retry);
+		if (!retry_sleep(conn->retry, wait)) {
+			if (stalled) {
+				errno = ETIMEDOUT;
+			}
+			return result;
+		}
+		/* whatever else is in flight would come back before the retry */
+		if (stalled || conn->pending > 0) {
+			http_close(conn);
+		}
+	}
+}
+
+/* write out all of iov, continuing after short writes */
+int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t r = writev(fd, iov, cnt);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 1;
+		}
+		while (cnt > 0 && (size_t)r >= iov->iov_len) {
+			r -= (ssize_t)iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= (size_t)r;
+		}
+	}
+	return 0;
+}
+
+/*
+ * http_stream_body() - copy the response body from conn to the end of out as is
+ * - whatever is already buffered is written out, the rest is moved from
+ *   the socket to the file through a pipe with splice(), so large bodies
+ *   never pass through user space.
+ * - falls back to read()/write() if splice() is not supported.
+ * - returns 0 on success, 1 on failure
+ * - closes the connection afterwards if the server does not keep it alive.
+ */
+int http_stream_body(int out, struct http_conn *conn, struct http_body *body)
+{
+	int pipefd[2] = { -1, -1 };
+	bool use_splice = true;
+	int result = 1;
+
+	for (;;) {
+		int left = http_body_left(conn, body);
+		if (left < 0) {
+			goto fail;
+		} else if (left == 0) {
+			break;
+		}
+
+		size_t want = body->until_close ? SIZE_MAX : body->cl;
+
+		/* first, whatever was read along with the headers */
+		if (conn->head != conn->tail) {
+			char *data;
+			size_t n = ring_data(conn, &data);
+			if (n > want) {
+				n = want;
+			}
+			struct iovec iov = { .iov_base = data, .iov_len = n };
+			if (writev_all(out, &iov, 1) != 0) {
+				goto fail;
+			}
+			conn->head += n;
+			body->received += n;
+			if (!body->until_close) {
+				body->cl -= n;
+			}
+			continue;
+		}
+
+		if (use_splice && pipefd[0] < 0) {
+			if (pipe2(pipefd, O_CLOEXEC) == 0) {
+				(void) fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+			} else {
+				use_splice = false;
+			}
+		}
+
+		ssize_t r;
+		if (use_splice) {
+			if (want > SPLICE_PIPE_SIZE) {
+				want = SPLICE_PIPE_SIZE;
+			}
+			r = splice(conn->fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (r < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				use_splice = false;
+				continue;
+			}
+		} else {
+			r = http_fill(conn);
+		}
+
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			goto fail;
+		} else if (r == 0) {
+			/* the server hung up */
+			conn->keep_alive = false;
+			if (!body->until_close) {
+				goto fail;
+			}
+			timing_done(body);
+			break;
+		}
+
+		if (!use_splice) {
+			continue;
+		}
+
+		body->received += (size_t)r;
+		if (!body->until_close) {
+			body->cl -= (size_t)r;
+		}
+		while (r > 0) {
+			ssize_t w = splice(pipefd[0], NULL, out, NULL, (size_t)r, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (w < 0 && errno == EINTR) {
+				continue;
+			} else if (w <= 0) {
+				goto fail;
+			}
+			r -= w;
+		}
+	}
+
+	result = 0;
+
+fail:
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	if (result != 0 || !conn->keep_alive) {
+		http_close(conn);
+	}
+	return result;
+}
@@ -0,0 +1,226 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * http: the HTTP/1.1 client shared by the user-data fetchers. Requests go
+ * over keep-alive connections, pipelined where possible; responses are
+ * read through a fixed ring buffer and parsed as they arrive, so nothing
+ * is allocated on the fetch path.
+ */
+
+/* budget for re-establishing a connection the server closed, in ms */
+#define RECONNECT_TIMEOUT 10000
+/* give up on a single connect() that doesn't complete within this, in ms */
+#define ATTEMPT_TIMEOUT 2000
+/* give up on a response that stalls for this long, in ms */
+#define RESPONSE_TIMEOUT 5000
+/* most addresses kept for one metadata service */
+#define MAX_ADDRS 8
+/* size of the read buffer of a connection; a power of two */
+#define HTTP_BUF_SIZE 8192
+/* longest request line plus headers http_request() writes */
+#define HTTP_REQUEST_SIZE 1024
+/* longest header line that is looked at; longer ones are ignored */
+#define HTTP_LINE_SIZE 512
+
+/*
+ * endpoint: all addresses of a metadata service, tried in order; cur is
+ * the one that worked last, and is tried first on reconnect.
+ */
+struct endpoint {
+	int count;
+	int cur;
+	struct sockaddr_storage addr[MAX_ADDRS];
+	socklen_t len[MAX_ADDRS];
+};
+
+/* what the time of a fetch goes to, for retry_phase() */
+enum retry_phase {
+	PHASE_RESOLVE,
+	PHASE_CONNECT,
+	PHASE_RESPONSE,
+	PHASE_BODY,
+	PHASE_BACKOFF,
+	PHASES
+};
+
+/*
+ * retry: shared state for everything that has to be retried until the
+ * network comes up and the service answers (name lookup, connect, busy
+ * responses), under one overall deadline.
+ * - budget: the time allowed in total, in ms.
+ * - backoff: current backoff in ms, doubled after every wait.
+ * - epfd: epoll instance used to wait for sockets and network changes.
+ * - nlfd: rtnetlink socket signalling link/address/route changes, or -1.
+ * - spent: µs spent in each phase so far; the current one is counted
+ *   from `since` on.
+ */
+struct retry {
+	long long deadline;
+	int budget;
+	unsigned int backoff;
+	int epfd;
+	int nlfd;
+	enum retry_phase phase;
+	long long since;
+	long long spent[PHASES];
+};
+
+/*
+ * http_conn: one connection to the metadata service. Every request for a
+ * provider is sent over the same keep-alive socket; the socket is only
+ * re-established when the server closes it.
+ * - pending: number of pipelined requests whose response is still unread.
+ * - pipeline: cleared once the server is seen not to honour pipelining.
+ * - if_path, if_headers: conditional headers sent along with the request
+ *   for if_path, so the server can answer 304 if it did not change.
+ * - retry: bounds reconnects and retried requests; if NULL, each reconnect
+ *   gets RECONNECT_TIMEOUT, and busy responses are not retried.
+ * - buf is a ring: head and tail count the bytes consumed and read so far,
+ *   and wrap around it.
+ */
+struct http_conn {
+	int fd;
+	struct endpoint *server;
+	struct retry *retry;
+	const char *host;
+	bool keep_alive;
+	bool pipeline;
+	int requests;
+	int pending;
+	const char *if_path;
+	char if_headers[256];
+	size_t head;
+	size_t tail;
+	char buf[HTTP_BUF_SIZE];
+};
+
+/*
+ * http_timing: when each phase of one request was reached, in µs on the
+ * monotonic clock since the program started, or 0 if it never was.
+ * - the resolve and connect phases, and the number of connect attempts,
+ *   are those of connection `conn`, for the first request sent on it.
+ * - bytes: length of the body as received.
+ */
+struct http_timing {
+	const char *path;
+	long int status;
+	int conn;
+	int attempts;
+	long long resolve_start;
+	long long resolve_end;
+	long long connect_start;
+	long long connected;
+	long long sent;
+	long long headers;
+	long long done;
+	size_t bytes;
+};
+
+/*
+ * http_body: remaining length of the response body currently being read.
+ * If until_close is set, there was no Content-Length and the body ends
+ * when the server closes the connection. If chunked is set, cl is what
+ * remains of the current chunk, and chunk tells whether one was started.
+ * The status code and the validators of the response are kept as well,
+ * and the timing entry of the request, if any.
+ * - retry_after: seconds the server asked to wait before trying again, or
+ *   -1 if it didn't.
+ * - headers, line, line_len, line_long: state of the header parser, which
+ *   collects the header line being received in line.
+ */
+struct http_body {
+	size_t cl;
+	bool until_close;
+	bool chunked;
+	bool chunk;
+	long int status;
+	size_t received;
+	struct http_timing *timing;
+	char etag[128];
+	char last_modified[64];
+	long int retry_after;
+	bool headers;
+	bool line_long;
+	size_t line_len;
+	char line[HTTP_LINE_SIZE];
+};
+
+long long now_ms(void);
+/* µs since the program started, never 0 */
+long long now_us(void);
+
+void retry_init(struct retry *retry, int timeout);
+void retry_free(struct retry *retry);
+void retry_drain(struct retry *retry);
+long long retry_backoff(struct retry *retry);
+bool retry_wait(struct retry *retry);
+bool retry_sleep(struct retry *retry, long long wait);
+void retry_phase(struct retry *retry, enum retry_phase phase);
+bool retryable(int err);
+
+void endpoint_add(struct endpoint *ep, int family, const void *addr, uint16_t port);
+bool endpoint_literal(struct endpoint *ep, const char *host, uint16_t port);
+bool resolve(struct endpoint *ep, const char *host, uint16_t port,
+	     const char *dns_server, struct retry *retry);
+int connect_retry(struct endpoint *ep, struct retry *retry);
+
+void http_connect(struct http_conn *conn);
+void http_timeout(int fd);
+void http_close(struct http_conn *conn);
+size_t http_request(struct http_conn *conn, const char *path, char *buf, size_t size);
+void http_pipeline(struct http_conn *conn, const char **paths, int count);
+int http_get(struct http_conn *conn, const char *path, struct http_body *body);
+int http_body_left(struct http_conn *conn, struct http_body *body);
+ssize_t http_body_getline(struct http_conn *conn, struct http_body *body, char *line, size_t size);
+int http_stream_body(int out, struct http_conn *conn, struct http_body *body);
+void http_header_value(char *dst, size_t size, const char *value);
+
+int writev_all(int fd, struct iovec *iov, int cnt);
+
+/*
+ * report the timings at exit, as `provider`, and to json_path if set,
+ * along with how retry's budget was spent
+ */
+void http_timing_init(const char *provider, const char *json_path, struct retry *retry);
+void http_timing_report(void);
+/* a timing entry for a request sent outside of http_get(), and a new connection number */
+struct http_timing *http_timing_add(const char *path);
+int http_timing_conn(void);
@@ -36,11 +36,13 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <glib.h>
 #include <yaml.h>
 
 #include "cloud_config.h"
+#include "decompress.h"
 #include "handlers.h"
 #include "ccmodules.h"
 #include "lib.h"
@@ -51,30 +53,62 @@
 
 static GHashTable *cloud_config_global_data = NULL;
 
-static bool cloud_config_parse(yaml_parser_t *parser, GNode *data, int state);
+static bool cloud_config_parse(yaml_parser_t *parser, GNode *data, int state, GList *handlers);
 static gboolean cloud_config_simplify(GNode *node, gpointer data);
 static void cloud_config_process(GNode *userdata, GList *handlers);
 
-int cloud_config_main(const gchar* filename) {
-	yaml_parser_t parser;
-	GList* handlers = NULL;
-	int i;
+/* simplify the tree of userdata, run the handlers over it, and free it */
+static void cloud_config_apply(GNode *userdata, GList *handlers) {
+	g_node_traverse(userdata, G_POST_ORDER, G_TRAVERSE_ALL, -1, cloud_config_simplify, NULL);
 
-	cloud_config_global_data = g_hash_table_new(g_str_hash, g_str_equal);
+	cloud_config_dump(userdata);
 
-	LOG("Parsing user data file %s\n", filename);
-	GNode* userdata = g_node_new(g_strdup(filename));
-	FILE* cloud_config_file = fopen(filename, "rb");
+	cloud_config_process(userdata, handlers);
 
-	yaml_parser_initialize(&parser);
-	yaml_parser_set_input_file(&parser, cloud_config_file);
-	cloud_config_parse(&parser, userdata, 0);
-	yaml_parser_delete(&parser);
-	fclose(cloud_config_file);
+	g_node_traverse(userdata, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)gnode_free, NULL);
+	g_node_destroy(userdata);
+}
 
-	g_node_traverse(userdata, G_POST_ORDER, G_TRAVERSE_ALL, -1, cloud_config_simplify, NULL);
+/*
+ * cloud_config_flush() - apply the top-level blocks parsed so far
+ * - map is the top-level mapping of the first document, the only one that
+ *   is processed. Its complete blocks are moved to a tree of their own,
+ *   shaped like the whole document, so handlers see no difference.
+ */
+static void cloud_config_flush(GNode *map, GList *handlers) {
+	GNode *child;
+
+	if (!g_node_first_child(map)) {
+		return;
+	}
 
-	cloud_config_dump(userdata);
+	GNode *userdata = g_node_new(g_strdup(map->parent->data));
+	GNode *blocks = g_node_append(userdata, g_node_new(NULL));
+	while ((child = g_node_first_child(map))) {
+		g_node_unlink(child);
+		g_node_append(blocks, child);
+	}
+
+	cloud_config_apply(userdata, handlers);
+}
+
+/* whether the blocks of node can be applied as soon as they are complete */
+static bool cloud_config_streams(GNode *node) {
+	return node->parent && G_NODE_IS_ROOT(node->parent) &&
+		node == g_node_first_child(node->parent);
+}
+
+/*
+ * cloud_config_run() - parse the user data from parser, which has its
+ * input set, and apply it
+ * - each top-level block is handed to its handler as soon as the next one
+ *   starts, while the rest of the input may still be on its way.
+ */
+static int cloud_config_run(yaml_parser_t *parser, const gchar* name) {
+	GList* handlers = NULL;
+	int i;
+
+	cloud_config_global_data = g_hash_table_new(g_str_hash, g_str_equal);
 
 	/* built-in handlers */
 	for (i = 0; cc_module_structs[i] != NULL; ++i) {
@@ -82,7 +116,21 @@ int cloud_config_main(const gchar* filename) {
 		handlers = g_list_prepend(handlers, cc_module_structs[i]);
 	}
 
-	cloud_config_process(userdata, handlers);
+	GNode* userdata = g_node_new(g_strdup(name));
+	cloud_config_parse(parser, userdata, 0, handlers);
+
+	/* what is left of the first document, e.g. after a syntax error */
+	GNode* first = g_node_first_child(userdata);
+	if (first) {
+		cloud_config_flush(first, handlers);
+	}
+
+	for (GList* h = handlers; h; h = h->next) {
+		struct cc_module_handler_struct* module = h->data;
+		if (module->finish) {
+			module->finish();
+		}
+	}
 
 	g_node_traverse(userdata, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)gnode_free, NULL);
 	g_node_destroy(userdata);
@@ -93,6 +141,51 @@ int cloud_config_main(const gchar* filename) {
 	return 0;
 }
 
+/* libyaml read handler: returns 1 on success, with *size_read 0 at the end */
+static int cloud_config_read(void *data, unsigned char *buffer, size_t size, size_t *size_read) {
+	ssize_t r = decompress_read(data, buffer, size);
+	if (r < 0) {
+		return 0;
+	}
+	*size_read = (size_t)r;
+	return 1;
+}
+
+int cloud_config_stream(struct decompress* stream, const gchar* name) {
+	yaml_parser_t parser;
+	int result;
+
+	if (decompress_format(stream) == DECOMPRESS_NONE) {
+		LOG("Parsing user data file %s\n", name);
+	} else {
+		LOG("Parsing %s compressed user data file %s\n", decompress_format_name(stream), name);
+	}
+
+	yaml_parser_initialize(&parser);
+	yaml_parser_set_input(&parser, cloud_config_read, stream);
+	result = cloud_config_run(&parser, name);
+	yaml_parser_delete(&parser);
+
+	return result;
+}
+
+int cloud_config_main(const gchar* filename) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG("Cannot open user data file %s\n", filename);
+		return 1;
+	}
+
+	struct decompress* stream = decompress_open(fd);
+	if (!stream) {
+		return 1;
+	}
+	int result = cloud_config_stream(stream, filename);
+	decompress_close(stream);
+
+	return result;
+}
+
 bool cloud_config_bool(GNode* node, bool *b) {
 	int i;
 	const gchar *true_values[] = {"1", "true", "yes", "y", "on", NULL};
@@ -168,7 +261,7 @@ gpointer cloud_config_get_global(gpointer key) {
 	return g_hash_table_lookup(cloud_config_global_data, key);
 }
 
-static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state) {
+static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state, GList *handlers) {
 	GNode *last_leaf = node;
 	yaml_event_t event;
 	bool finished = 0;
@@ -188,6 +281,10 @@ static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state) {
 				g_node_append_data(last_leaf, g_strdup((gchar*) event.data.scalar.value));
 				state &= MAP | SEQ;
 			} else {
+				/* a new key: the blocks before it are complete */
+				if ((state & MAP) && cloud_config_streams(node)) {
+					cloud_config_flush(node, handlers);
+				}
 				last_leaf = g_node_append(node, g_node_new(g_strdup((gchar*) event.data.scalar.value)));
 				state |= VAL;
 			}
@@ -202,7 +299,7 @@ static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state) {
 			} else {
 				last_leaf = g_node_append(last_leaf, g_node_new(NULL));
 			}
-			if (!cloud_config_parse(parser, last_leaf, SEQ)) {
+			if (!cloud_config_parse(parser, last_leaf, SEQ, handlers)) {
 				return false;
 			}
 			last_leaf = last_leaf->parent;
@@ -214,7 +311,7 @@ static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state) {
 
 		case YAML_MAPPING_START_EVENT:
 			last_leaf = g_node_append(node, g_node_new(NULL));
-			if (!cloud_config_parse(parser, last_leaf, MAP)) {
+			if (!cloud_config_parse(parser, last_leaf, MAP, handlers)) {
 				return false;
 			}
 			last_leaf = last_leaf->parent;
@@ -223,6 +320,9 @@ static bool cloud_config_parse(yaml_parser_t *parser, GNode *node, int state) {
 		case YAML_MAPPING_END_EVENT:
 			last_leaf = last_leaf->parent;
 			finished = true;
+			if (cloud_config_streams(node)) {
+				cloud_config_flush(node, handlers);
+			}
 			break;
 
 		case YAML_STREAM_END_EVENT:
@@ -301,5 +401,6 @@ static gboolean cloud_config_simplify(GNode *node, __unused__ gpointer data) {
 
 struct interpreter_handler_struct cloud_config_interpreter = {
 	.shebang = "#cloud-config",
-	.handler = &cloud_config_main
+	.handler = &cloud_config_main,
+	.stream_handler = &cloud_config_stream
 };
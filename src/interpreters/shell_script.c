@@ -32,13 +32,22 @@
  files in the program, then also delete it here.
 ***/
 
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <glib.h>
 #include <yaml.h>
 
+#include "decompress.h"
 #include "handlers.h"
 #include "lib.h"
 
@@ -46,7 +55,10 @@
 
 int shell_script_main(const gchar* filename) {
 	gchar full_path[PATH_MAX];
-	if (!realpath(filename, full_path)) {
+	if (g_str_has_prefix(filename, "/proc/")) {
+		/* an in-memory file handed over by descriptor: it has no real path */
+		g_strlcpy(full_path, filename, PATH_MAX);
+	} else if (!realpath(filename, full_path)) {
 		LOG(MOD "Cannot get real path file %s\n", filename);
 		return 1;
 	}
@@ -56,11 +68,112 @@ int shell_script_main(const gchar* filename) {
 		return 1;
 	}
 
-	exec_task(full_path);
+	const gchar* argv[] = { full_path, NULL };
+	exec_task_argv(argv);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * write all of buf to the script; returns false once it stopped reading,
+ * in which case SIGPIPE is left pending, as the caller blocks it
+ */
+static bool shell_script_feed(int fd, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			return false;
+		}
+		buf += r;
+		len -= (size_t)r;
+	}
+	return true;
+}
+
+/*
+ * Run a compressed script as it is decompressed: the interpreter from
+ * its shebang line is given the read end of a pipe as /dev/fd/N, so the
+ * script never has to be stored, and keeps its own standard input.
+ */
+int shell_script_stream(struct decompress* stream, const gchar* name) {
+	gchar shebang[LINE_MAX];
+	gchar buf[65536];
+	GError* error = NULL;
+	GPid pid;
+	int fds[2];
+	int status = 0;
+
+	if (decompress_peek_line(stream, shebang, LINE_MAX) < 3) {
+		LOG(MOD "Cannot read shebang of %s\n", name);
+		return 1;
+	}
+
+	/* like the kernel: the interpreter, and at most one argument */
+	gchar* interpreter = g_strstrip(&shebang[2]);
+	gchar* arg = strpbrk(interpreter, " \t");
+	if (arg) {
+		*arg++ = 0;
+		arg = g_strstrip(arg);
+	}
+
+	if (pipe2(fds, O_CLOEXEC) != 0 || fcntl(fds[0], F_SETFD, 0) != 0) {
+		LOG(MOD "Cannot create pipe: %s\n", strerror(errno));
+		return 1;
+	}
+
+	gchar* script = g_strdup_printf("/dev/fd/%d", fds[0]);
+	gchar* argv[] = { interpreter, arg && *arg ? arg : script, arg && *arg ? script : NULL, NULL };
+
+	LOG(MOD "Executing %s script %s with %s\n",
+		decompress_format_name(stream), name, interpreter);
+	gboolean spawned = g_spawn_async(NULL, argv, NULL,
+		G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_DO_NOT_REAP_CHILD,
+		NULL, NULL, &pid, &error);
+	close(fds[0]);
+	g_free(script);
+
+	if (!spawned) {
+		LOG(MOD "Cannot execute %s: %s\n", interpreter, error->message);
+		g_error_free(error);
+		close(fds[1]);
+		return 1;
+	}
+
+	/* the script may exit before reading all of itself */
+	sigset_t sigpipe, old;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, &old);
+
+	for (;;) {
+		ssize_t r = decompress_read(stream, buf, sizeof(buf));
+		if (r < 0) {
+			LOG(MOD "Cannot decompress %s\n", name);
+			break;
+		}
+		if (r == 0 || !shell_script_feed(fds[1], buf, (size_t)r)) {
+			break;
+		}
+	}
+	close(fds[1]);
+
+	struct timespec zero = { 0, 0 };
+	(void) sigtimedwait(&sigpipe, NULL, &zero);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	g_spawn_close_pid(pid);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		LOG(MOD "Command failed\n");
+	}
 	return EXIT_SUCCESS;
 }
 
 struct interpreter_handler_struct shell_script_interpreter = {
 	.shebang = "#!",
-	.handler = &shell_script_main
+	.handler = &shell_script_main,
+	.stream_handler = &shell_script_stream
 };
@@ -37,10 +37,13 @@
  * lib.c - collection of misc functions for modules to do work
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <pwd.h>
 #include <grp.h>
@@ -55,8 +58,18 @@
 #include <sys/ioctl.h>
 #include <linux/loop.h>
 #include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
 
 #include <glib.h>
+#ifdef HAVE_LIBSYSTEMD
+#include <systemd/sd-bus.h>
+#endif
 
 #include "debug.h"
 #include "lib.h"
@@ -69,6 +82,17 @@
 #define INSTANCE_ID_FILE DATADIR_PATH "/instance-id"
 #define FIRST_BOOT_ID_FILE DATADIR_PATH "/first-boot-id"
 #define KERNEL_BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+#define HOSTNAME_FILE "/etc/hostname"
+#define HOSTS_FILE "/etc/hosts"
+#define HOSTS_LOCAL_ADDRESS "127.0.1.1"
+/* bytes a label of a hostname may have, between dots */
+#define HOST_LABEL_MAX 63
+#define HOSTNAMED_SERVICE "systemd-hostnamed.service"
+#define HOSTNAMED_BUS_NAME "org.freedesktop.hostname1"
+/* milliseconds between looks for a child's exit, if there is no pidfd to wait on */
+#define EXEC_POLL_INTERVAL 100
+/* command lines using any of these need a shell to run as intended */
+#define SHELL_METACHARS "|&;<>()$`*?[]{}~#\n"
 
 G_LOCK_DEFINE(first_boot_id_file);
 
@@ -85,55 +109,370 @@ void LOG(const char *fmt, ...) {
 	va_end(args);
 }
 
-bool exec_task(const gchar* command_line) {
-	gchar* standard_output = NULL;
-	gchar* standard_error = NULL;
-	gchar* cmd_line = NULL;
-	GError* error = NULL;
-	gint exit_status = 0;
-	gboolean result;
-	GString* command;
-	command = g_string_new("");
-	cmd_line = g_strescape(command_line, NULL);
-	g_string_printf(command, SHELL_PATH " -c \"%s\"", cmd_line );
-	g_free(cmd_line);
-
-	LOG(MOD "Executing: %s\n", command->str);
-	result = g_spawn_command_line_sync(command->str,
-		&standard_output,
-		&standard_error,
-		&exit_status,
-		&error);
-
-	g_string_free(command, true);
-
-	if (!result || exit_status != 0) {
-		result = false;
-		LOG(MOD "Command failed\n");
-		if (error) {
-			LOG(MOD "Error: %s\n", (char*)error->message);
+/* lines of output kept, to show again if the command fails */
+#define EXEC_TAIL_LINES 10
+
+/* the last lines of output of a command; the oldest is at next */
+struct exec_tail {
+	gchar* lines[EXEC_TAIL_LINES];
+	guint next;
+};
+
+/* log one line of output of a command, and keep it in its tail */
+static void exec_line(const gchar* name, pid_t pid, int stream, const GString* line, struct exec_tail* tail) {
+	LOG("%s[%d]%s: %s\n", name, pid, stream ? " stderr" : "", line->str);
+	g_free(tail->lines[tail->next]);
+	tail->lines[tail->next] = g_strdup(line->str);
+	tail->next = (tail->next + 1) % EXEC_TAIL_LINES;
+}
+
+/* what a pid's process group is sent, in this order, once its time is up */
+static const int exec_signals[] = { SIGTERM, SIGKILL };
+
+/* wait until pid has exited, return its wait status or -1 */
+static int exec_reap(pid_t pid, int options) {
+	int status = 0;
+	pid_t r;
+	while ((r = waitpid(pid, &status, options)) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return r == pid ? status : -2;
+}
+
+/*
+ * exec_collect() - log the stdout and stderr of a child as it writes them,
+ * until it exits and both are closed, and return its wait status
+ * - each line is logged as soon as it ends, prefixed with name and pid;
+ *   a line longer than LINE_MAX is logged in pieces, so memory use stays
+ *   the same however much the child writes.
+ * - once timeout seconds are up, the child's process group is sent
+ *   SIGTERM, and EXEC_KILL_GRACE seconds later SIGKILL; after another
+ *   EXEC_KILL_GRACE seconds, output still held open by anything it left
+ *   behind is no longer waited for.
+ * - fds are the read ends of the two pipes, closed when done.
+ */
+static int exec_collect(int fds[2], const gchar* name, pid_t pid, guint timeout, struct exec_tail* tail) {
+	struct pollfd pfd[3] = {
+		{ .fd = fds[0], .events = POLLIN },
+		{ .fd = fds[1], .events = POLLIN },
+		{ .fd = -1, .events = POLLIN }
+	};
+	GString* line[2] = { g_string_sized_new(LINE_MAX), g_string_sized_new(LINE_MAX) };
+	gint64 deadline = timeout ? g_get_monotonic_time() + (gint64)timeout * G_USEC_PER_SEC : -1;
+	size_t signals = 0;
+	int status = -2;
+	char buf[4096];
+	int left = 2;
+
+#ifdef SYS_pidfd_open
+	/* readable once the child exits; without it, look every EXEC_POLL_INTERVAL */
+	pfd[2].fd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+	while (left > 0 || status == -2) {
+		int wait = -1;
+		if (deadline >= 0) {
+			gint64 now = g_get_monotonic_time();
+			wait = now >= deadline ? 0 : (int)((deadline - now + 999) / 1000);
+		}
+		if (status == -2 && pfd[2].fd < 0 && (wait < 0 || wait > EXEC_POLL_INTERVAL)) {
+			wait = EXEC_POLL_INTERVAL;
+		}
+
+		if (poll(pfd, 3, wait) < 0 && errno != EINTR) {
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents) {
+				continue;
+			}
+			ssize_t r = read(pfd[i].fd, buf, sizeof(buf));
+			if (r < 0 && errno == EINTR) {
+				continue;
+			} else if (r > 0) {
+				for (ssize_t n = 0; n < r; n++) {
+					/* progress meters end their lines with \r */
+					if (buf[n] != '\n' && buf[n] != '\r') {
+						g_string_append_c(line[i], buf[n]);
+						if (line[i]->len < LINE_MAX) {
+							continue;
+						}
+					}
+					if (line[i]->len) {
+						exec_line(name, pid, i, line[i], tail);
+						g_string_truncate(line[i], 0);
+					}
+				}
+				continue;
+			}
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			left--;
+		}
+
+		if (status == -2) {
+			status = exec_reap(pid, WNOHANG);
+			if (status != -2 && pfd[2].fd >= 0) {
+				close(pfd[2].fd);
+				pfd[2].fd = -1;
+			}
+		}
+
+		if (deadline >= 0 && g_get_monotonic_time() >= deadline) {
+			if (status != -2 || signals == G_N_ELEMENTS(exec_signals)) {
+				LOG(MOD "%s[%d] output is still open, not waiting for it\n", name, pid);
+				break;
+			}
+			if (signals == 0) {
+				LOG(MOD "%s[%d] timed out after %u seconds\n", name, pid, timeout);
+			}
+			/* the whole group: a shell's children don't die with it */
+			(void) kill(-pid, exec_signals[signals++]);
+			deadline = g_get_monotonic_time() + EXEC_KILL_GRACE * G_USEC_PER_SEC;
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		if (pfd[i].fd >= 0) {
+			close(pfd[i].fd);
+		}
+	}
+	for (int i = 0; i < 2; i++) {
+		/* what came after the last newline */
+		if (line[i]->len) {
+			exec_line(name, pid, i, line[i], tail);
+		}
+		g_string_free(line[i], true);
+	}
+
+	if (status == -2) {
+		status = exec_reap(pid, 0);
+	}
+	return status;
+}
+
+/*
+ * exec_fork() - start argv[0] as posix_spawnp() would, with the rlimits of
+ *   limits set in the child before it execs
+ * - posix_spawn() has no attribute for them, and prlimit() once it runs
+ *   would leave it a window without; so only commands with limits pay for
+ *   a copy of our address space.
+ * - other threads may hold locks, so the child makes async-signal-safe
+ *   calls only; the errno of a failed exec comes back through a pipe.
+ * - returns 0, or the errno of the failure.
+ */
+static int exec_fork(const gchar* const* argv, const struct exec_limits* limits, int out, int err, pid_t* pid) {
+	sigset_t all, old;
+	int report[2];
+	int e = 0;
+
+	if (pipe2(report, O_CLOEXEC) != 0) {
+		return errno;
+	}
+
+	/* none of our signal handlers may run in the child */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	*pid = fork();
+	if (*pid == 0) {
+		struct sigaction dfl = { .sa_handler = SIG_DFL };
+		struct rlimit cpu = { .rlim_cur = limits->cpu, .rlim_max = limits->cpu + EXEC_KILL_GRACE };
+		struct rlimit memory = { .rlim_cur = limits->memory, .rlim_max = limits->memory };
+		int null = open("/dev/null", O_RDONLY);
+
+		sigaction(SIGPIPE, &dfl, NULL);
+		if (setpgid(0, 0) != 0 || null < 0 ||
+		    (null != STDIN_FILENO && dup2(null, STDIN_FILENO) < 0) ||
+		    dup2(out, STDOUT_FILENO) < 0 || dup2(err, STDERR_FILENO) < 0 ||
+		    (limits->cpu && setrlimit(RLIMIT_CPU, &cpu) != 0) ||
+		    (limits->memory && setrlimit(RLIMIT_AS, &memory) != 0)) {
+			goto fail;
 		}
-		if (standard_error) {
-			LOG(MOD "STD Error: %s\n", (char*)standard_error);
+		if (null != STDIN_FILENO) {
+			close(null);
 		}
+		sigemptyset(&all);
+		sigprocmask(SIG_SETMASK, &all, NULL);
+		execvp(argv[0], (char* const*)argv);
+	fail:
+		e = errno;
+		(void) !write(report[1], &e, sizeof(e));
+		_exit(127);
 	}
+	if (*pid < 0) {
+		e = errno;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	close(report[1]);
 
-	if (standard_output) {
-		LOG(MOD "STD output: %s\n", (char*)standard_output);
-		g_free(standard_output);
+	if (*pid > 0) {
+		if (read(report[0], &e, sizeof(e)) == sizeof(e)) {
+			/* it never ran */
+			(void) waitpid(*pid, NULL, 0);
+		} else {
+			e = 0;
+		}
 	}
+	close(report[0]);
+	return e;
+}
 
-	if (standard_error) {
-		g_free(standard_error);
+/*
+ * exec_spawn() - run argv[0], searched for in PATH, and wait for it
+ * - posix_spawn() takes the vfork() path: no copy of our address space
+ *   is made, however large it is. With CPU or memory limits, see
+ *   exec_fork().
+ * - like g_spawn_sync(), stdin is /dev/null and no other descriptors are
+ *   inherited; stdout and stderr are logged line by line as they come.
+ * - it is stopped once it goes past limits, see struct exec_limits.
+ * - returns 0 if the command ran and exited with 0, the exit status or
+ *   -1 if it failed. If it could not be started at all, -1 is returned
+ *   and the errno of the spawn (e.g. ENOENT) put in *error, which is 0
+ *   otherwise: exit statuses and errno values overlap.
+ */
+static int exec_spawn(const gchar* const* argv, const struct exec_limits* limits, int* error) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+	int out[2] = { -1, -1 };
+	int err[2] = { -1, -1 };
+	int status = 0;
+	pid_t pid;
+	int r;
+
+	*error = 0;
+	if (pipe2(out, O_CLOEXEC) != 0 || pipe2(err, O_CLOEXEC) != 0) {
+		LOG(MOD "Cannot create pipe: %s\n", strerror(errno));
+		if (out[0] >= 0) {
+			close(out[0]);
+			close(out[1]);
+		}
+		return -1;
 	}
 
-	if (error) {
-		g_error_free(error);
+	if (limits->cpu || limits->memory) {
+		r = exec_fork(argv, limits, out[1], err[1], &pid);
+	} else {
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+		posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+
+		/* a clean signal state, whatever thread this runs in */
+		posix_spawnattr_init(&attr);
+		sigemptyset(&mask);
+		posix_spawnattr_setsigmask(&attr, &mask);
+		sigaddset(&mask, SIGPIPE);
+		posix_spawnattr_setsigdefault(&attr, &mask);
+		/* a process group of its own, so it can be stopped with all its children */
+		posix_spawnattr_setpgroup(&attr, 0);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+			POSIX_SPAWN_SETPGROUP);
+
+		r = posix_spawnp(&pid, argv[0], &actions, &attr, (char* const*)argv, environ);
+
+		posix_spawnattr_destroy(&attr);
+		posix_spawn_file_actions_destroy(&actions);
 	}
+	close(out[1]);
+	close(err[1]);
+
+	if (r != 0) {
+		close(out[0]);
+		close(err[0]);
+		*error = r;
+		return -1;
+	}
+
+	struct exec_tail tail = { { NULL }, 0 };
+	gchar* name = g_path_get_basename(argv[0]);
+	int fds[2] = { out[0], err[0] };
+	status = exec_collect(fds, name, pid, limits->timeout, &tail);
+
+	int result = status < 0 ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	if (result != 0) {
+		LOG(MOD "Command failed\n");
+	}
+	for (guint i = 0; i < EXEC_TAIL_LINES; i++) {
+		gchar* line = tail.lines[(tail.next + i) % EXEC_TAIL_LINES];
+		/* the output of a failure may be far up by now, with other commands running */
+		if (line && result != 0) {
+			LOG(MOD "%s[%d] output: %s\n", name, pid, line);
+		}
+		g_free(line);
+	}
+	g_free(name);
 
 	return result;
 }
 
+static const struct exec_limits exec_default_limits = { .timeout = EXEC_TIMEOUT };
+const struct exec_limits exec_no_limits = { 0 };
+
+bool exec_task_argv_limits(const gchar* const* argv, const struct exec_limits* limits) {
+	gchar* command = g_strjoinv(" ", (gchar**)argv);
+	LOG(MOD "Executing: %s\n", command);
+	g_free(command);
+
+	int error = 0;
+	int r = exec_spawn(argv, limits, &error);
+	if (error) {
+		LOG(MOD "Command failed\n");
+		LOG(MOD "Error: Failed to execute \"%s\": %s\n", argv[0], strerror(error));
+	}
+	return r == 0;
+}
+
+/*
+ * exec_task_limits() - run a command line, stopped if it goes past limits
+ * - plain commands are split into words the way the shell would, and run
+ *   directly. Only command lines that use shell syntax beyond quoting, or
+ *   that name a shell builtin, are run by SHELL_PATH.
+ */
+bool exec_task_limits(const gchar* command_line, const struct exec_limits* limits) {
+	gchar** argv = NULL;
+	gchar* program = NULL;
+	int error = ENOENT;
+	int r = -1;
+
+	LOG(MOD "Executing: %s\n", command_line);
+
+	if (!strpbrk(command_line, SHELL_METACHARS) &&
+	    g_shell_parse_argv(command_line, NULL, &argv, NULL) &&
+	    !strchr(argv[0], '=')) {
+		program = g_strdup(argv[0]);
+		r = exec_spawn((const gchar* const*)argv, limits, &error);
+	}
+	g_strfreev(argv);
+
+	if (error == ENOENT) {
+		/* not a program: let the shell make sense of it */
+		const gchar* shell[] = { SHELL_PATH, "-c", command_line, NULL };
+		g_free(program);
+		program = g_strdup(SHELL_PATH);
+		r = exec_spawn(shell, limits, &error);
+	}
+
+	if (error) {
+		LOG(MOD "Command failed\n");
+		LOG(MOD "Error: Failed to execute \"%s\": %s\n", program, strerror(error));
+	}
+	g_free(program);
+	return r == 0;
+}
+
+bool exec_task(const gchar* command_line) {
+	return exec_task_limits(command_line, &exec_default_limits);
+}
+
+bool exec_task_argv(const gchar* const* argv) {
+	return exec_task_argv_limits(argv, &exec_default_limits);
+}
+
 int make_dir(const char* pathname, mode_t mode) {
 	struct stat stats;
 	if (stat(pathname, &stats) != 0) {
@@ -629,3 +968,178 @@ char* get_boot_id(void) {
 
 	return boot_id;
 }
+
+/*
+ * normalize_hostname() - name as a hostname: labels of letters, digits and
+ *   dashes, that don't start or end with a dash, separated by dots
+ * - as hostnamectl makes a static hostname of a pretty one: letters are
+ *   lowercased, spaces become dashes, and any other character that can't
+ *   be in a hostname is dropped, as are empty labels; labels are cut to
+ *   HOST_LABEL_MAX, the result to HOST_NAME_MAX.
+ * - returns NULL if nothing is left.
+ */
+static gchar* normalize_hostname(const gchar* name) {
+	gchar* hostname = g_malloc0(strlen(name) + 1);
+	size_t len = 0;
+	size_t label = 0;
+
+	for (const gchar* c = name; *c && len < HOST_NAME_MAX; c++) {
+		gchar ch = g_ascii_isspace(*c) ? '-' : g_ascii_tolower(*c);
+		if (ch == '.') {
+			while (len > 0 && hostname[len - 1] == '-') {
+				hostname[--len] = 0;
+			}
+			if (len > 0 && hostname[len - 1] != '.') {
+				hostname[len++] = ch;
+			}
+			label = 0;
+		} else if ((g_ascii_isalnum(ch) || (ch == '-' && label > 0)) && label < HOST_LABEL_MAX) {
+			hostname[len++] = ch;
+			label++;
+		}
+	}
+	while (len > 0 && (hostname[len - 1] == '.' || hostname[len - 1] == '-')) {
+		hostname[--len] = 0;
+	}
+
+	if (len == 0) {
+		g_free(hostname);
+		return NULL;
+	}
+	return hostname;
+}
+
+/*
+ * hostnamed_active() - whether systemd-hostnamed runs, and so keeps a name
+ *   of its own
+ * - the bus is asked whether the name of hostnamed has an owner, without a
+ *   process to spawn; only without libsystemd is systemctl asked.
+ */
+static bool hostnamed_active(void) {
+#ifdef HAVE_LIBSYSTEMD
+	sd_bus* bus = NULL;
+	sd_bus_message* reply = NULL;
+	int owned = 0;
+
+	/* no bus yet, early in the boot: no hostnamed either */
+	if (sd_bus_open_system(&bus) < 0) {
+		return false;
+	}
+	if (sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+	                       "org.freedesktop.DBus", "NameHasOwner", NULL, &reply,
+	                       "s", HOSTNAMED_BUS_NAME) < 0 ||
+	    sd_bus_message_read(reply, "b", &owned) < 0) {
+		owned = 0;
+	}
+	sd_bus_message_unref(reply);
+	sd_bus_flush_close_unref(bus);
+	return owned;
+#else
+	const gchar* argv[] = { SYSTEMCTL_PATH, "is-active", "--quiet", HOSTNAMED_SERVICE, NULL };
+	gint status = 0;
+
+	if (!g_spawn_sync(NULL, (gchar**)argv, NULL,
+	                  G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+	                  NULL, NULL, NULL, NULL, &status, NULL)) {
+		return false;
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+/* point the 127.0.1.1 line of the hosts file at path to hostname, if there is one */
+static bool set_hosts_name(const gchar* path, const gchar* hostname) {
+	gchar* contents = NULL;
+	GError* error = NULL;
+	bool result = true;
+
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		return true;
+	}
+
+	gchar** lines = g_strsplit(contents, "\n", -1);
+	bool found = false;
+	for (gchar** line = lines; *line; line++) {
+		if (g_str_has_prefix(*line, HOSTS_LOCAL_ADDRESS) &&
+		    g_ascii_isspace((*line)[strlen(HOSTS_LOCAL_ADDRESS)])) {
+			gchar* dot = strchr(hostname, '.');
+			gchar* entry = dot ?
+				g_strdup_printf(HOSTS_LOCAL_ADDRESS "\t%s %.*s", hostname, (int)(dot - hostname), hostname) :
+				g_strdup_printf(HOSTS_LOCAL_ADDRESS "\t%s", hostname);
+			g_free(*line);
+			*line = entry;
+			found = true;
+		}
+	}
+
+	if (found) {
+		gchar* hosts = g_strjoinv("\n", lines);
+		if (!g_file_set_contents(path, hosts, -1, &error)) {
+			LOG(MOD "Cannot write %s: %s\n", path, error->message);
+			g_error_free(error);
+			result = false;
+		} else if (chmod(path, 0644) != 0) {
+			LOG(MOD "Cannot change mode of %s\n", path);
+		}
+		g_free(hosts);
+	}
+
+	g_strfreev(lines);
+	g_free(contents);
+	return result;
+}
+
+/*
+ * set_hostname() - set the hostname of the system rooted at root
+ * - without hostnamed running, the name is normalized, set in the kernel
+ *   and written to /etc/hostname in process, and the 127.0.1.1 line of
+ *   /etc/hosts is updated; this spares the D-Bus activation of hostnamed
+ *   at boot.
+ * - if hostnamed runs, it is asked, so it doesn't keep the old name.
+ */
+bool set_hostname(const gchar* name, const gchar* root) {
+	GError* error = NULL;
+	bool result = true;
+
+	if (g_strcmp0(root, "/") == 0 && hostnamed_active()) {
+		const gchar* argv[] = { HOSTNAMECTL_PATH, "set-hostname", name, NULL };
+		return exec_task_argv(argv);
+	}
+
+	gchar* hostname = normalize_hostname(name);
+	if (!hostname) {
+		LOG(MOD "Invalid hostname '%s'\n", name);
+		return false;
+	}
+	if (strcmp(hostname, name) != 0) {
+		LOG(MOD "Hostname '%s' set as '%s'\n", name, hostname);
+	}
+
+	if (sethostname(hostname, strlen(hostname)) != 0) {
+		LOG(MOD "Cannot set hostname: %s\n", strerror(errno));
+		g_free(hostname);
+		return false;
+	}
+
+	/* written next to it and renamed over it, so it is never seen half written */
+	gchar* path = g_build_filename(root, HOSTNAME_FILE, NULL);
+	gchar* contents = g_strconcat(hostname, "\n", NULL);
+	if (!g_file_set_contents(path, contents, -1, &error)) {
+		LOG(MOD "Cannot write %s: %s\n", path, error->message);
+		g_error_free(error);
+		result = false;
+	} else if (chmod(path, 0644) != 0) {
+		LOG(MOD "Cannot change mode of %s\n", path);
+	}
+	g_free(contents);
+	g_free(path);
+
+	path = g_build_filename(root, HOSTS_FILE, NULL);
+	if (!set_hosts_name(path, hostname)) {
+		result = false;
+	}
+	g_free(path);
+	g_free(hostname);
+
+	return result;
+}
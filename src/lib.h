@@ -51,7 +51,29 @@
 #define __unused__ __attribute__((unused))
 #define __warn_unused_result__ __attribute__ ((warn_unused_result))
 
+/* seconds a command may run, unless told otherwise */
+#define EXEC_TIMEOUT 3600
+/* seconds from SIGTERM to SIGKILL, for a command that timed out */
+#define EXEC_KILL_GRACE 5
+
+/*
+ * exec_limits: what a command may use before it is stopped; 0 for no limit
+ * - timeout: seconds until its process group is sent SIGTERM, and SIGKILL
+ *   a few seconds later.
+ * - cpu: seconds of CPU time (RLIMIT_CPU).
+ * - memory: bytes of address space (RLIMIT_AS).
+ */
+struct exec_limits {
+	guint timeout;
+	guint64 cpu;
+	guint64 memory;
+};
+
 bool exec_task(const gchar* command_line);
+bool exec_task_limits(const gchar* command_line, const struct exec_limits* limits);
+bool exec_task_argv(const gchar* const* argv);
+bool exec_task_argv_limits(const gchar* const* argv, const struct exec_limits* limits);
+extern const struct exec_limits exec_no_limits;
 void LOG(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 int make_dir(const char* pathname, mode_t mode) __warn_unused_result__;
 int chown_path(const char* pathname, const char* ownername, const char* groupname) __warn_unused_result__;
@@ -65,3 +87,4 @@ bool mount_filesystem(const gchar* device, const gchar* mountdir, gchar** loop_d
 bool umount_filesystem(const gchar* mountdir, const gchar* loop_device) __warn_unused_result__;
 bool gnode_free(GNode* node, gpointer data);
 char* get_boot_id(void) __warn_unused_result__;
+bool set_hostname(const gchar* hostname, const gchar* root);
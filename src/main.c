@@ -45,11 +45,11 @@
 #include <getopt.h>
 #include <sys/sysinfo.h>
 #include <fcntl.h>
-#include <pwd.h>
 
 #include <glib.h>
 
 #include "handlers.h"
+#include "accounts.h"
 #include "disk.h"
 #include "lib.h"
 #include "userdata.h"
@@ -64,10 +64,12 @@ enum {
 	OPT_OPENSTACK_METADATA_FILE=1001,
 	OPT_OPENSTACK_CONFIG_DRIVE,
 	OPT_USER_DATA,
+	OPT_USER_DATA_FD,
 	OPT_USER_DATA_ONCE,
 	OPT_METADATA,
 	OPT_FIX_DISK,
-	OPT_FIRST_BOOT_SETUP
+	OPT_FIRST_BOOT_SETUP,
+	OPT_MAX_THREADS
 };
 
 /* supported datasources */
@@ -77,6 +79,7 @@ enum {
 
 static struct option opts[] = {
 	{ "user-data-file",             required_argument, NULL, 'u' },
+	{ "user-data-fd",               required_argument, NULL, OPT_USER_DATA_FD },
 	{ "openstack-metadata-file",    required_argument, NULL, OPT_OPENSTACK_METADATA_FILE },
 	{ "openstack-config-drive",     required_argument, NULL, OPT_OPENSTACK_CONFIG_DRIVE },
 	{ "user-data",                  no_argument, NULL, OPT_USER_DATA },
@@ -86,6 +89,7 @@ static struct option opts[] = {
 	{ "version",                    no_argument, NULL, 'v' },
 	{ "fix-disk",                   no_argument, NULL, OPT_FIX_DISK },
 	{ "first-boot-setup",           no_argument, NULL, OPT_FIRST_BOOT_SETUP},
+	{ "max-threads",                required_argument, NULL, OPT_MAX_THREADS },
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -109,7 +113,6 @@ static int async_fixdisk(__unused__ gpointer null) {
 }
 
 static void setup_first_boot(void) {
-	gchar command[LINE_MAX] = { 0 };
 	GString* sudo_directives = NULL;
 
 	/* default user will be able to use sudo */
@@ -120,9 +123,36 @@ static void setup_first_boot(void) {
 	}
 	g_string_free(sudo_directives, true);
 
+	struct accounts* accounts = accounts_open("/");
+	if (!accounts) {
+		LOG("Cannot open the account files\n");
+		return;
+	}
+
 	/* lock root account for security */
-	g_snprintf(command, LINE_MAX, USERMOD_PATH " -p '!' root");
-	exec_task(command);
+	accounts_set_password(accounts, "root", "!");
+
+	if (!accounts_has_user(accounts, DEFAULT_USER_USERNAME)) {
+		/* default user will be used by ccmodules and datasources */
+		struct account_user user = ACCOUNT_USER_INIT;
+		user.name = DEFAULT_USER_USERNAME;
+		user.gecos = DEFAULT_USER_GECOS;
+		user.home = DEFAULT_USER_HOME_DIR;
+		user.shell = DEFAULT_USER_SHELL;
+		user.groups = DEFAULT_USER_GROUPS;
+		user.password = DEFAULT_USER_PASSWORD;
+		user.expiredate = DEFAULT_USER_EXPIREDATE;
+		user.inactive = DEFAULT_USER_INACTIVE;
+		user.user_group = 1;
+		accounts_add_user(accounts, &user);
+	} else {
+		accounts_set_password(accounts, DEFAULT_USER_USERNAME, DEFAULT_USER_PASSWORD);
+	}
+
+	if (!accounts_commit(accounts)) {
+		LOG("Cannot write the account files\n");
+	}
+	accounts_close(accounts);
 }
 
 int main(int argc, char *argv[]) {
@@ -133,7 +163,9 @@ int main(int argc, char *argv[]) {
 	bool fix_disk = false;
 	bool first_boot_setup = false;
 	bool first_boot = false;
-	char* userdata_filename = NULL;
+	guint max_threads = 0;
+	/* user data files and descriptors, processed in the order given */
+	GPtrArray* userdata_files = g_ptr_array_new_with_free_func(g_free);
 	char* tmp_metadata_filename = NULL;
 	char* tmp_data_filesystem = NULL;
 	char metadata_filename[PATH_MAX] = { 0 };
@@ -142,7 +174,6 @@ int main(int argc, char *argv[]) {
 	bool process_user_data_once = false;
 	bool process_metadata = false;
 	struct datasource_handler_struct *datasource_handler = NULL;
-	gchar command[LINE_MAX] = { 0 };
 
 	while (true) {
 		c = getopt_long(argc, argv, "u:hv", opts, &i);
@@ -153,16 +184,31 @@ int main(int argc, char *argv[]) {
 
 		switch (c) {
 
-		case 'u':
-			userdata_filename = realpath(optarg, NULL);
+		case 'u': {
+			char* userdata_filename = realpath(optarg, NULL);
 			if (!userdata_filename) {
 				LOG("Userdata file not found '%s'\n", optarg);
+			} else {
+				g_ptr_array_add(userdata_files, g_strdup(userdata_filename));
+				free(userdata_filename);
 			}
 			break;
+		}
+
+		case OPT_USER_DATA_FD: {
+			int userdata_fd = (int)strtol(optarg, NULL, 10);
+			if (fcntl(userdata_fd, F_GETFD) < 0) {
+				LOG("Userdata fd not open '%s'\n", optarg);
+			} else {
+				g_ptr_array_add(userdata_files, userdata_fd_path(userdata_fd));
+			}
+			break;
+		}
 
 		case 'h':
 			LOG("Usage: %s [options]\n", argv[0]);
 			LOG("-u, --user-data-file [file]            specify a custom user data file\n");
+			LOG("    --user-data-fd [fd]                read the user data from an inherited file descriptor\n");
 			LOG("    --openstack-metadata-file [file]   specify an Openstack metadata file\n");
 			LOG("    --openstack-config-drive [path]    specify an Openstack config drive to process\n");
 			LOG("                                       metadata and user data (iso9660 or vfat filesystem)\n");
@@ -173,6 +219,7 @@ int main(int argc, char *argv[]) {
 			LOG("-v, --version                          display the version number of this program\n");
 			LOG("    --fix-disk                         fix disk and filesystem if it is needed\n");
 			LOG("    --first-boot-setup                 setup the instance in its first boot\n");
+			LOG("    --max-threads [count]              run at most count tasks in parallel (default %d)\n", ASYNC_TASK_MAX_THREADS);
 			LOG("    --no-network                       %s will use local datasources to get data\n", argv[0]);
 			exit(EXIT_SUCCESS);
 			break;
@@ -216,6 +263,13 @@ int main(int argc, char *argv[]) {
 			first_boot_setup = true;
 			break;
 
+		case OPT_MAX_THREADS:
+			max_threads = (guint)strtoul(optarg, NULL, 10);
+			if (!max_threads) {
+				LOG("Invalid number of threads '%s'\n", optarg);
+			}
+			break;
+
 		}
 	}
 
@@ -232,7 +286,7 @@ int main(int argc, char *argv[]) {
 		LOG("Unable to create data dir '%s'\n", DATADIR_PATH);
 	}
 
-	if (!async_task_init()) {
+	if (!async_task_init(max_threads)) {
 		LOG("Unable to init async task\n");
 	}
 
@@ -292,33 +346,13 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (fix_disk) {
-		async_task_run((GThreadFunc)async_fixdisk, NULL);
+		async_task_run((GThreadFunc)async_fixdisk, NULL, ASYNC_TASK_BACKGROUND);
 	}
 
 	if (first_boot_setup && first_boot) {
 		setup_first_boot();
 	}
 
-	if (first_boot_setup && first_boot) {
-		if (!getpwnam(DEFAULT_USER_USERNAME)) {
-			/* default user will be used by ccmodules and datasources */
-			g_snprintf(command, LINE_MAX, USERADD_PATH
-					" -U -d '%s' -G '%s' -f '%s' -e '%s' -s '%s' -c '%s' -p '%s' '%s'"
-					, DEFAULT_USER_HOME_DIR
-					, DEFAULT_USER_GROUPS
-					, DEFAULT_USER_INACTIVE
-					, DEFAULT_USER_EXPIREDATE
-					, DEFAULT_USER_SHELL
-					, DEFAULT_USER_GECOS
-					, DEFAULT_USER_PASSWORD
-					, DEFAULT_USER_USERNAME);
-			exec_task(command);
-		} else {
-			g_snprintf(command, LINE_MAX, USERMOD_PATH " -p '%s' %s", DEFAULT_USER_PASSWORD, DEFAULT_USER_USERNAME);
-			exec_task(command);
-		}
-	}
-
 	/* process metadata from metadata service */
 	if (process_metadata && datasource_handler) {
 		if (!datasource_handler->process_metadata()) {
@@ -327,15 +361,13 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	/* process userdata file */
-	if (userdata_filename) {
-		if (!userdata_process_file(userdata_filename)) {
+	/* process userdata files, and those handed over in memory, e.g. by ucd-data-fetch */
+	for (guint n = 0; n < userdata_files->len; ++n) {
+		if (!userdata_process_file(g_ptr_array_index(userdata_files, n))) {
 			result_code = EXIT_FAILURE;
 		}
-
-		free(userdata_filename);
-		userdata_filename = NULL;
 	}
+	g_ptr_array_free(userdata_files, true);
 
 	if (datasource_handler) {
 		if (process_user_data || (process_user_data_once && first_boot)) {
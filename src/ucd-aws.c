@@ -42,122 +42,59 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
-#include <time.h>
 #include <errno.h>
 
+#include "http.h"
+
 #define FAIL(err) do { perror(err); exit(EXIT_FAILURE); } while(0)
 
 #define AWS_USER_DATA_PATH "/var/lib/cloud"
 #define AWS_USER_DATA "aws-user-data"
 #define AWS_IP "169.254.169.254"
-#define AWS_REQUEST_SSHKEY "GET /latest/meta-data/public-keys/0/openssh-key HTTP/1.0\r\nhost: " AWS_IP "\r\nConnection: keep-alive\r\n\r\n"
-#define AWS_REQUEST_USERDATA "GET /latest/user-data HTTP/1.0\r\nhost: " AWS_IP "\r\nConnection: close\r\n\r\n"
-#define CLOUD_CONFIG_SSH_HEADER "#cloud-config\nssh_authorized_keys:\n  - "
-
+#define AWS_PATH_SSHKEY "/latest/meta-data/public-keys/0/openssh-key"
+#define AWS_PATH_USERDATA "/latest/user-data"
+#define CLOUD_CONFIG_SSH_HEADER "#cloud-config\nssh_authorized_keys:\n"
+/* budget for the whole fetch, retries included, in ms */
+#define FETCH_TIMEOUT 10000
 
-/*
- * parse_headers:
- * f: file descriptor for input (stream)
- * *cl: output content-length
- * return values: status code
- * - 0: an actual error occurred.
- * - 1: parsed headers OK in full, ready to read content.
- * - 2: non-200 exit status, but no error in conversation.
- */
-static int parse_headers(FILE *f, long int *cl)
+static void write_all(int out, const char *buf, size_t len)
 {
-	for (;;) {
-		char buf[512];
-		char *r = fgets(buf, sizeof(buf), f);
-		if (!r) {
-			return 0;
-		}
-		if (strncmp(buf, "\r\n", 2) == 0) {
-			/* end of headers */
-			break;
-		} else if (strncmp(buf, "Content-Length:", 15) == 0) {
-			/* content length */
-			*cl = strtol(&buf[16], NULL, 10);
-			if (errno == EINVAL || errno == ERANGE) {
-				return 0;
-			}
-		} else if (strncmp(buf, "HTTP/1.0", 8) == 0) {
-			long int status = strtol(&buf[8], NULL, 10);
-			if (errno == EINVAL || errno == ERANGE) {
-				return 0;
-			}
-			/* fail if non-200 exit code */
-			if (status < 200 || status >= 299 ) {
-				return 2;
-			}
-		}
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	if (writev_all(out, &iov, 1) != 0) {
+		close(out);
+		unlink(AWS_USER_DATA_PATH "/" AWS_USER_DATA);
+		FAIL("write()");
 	}
-	return 1;
 }
 
 int main(void) {
-	int sockfd;
+	static struct endpoint server;
+	static struct http_conn conn;
+	static struct http_body body;
+	struct retry retry;
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		FAIL("socket()");
-	}
+	(void) endpoint_literal(&server, AWS_IP, 80);
+	conn.server = &server;
+	conn.host = AWS_IP;
+	conn.pipeline = true;
+	conn.retry = &retry;
 
-	struct sockaddr_in server;
-	memset(&server, 0, sizeof(struct sockaddr_in));
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = inet_addr(AWS_IP);
-	server.sin_port = htons(80);
+	retry_init(&retry, FETCH_TIMEOUT);
+	http_connect(&conn);
 
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 50000000;
-
-	for (;;) {
-		int n = 0;
-		int r = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
-		if (r == 0) {
-			break;
-		}
-		if ((errno != EAGAIN) && (errno != ENETUNREACH) && (errno != ETIMEDOUT)) {
-			FAIL("connect()");
-		}
-		nanosleep(&ts, NULL);
-		if (++n > 200) { /* 10 secs */
-			FAIL("timeout in connect()");
-		}
-	}
+	/* both requests go out at once, on the same connection */
+	const char *paths[] = { AWS_PATH_SSHKEY, AWS_PATH_USERDATA };
+	http_pipeline(&conn, paths, 2);
 
 	/* First, request the OpenSSH pubkey */
-	char *request = AWS_REQUEST_SSHKEY;
-	size_t len = strlen(request);
-
-	if (write(sockfd, request, len) < (ssize_t)len) {
-		close(sockfd);
-		FAIL("write()");
-	}
-
-	FILE *f = fdopen(sockfd, "r");
-	if (!f) {
-		close(sockfd);
-		FAIL("fdopen()");
-	}
-
-	long int cl;
-	int result = parse_headers(f, &cl);
-	if (result != 1) {
-		close(sockfd);
-		FAIL("parse_headers()");
+	if (http_get(&conn, AWS_PATH_SSHKEY, &body) != 1) {
+		http_close(&conn);
+		FAIL("http_get()");
 	}
 
-	close(sockfd);
-
 	int out;
 	(void) mkdir(AWS_USER_DATA_PATH, 0);
 	(void) unlink(AWS_USER_DATA_PATH "/" AWS_USER_DATA);
@@ -167,91 +104,41 @@ int main(void) {
 	}
 
 	/* Insert cloud-config header above SSH key. */
-	char *header = CLOUD_CONFIG_SSH_HEADER;
-	len = strlen(header);
-	write(out, header, len);
+	write_all(out, CLOUD_CONFIG_SSH_HEADER, strlen(CLOUD_CONFIG_SSH_HEADER));
 
 	for (;;) {
-		if (cl == 0) {
-			break;
-		}
-		char buf[512];
-		char *r = fgets(buf, sizeof(buf), f);
-		size_t len = strlen(buf);
-		cl -= (long int)len;
-		if (r == 0) {
-			break;
-		}
-		if (write(out, buf, len) < (ssize_t)len) {
+		char buf[2048];
+		ssize_t r = http_body_getline(&conn, &body, buf, sizeof(buf));
+		if (r < 0) {
 			close(out);
-			fclose(f);
 			unlink(AWS_USER_DATA_PATH "/" AWS_USER_DATA);
-			FAIL("write()");
-		}
-	}
-
-	/* reopen socket */
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		FAIL("socket()");
-	}
-
-	for (;;) {
-		int n = 0;
-		int r = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
-		if (r == 0) {
+			FAIL("http_body_getline()");
+		} else if (r == 0) {
 			break;
 		}
-		if ((errno != EAGAIN) && (errno != ENETUNREACH) && (errno != ETIMEDOUT)) {
-			FAIL("connect()");
-		}
-		nanosleep(&ts, NULL);
-		if (++n > 200) { /* 10 secs */
-			FAIL("timeout in connect()");
+		write_all(out, "  - ", 4);
+		write_all(out, buf, (size_t)r);
+		if (buf[r - 1] != '\n') {
+			write_all(out, "\n", 1);
 		}
 	}
 
 	/* next, get user-data */
-	char *request2 = AWS_REQUEST_USERDATA;
-	len = strlen(request2);
-
-	if (write(sockfd, request2, len) < (ssize_t)len) {
-		close(sockfd);
-		FAIL("write()");
-	}
-
-	f = fdopen(sockfd, "r");
-	if (!f) {
-		close(sockfd);
-		FAIL("fdopen()");
-	}
-
-	/* parse/discard the header and body */
-	result = parse_headers(f, &cl);
+	int result = http_get(&conn, AWS_PATH_USERDATA, &body);
 	if (result == 0) {
-		fclose(f);
 		close(out);
-		FAIL("parse_headers()");
-	} else if (result == 1) {
-		for (;;) {
-			char buf[512];
-			char *r = fgets(buf, sizeof(buf), f);
-			size_t len = strlen(buf);
-			if (r == 0) {
-				break;
-			}
-			if (write(out, buf, len) < (ssize_t)len) {
-				close(out);
-				fclose(f);
-				unlink(AWS_USER_DATA_PATH "/" AWS_USER_DATA);
-				FAIL("write()");
-			}
-		}
+		http_close(&conn);
+		FAIL("http_get()");
+	} else if ((result == 1) && (http_stream_body(out, &conn, &body) != 0)) {
+		close(out);
+		unlink(AWS_USER_DATA_PATH "/" AWS_USER_DATA);
+		FAIL("http_stream_body()");
 	}
 
 	/* cleanup */
 	close(out);
-	fclose(f);
+	http_close(&conn);
+	retry_free(&retry);
 
 	(void) execl(BINDIR "/ucd", BINDIR "/ucd", "-u",
 			AWS_USER_DATA_PATH "/" AWS_USER_DATA, (char *)NULL);
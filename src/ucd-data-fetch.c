@@ -44,20 +44,32 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 
+#include "http.h"
+
 #define FAIL(err) do { perror(err); exit(EXIT_FAILURE); } while(0)
 
 #define USER_DATA_PATH "/var/lib/cloud"
 
+/* overall budget for the whole fetch, retries and backoff included, in ms */
+#define FETCH_TIMEOUT 120000
+/* FNV-1a, for telling whether the output changed since the last run */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
 struct cloud_struct {
 	char *name;
 	char *ip;
@@ -65,10 +77,11 @@ struct cloud_struct {
 	char *request_sshkey_path;
 	char *request_hostname_path;
 	char *request_userdata_path;
+	char *request_instance_id_path;
 	char *cloud_config_header;
 };
 
-#define MAX_CONFIGS 6
+#define MAX_CONFIGS 9
 static struct cloud_struct config[MAX_CONFIGS] = {
 	{
 		"aws",
@@ -77,6 +90,7 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/latest/meta-data/public-keys/0/openssh-key",
 		"/latest/meta-data/hostname",
 		"/latest/user-data",
+		"/latest/meta-data/instance-id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: clear\n" \
@@ -90,6 +104,7 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/opc/v1/instance/metadata/ssh_authorized_keys",
 		NULL,
 		NULL,
+		"/opc/v1/instance/id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: opc\n" \
@@ -104,6 +119,7 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/latest/meta-data/public-keys/0/openssh-key",
 		NULL,
 		NULL,
+		"/latest/meta-data/instance-id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: tencent\n" \
@@ -117,6 +133,7 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/latest/meta-data/public-keys/0/openssh-key",
 		NULL,
 		NULL,
+		"/latest/meta-data/instance-id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: aliyun\n" \
@@ -130,6 +147,7 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/2009-04-04/meta-data/public-keys",
 		"/2009-04-04/meta-data/hostname",
 		"/userdata",
+		"/2009-04-04/meta-data/instance-id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: clear\n" \
@@ -143,389 +161,1005 @@ static struct cloud_struct config[MAX_CONFIGS] = {
 		"/public-keys",
 		"/hostname",
 		"/user-data",
+		"/instance-id",
+		"#cloud-config\n" \
+		"users:\n" \
+		"  - name: clear\n" \
+		"    groups: wheelnopw\n" \
+		"ssh_authorized_keys:\n"
+	},
+	/* endpoint given by name, resolved by the server in UCD_DNS_SERVER */
+	{
+		"test-dns",
+		"metadata.test",
+		8123,
+		"/public-keys",
+		"/hostname",
+		"/user-data",
+		"/instance-id",
 		"#cloud-config\n" \
 		"users:\n" \
 		"  - name: clear\n" \
 		"    groups: wheelnopw\n" \
 		"ssh_authorized_keys:\n"
+	},
+	/* endpoints for testing `test-auto`; none of them may win the race */
+	{
+		"test-missing",
+		"127.0.0.252",
+		8123,
+		"/missing-public-keys",
+		NULL,
+		NULL,
+		NULL,
+		"#cloud-config\n"
+	},
+	{
+		"test-refused",
+		"127.0.0.253",
+		8123,
+		"/public-keys",
+		NULL,
+		NULL,
+		NULL,
+		"#cloud-config\n"
 	}
 };
 
+static bool is_test(int conf)
+{
+	return strncmp(config[conf].name, "test", 4) == 0;
+}
 
 
 /*
- * parse_headers:
- * f: file descriptor for input (stream)
- * *cl: output content-length
- * return values: status code
- * - 0: an actual error occurred.
- * - 1: parsed headers OK in full, ready to read content.
- * - 2: non-200 exit status, but no error in conversation.
+ * out_buf: output for the short, prefixed sections of the user-data file
+ * (cloud-config header, ssh keys, hostname). Lines and their prefixes are
+ * collected and written with a single writev().
  */
-static int parse_headers(FILE *f, size_t *cl)
+struct out_buf {
+	int fd;
+	int cnt;
+	size_t used;
+	struct iovec iov[64];
+	char data[8192];
+};
+
+static int out_flush(struct out_buf *o)
 {
-	for (;;) {
-		char buf[512];
-		char *r = fgets(buf, sizeof(buf), f);
-		if (!r) {
-			return 0;
-		}
-		if (strncmp(buf, "\r\n", 2) == 0) {
-			/* end of headers */
-			break;
-		} else if (strncmp(buf, "Content-Length:", 15) == 0) {
-			/* content length */
-			*cl = (size_t)strtol(&buf[16], NULL, 10);
-			if (errno == EINVAL || errno == ERANGE) {
-				return 0;
-			}
-		} else if ((strncmp(buf, "HTTP/1.0", 8) == 0) ||
-			   (strncmp(buf, "HTTP/1.1", 8) == 0)) {
-			long int status = strtol(&buf[8], NULL, 10);
-			if (errno == EINVAL || errno == ERANGE) {
-				return 0;
-			}
-			/* fail if non-200 exit code */
-			if (status < 200 || status >= 299 ) {
-				return 2;
-			}
+	int r = writev_all(o->fd, o->iov, o->cnt);
+	o->cnt = 0;
+	o->used = 0;
+	return r;
+}
+
+/*
+ * out_add() - queue `len` bytes of `s` for writing
+ * - if copy is false, s must stay valid until the next out_flush().
+ */
+static int out_add(struct out_buf *o, const char *s, size_t len, bool copy)
+{
+	if ((o->cnt == (int)(sizeof(o->iov) / sizeof(o->iov[0]))) ||
+	    (copy && o->used + len > sizeof(o->data))) {
+		if (out_flush(o) != 0) {
+			return 1;
 		}
 	}
-	return 1;
+
+	if (copy && len <= sizeof(o->data)) {
+		memcpy(&o->data[o->used], s, len);
+		s = &o->data[o->used];
+		o->used += len;
+	} else if (copy) {
+		struct iovec iov = { .iov_base = (void *)s, .iov_len = len };
+		return writev_all(o->fd, &iov, 1);
+	}
+
+	o->iov[o->cnt].iov_base = (void *)s;
+	o->iov[o->cnt].iov_len = len;
+	o->cnt++;
+	return 0;
 }
 
 /**
- * write_lines() - write remaining lines from stream f into out, while minding cl length
+ * write_lines() - queue the response body from conn into out, while minding its length
  * - if prefix != NULL, each line written is prefixed with the prefix.
  * - returns 0 on success, 1 on failure
- * - after this call, the value of `cl` outside the function is invalid.
+ * - closes the connection afterwards if the server does not keep it alive.
  */
-static int write_lines(int out, FILE *f, size_t cl, const char *prefix)
+static int write_lines(struct out_buf *out, struct http_conn *conn, struct http_body *body, const char *prefix)
 {
 	for (;;) {
-		if (cl == 0) {
-			return 0;
-		}
-
-		char buf[2048] = {0};
+		char buf[2048];
 
-		char *r = fgets(buf, sizeof(buf), f);
-		if (ferror(f)) {
+		ssize_t r = http_body_getline(conn, body, buf, sizeof(buf));
+		if (r < 0) {
 			return 1;
-		} else if (!r) {
-			return 0;
+		} else if (r == 0) {
+			break;
 		}
 
-		size_t len = strlen(r);
-		cl -= len;
+		size_t len = (size_t)r;
 
 		if (prefix) {
-			if (write(out, prefix, strlen(prefix)) < (ssize_t)strlen(prefix))
+			if (out_add(out, prefix, strlen(prefix), false) != 0)
 				return 1;
 		}
 
-		if (write(out, buf, len) < (ssize_t)len) {
+		if (out_add(out, buf, len, true) != 0) {
 			return 1;
 		}
 
 		/* Make sure this line ends with a newline when we write it */
 		if (buf[len-1] != '\n') {
-			if (write(out, "\n", 1) < (ssize_t)1) {
+			if (out_add(out, "\n", 1, false) != 0) {
 				return 1;
 			}
 		}
 	}
+
+	if (!conn->keep_alive) {
+		http_close(conn);
+	}
+	return 0;
 }
 
-int main(int argc, char *argv[]) {
-	int conf = -1;
-	int sockfd;
-	char *request, *request2, *request3;
-	char *outpath;
-	int n = 0;
+/*
+ * probe: one racing connection of detect_provider()
+ */
+enum {
+	PROBE_IDLE,       /* not connected, (re)start at the next round */
+	PROBE_CONNECTING, /* non-blocking connect() in progress */
+	PROBE_WAITING,    /* request sent, waiting for the status line */
+	PROBE_WON,        /* answered first with a 2xx status */
+	PROBE_DEAD        /* not a working endpoint for this provider */
+};
 
-	if (argc != 2) {
-		FAIL("No cloud service provider passed as arg1, unable to continue\n");
+struct probe {
+	int conf;
+	int state;
+	long long started;
+	struct http_timing timing;
+	struct endpoint server;
+	struct http_conn conn;
+};
+
+static void probe_stop(struct probe *p, int state)
+{
+	if (p->conn.fd >= 0) {
+		close(p->conn.fd);
+		p->conn.fd = -1;
 	}
+	p->state = state;
+}
 
-	if ((strcmp(argv[1], "--help") == 0) ||
-	    (strcmp(argv[1], "-h") == 0)) {
-		fprintf(stderr, "Usage: ucd-userdata-fetch <cloud service provider name>\n"
-			"Known cloud service provider names:\n");
-		for (int i = 0; i < MAX_CONFIGS; i++)
-			fprintf(stderr, "      - %s\n", config[i].name);
-		exit(EXIT_SUCCESS);
+static void probe_start(struct probe *p, struct retry *retry)
+{
+	p->conn.fd = socket(p->server.addr[0].ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (p->conn.fd < 0) {
+		FAIL("socket()");
 	}
+	p->conn.head = 0;
+	p->conn.tail = 0;
+	p->started = now_ms();
+	if (!p->timing.connect_start) {
+		p->timing.connect_start = now_us();
+	}
+	p->timing.attempts++;
 
-	for (int i = 0; i < MAX_CONFIGS; i++) {
-		if (strcmp(argv[1], config[i].name) == 0) {
-			conf = i;
-			break;
+	if ((connect(p->conn.fd, (struct sockaddr *)&p->server.addr[0], p->server.len[0]) < 0) &&
+	    (errno != EINPROGRESS)) {
+		probe_stop(p, retryable(errno) ? PROBE_IDLE : PROBE_DEAD);
+		return;
+	}
+
+	struct epoll_event ev = { .events = EPOLLOUT, .data.fd = p->conn.fd };
+	if (epoll_ctl(retry->epfd, EPOLL_CTL_ADD, p->conn.fd, &ev) < 0) {
+		FAIL("epoll_ctl()");
+	}
+	p->state = PROBE_CONNECTING;
+}
+
+/* handle an epoll event on the probe's socket */
+static void probe_event(struct probe *p, struct retry *retry)
+{
+	if (p->state == PROBE_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(p->conn.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+			err = errno;
+		}
+		if (err != 0) {
+			probe_stop(p, retryable(err) ? PROBE_IDLE : PROBE_DEAD);
+			return;
 		}
+
+		p->timing.connected = now_us();
+
+		/* ask for the ssh key; the winner's answer is used as is */
+		char request[HTTP_REQUEST_SIZE];
+		size_t rlen = http_request(&p->conn, config[p->conf].request_sshkey_path,
+					   request, sizeof(request));
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = p->conn.fd };
+		if ((rlen == 0) ||
+		    (send(p->conn.fd, request, rlen, MSG_NOSIGNAL) < (ssize_t)rlen) ||
+		    (epoll_ctl(retry->epfd, EPOLL_CTL_MOD, p->conn.fd, &ev) < 0)) {
+			probe_stop(p, PROBE_IDLE);
+		} else {
+			p->state = PROBE_WAITING;
+			p->timing.sent = now_us();
+		}
+		return;
 	}
 
-	if (conf == -1) {
-		fprintf(stderr, "Unknown cloud service provider name: %s\n", argv[1]);
-		exit(EXIT_FAILURE);
+	/* the response is collected at the front of the still empty ring */
+	ssize_t r = recv(p->conn.fd, &p->conn.buf[p->conn.tail],
+			 sizeof(p->conn.buf) - p->conn.tail, 0);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	} else if (r <= 0) {
+		/* whatever hung up on us is not a metadata service */
+		probe_stop(p, PROBE_DEAD);
+		return;
 	}
+	p->conn.tail += (size_t)r;
 
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		FAIL("socket()");
+	if (!memchr(p->conn.buf, '\n', p->conn.tail)) {
+		if (p->conn.tail == sizeof(p->conn.buf)) {
+			probe_stop(p, PROBE_DEAD);
+		}
+		return;
 	}
 
-	struct sockaddr_in server;
-	memset(&server, 0, sizeof(struct sockaddr_in));
-	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = inet_addr(config[conf].ip);
-	server.sin_port = htons(config[conf].port);
+	long int status = 0;
+	if ((strncmp(p->conn.buf, "HTTP/1.0 ", 9) == 0) ||
+	    (strncmp(p->conn.buf, "HTTP/1.1 ", 9) == 0)) {
+		status = strtol(&p->conn.buf[9], NULL, 10);
+	}
 
-	struct timespec ts;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 50000000;
+	if (status >= 200 && status <= 299) {
+		/* winner: hand over the connection as it is */
+		int flags = fcntl(p->conn.fd, F_GETFL);
+		if ((epoll_ctl(retry->epfd, EPOLL_CTL_DEL, p->conn.fd, NULL) < 0) ||
+		    (flags < 0) || (fcntl(p->conn.fd, F_SETFL, flags & ~O_NONBLOCK) < 0)) {
+			FAIL("fcntl()");
+		}
+		p->state = PROBE_WON;
+	} else if (status == 429 || status >= 500) {
+		/* the service exists but is busy; try again later */
+		probe_stop(p, PROBE_IDLE);
+	} else {
+		probe_stop(p, PROBE_DEAD);
+	}
+}
 
-	/* Do we need to look up a hostname? */
-	if ((int) server.sin_addr.s_addr == -1) {
-		n = 0;
-		for (;;) {
-			struct hostent *hp = gethostbyname(config[conf].ip);
-			if (hp != NULL) {
-				if (hp->h_length > 0) {
-					/* Got it; use the resulting IP address */
-					server.sin_family = (short unsigned int) (hp->h_addrtype & 0xFFFF);
-					memcpy(&(server.sin_addr.s_addr), hp->h_addr, (size_t) hp->h_length);
-					break;
-				}
-				else {
-					fprintf(stderr, "gethostbyname(): empty response");
-					exit(EXIT_FAILURE);
-				}
+/*
+ * detect_provider() - find out which cloud we're running in
+ * - connects to the metadata endpoints of every candidate provider at once,
+ *   and asks each for its ssh key. The first one to answer with a 2xx
+ *   status wins, all other connections are dropped. Detection therefore
+ *   takes one round trip instead of walking the providers one by one.
+ * - candidates are the `test` entries in test mode, all others otherwise.
+ * - endpoints that are still unreachable are retried with backoff until
+ *   the deadline in `retry`.
+ * - on success, `conn` is the connection of the winner, with the response
+ *   to the ssh key request pending, and its config index is returned.
+ *   Returns -1 if no provider answered.
+ */
+static int detect_provider(bool test, struct http_conn *conn, struct endpoint *server,
+			   struct retry *retry)
+{
+	static struct probe probes[MAX_CONFIGS];
+	struct probe *winner = NULL;
+	int count = 0;
+
+	for (int i = 0; i < MAX_CONFIGS; i++) {
+		if (is_test(i) != test) {
+			continue;
+		}
+
+		struct probe *p = &probes[count];
+		/* endpoints given by name would need a lookup first */
+		if (!endpoint_literal(&p->server, config[i].ip, config[i].port)) {
+			continue;
+		}
+
+		p->conf = i;
+		p->state = PROBE_IDLE;
+		memset(&p->timing, 0, sizeof(p->timing));
+		p->conn.fd = -1;
+		p->conn.server = &p->server;
+		p->conn.host = config[i].ip;
+		count++;
+	}
+
+	long long restart = 0;
+
+	while (!winner) {
+		long long now = now_ms();
+		long long wake = retry->deadline;
+		bool alive = false;
+
+		if (now >= retry->deadline) {
+			errno = ETIMEDOUT;
+			break;
+		}
+
+		bool start = false;
+		for (int i = 0; i < count; i++) {
+			if (probes[i].state == PROBE_IDLE && now >= restart) {
+				start = true;
+				restart = now + retry_backoff(retry);
+				break;
 			}
+		}
 
-			if ((h_errno != TRY_AGAIN) && (h_errno != NO_RECOVERY)) {
-				herror("gethostbyname()");
-				exit(EXIT_FAILURE);
+		for (int i = 0; i < count; i++) {
+			struct probe *p = &probes[i];
+			if (p->state == PROBE_IDLE && start) {
+				probe_start(p, retry);
 			}
-			nanosleep(&ts, NULL);
-			if (++n > 2000) { /* 100 secs */
-				herror("gethostbyname()");
-				exit(EXIT_FAILURE);
+			if ((p->state == PROBE_CONNECTING || p->state == PROBE_WAITING) &&
+			    (now - p->started >= ATTEMPT_TIMEOUT)) {
+				probe_stop(p, PROBE_IDLE);
+			}
+
+			if (p->state == PROBE_IDLE && restart < wake) {
+				wake = restart;
+			} else if (p->state == PROBE_CONNECTING || p->state == PROBE_WAITING) {
+				if (p->started + ATTEMPT_TIMEOUT < wake) {
+					wake = p->started + ATTEMPT_TIMEOUT;
+				}
+			}
+			if (p->state != PROBE_DEAD) {
+				alive = true;
 			}
 		}
-	}
 
-	for (;;) {
-		int r = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
-		if (r == 0) {
+		if (!alive) {
+			errno = ENOENT;
 			break;
 		}
-		if ((errno != EAGAIN) && (errno != ENETUNREACH) && (errno != ETIMEDOUT)) {
-			FAIL("connect()");
+
+		struct epoll_event events[MAX_CONFIGS + 1];
+		int n = epoll_wait(retry->epfd, events, MAX_CONFIGS + 1,
+				   wake > now ? (int)(wake - now) : 0);
+		for (int e = 0; e < n; e++) {
+			if (events[e].data.fd == retry->nlfd) {
+				/* the network changed; retry unreachable endpoints now */
+				retry_drain(retry);
+				restart = 0;
+				continue;
+			}
+			for (int i = 0; i < count; i++) {
+				struct probe *p = &probes[i];
+				if (p->conn.fd == events[e].data.fd &&
+				    (p->state == PROBE_CONNECTING || p->state == PROBE_WAITING)) {
+					probe_event(p, retry);
+					if (p->state == PROBE_WON) {
+						winner = p;
+					}
+					break;
+				}
+			}
+			if (winner) {
+				break;
+			}
 		}
-		nanosleep(&ts, NULL);
-		if (++n > 2400) { /* 120 secs - any used up in gethostbyname */
-			FAIL("timeout in connect()");
+	}
+
+	/* cancel the losers */
+	for (int i = 0; i < count; i++) {
+		if (&probes[i] != winner) {
+			probe_stop(&probes[i], PROBE_DEAD);
 		}
 	}
 
-	/* First, request the OpenSSH pubkey */
-	if (asprintf(&request, "GET %s HTTP/1.1\r\nhost: %s\r\nConnection: keep-alive\r\n\r\n",
-			config[conf].request_sshkey_path, config[conf].ip) < 0) {
-		FAIL("asprintf");
+	if (!winner) {
+		return -1;
 	}
 
-	size_t len = strlen(request);
+	*server = winner->server;
+	*conn = winner->conn;
+	conn->server = server;
+	conn->retry = retry;
+	http_timeout(conn->fd);
+	conn->keep_alive = true;
+	conn->requests = 1;
+	conn->pending = 1;
+
+	struct http_timing *t = http_timing_add(config[winner->conf].request_sshkey_path);
+	*t = winner->timing;
+	t->path = config[winner->conf].request_sshkey_path;
+	t->conn = http_timing_conn();
+	return winner->conf;
+}
 
-	if (write(sockfd, request, len) < (ssize_t)len) {
-		close(sockfd);
-		FAIL("write()");
+/*
+ * persist_copy() - save `len` bytes at `off` in fd to `path`, after `header`
+ * - runs in a child process, so ucd can start on the memfd right away.
+ * - the file is written under a temporary name and renamed into place,
+ *   so it only appears once complete.
+ * - sendfile() is given its own offset, the file offset of fd is shared
+ *   with ucd and must not move.
+ * - returns the pid of the child, or -1.
+ */
+static pid_t persist_copy(int fd, const char *path, const char *header, off_t off, off_t len)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		return -1;
+	} else if (pid > 0) {
+		return pid;
 	}
 
-	FILE *f = fdopen(sockfd, "r");
-	if (!f) {
-		close(sockfd);
-		FAIL("fdopen()");
+	char *tmp;
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		_exit(EXIT_FAILURE);
 	}
-
-	size_t cl;
-	int result = parse_headers(f, &cl);
-	if (result != 1) {
-		fclose(f);
-		FAIL("parse_headers()");
+	int out = mkstemp(tmp);
+	if (out < 0) {
+		perror("mkstemp()");
+		_exit(EXIT_FAILURE);
 	}
 
-	int out;
-	(void) mkdir(USER_DATA_PATH, 0);
-	if (asprintf(&outpath, "%s/%s-user-data", USER_DATA_PATH, config[conf].name) < 0) {
-		fclose(f);
-		FAIL("asprintf()");
+	if (header && dprintf(out, "%s", header) < 0) {
+		goto fail;
 	}
-	/* Special case for testing -- can't use/don't need privileged directory */
-	if (0 == strcmp(config[conf].name, "test")) {
-		if (asprintf(&outpath, "%s-user-data", config[conf].name) < 0) {
-			fclose(f);
-			FAIL("asprintf()");
+	off_t end = off + len;
+	while (off < end) {
+		ssize_t r = sendfile(out, fd, &off, (size_t)(end - off));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			goto fail;
 		}
 	}
-	(void) unlink(outpath);
-	out = open(outpath, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
-	if (out < 0) {
-		fclose(f);
-		FAIL("open()");
+	if ((fsync(out) != 0) || (close(out) != 0) || (rename(tmp, path) != 0)) {
+		goto fail;
 	}
+	_exit(EXIT_SUCCESS);
 
-	/* Insert cloud-config header above SSH key. */
-	len = strlen(config[conf].cloud_config_header);
-	if (write(out, config[conf].cloud_config_header, len) < (ssize_t)len) {
-		close(out);
-		fclose(f);
-		unlink(outpath);
-		FAIL("write()");
+fail:
+	perror("persist_copy()");
+	(void) unlink(tmp);
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * run_ucd() - run ucd with argv and wait for it
+ * - ucd is a child rather than exec'd, so the cache is only written once
+ *   it applied the user data.
+ * - returns its exit status, or -1 if it could not be run or was killed.
+ */
+static int run_ucd(char *const argv[])
+{
+	int status;
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		return -1;
+	} else if (pid == 0) {
+		(void) execv(argv[0], argv);
+		perror("exec()");
+		_exit(127);
 	}
 
-	/* Write out SSH keys */
-	if (write_lines(out, f, cl, "  - ") != 0) {
-		close(out);
-		fclose(f);
-		unlink(outpath);
-		FAIL("write_lines()");
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			perror("waitpid()");
+			return -1;
+		}
 	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
-	close(sockfd);
+/*
+ * fetch_cache: what the previous run fetched, kept in <name>-fetch-cache
+ * - a few "key value" lines: the instance-id, the validators of the
+ *   user-data response and the hash of the whole output, then an empty
+ *   line, then the user-data body as it was written to the output.
+ * - fd is the open cache file, -1 if there is none; the body is the
+ *   `body_len` bytes at `body` in it.
+ */
+struct fetch_cache {
+	int fd;
+	off_t body;
+	off_t body_len;
+	char instance_id[128];
+	char etag[128];
+	char last_modified[64];
+	unsigned long long hash;
+};
 
-	/* reopen socket */
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		FAIL("socket()");
+static void cache_load(struct fetch_cache *cache, const char *path)
+{
+	char buf[1024];
+	struct stat st;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (cache->fd < 0) {
+		return;
 	}
 
-	n = 0;
-	for (;;) {
-		int r = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
-		if (r == 0) {
-			break;
+	ssize_t r = pread(cache->fd, buf, sizeof(buf) - 1, 0);
+	char *end = (r > 0) ? (buf[r] = 0, strstr(buf, "\n\n")) : NULL;
+	if (!end || fstat(cache->fd, &st) != 0) {
+		/* not one of ours; ignore it */
+		close(cache->fd);
+		cache->fd = -1;
+		return;
+	}
+	cache->body = end - buf + 2;
+	cache->body_len = st.st_size - cache->body;
+	end[1] = 0;
+
+	for (char *line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		if (strncmp(line, "instance-id ", 12) == 0) {
+			http_header_value(cache->instance_id, sizeof(cache->instance_id), &line[12]);
+		} else if (strncmp(line, "etag ", 5) == 0) {
+			http_header_value(cache->etag, sizeof(cache->etag), &line[5]);
+		} else if (strncmp(line, "last-modified ", 14) == 0) {
+			http_header_value(cache->last_modified, sizeof(cache->last_modified), &line[14]);
+		} else if (strncmp(line, "hash ", 5) == 0) {
+			cache->hash = strtoull(&line[5], NULL, 16);
 		}
-		if ((errno != EAGAIN) && (errno != ENETUNREACH) && (errno != ETIMEDOUT)) {
-			FAIL("connect()");
+	}
+}
+
+/* add everything written to fd to the FNV-1a hash */
+static int hash_output(int fd, unsigned long long *hash)
+{
+	char buf[65536];
+	off_t off = 0;
+
+	for (;;) {
+		ssize_t r = pread(fd, buf, sizeof(buf), off);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r < 0) {
+			return 1;
+		} else if (r == 0) {
+			return 0;
 		}
-		nanosleep(&ts, NULL);
-		if (++n > 200) { /* 10 secs */
-			FAIL("timeout in connect()");
+		for (ssize_t i = 0; i < r; i++) {
+			*hash = (*hash ^ (unsigned char)buf[i]) * FNV_PRIME;
 		}
+		off += r;
 	}
+}
 
-	/* next, get hostname */
-	if (!config[conf].request_hostname_path)
-		goto user_data;
+/* whether the `len` bytes at `off` in fd are gzip or zstd compressed */
+static bool is_compressed(int fd, off_t off, off_t len)
+{
+	unsigned char magic[4];
 
-	if (asprintf(&request2, "GET %s HTTP/1.1\r\nhost: %s \r\nConnection: keep-alive\r\n\r\n",
-				config[conf].request_hostname_path, config[conf].ip) < 0) {
-		FAIL("asprintf");
+	if ((len < (off_t)sizeof(magic)) || (pread(fd, magic, sizeof(magic), off) != sizeof(magic))) {
+		return false;
 	}
-	len = strlen(request2);
+	return ((magic[0] == 0x1f) && (magic[1] == 0x8b)) ||
+	       ((magic[0] == 0x28) && (magic[1] == 0xb5) && (magic[2] == 0x2f) && (magic[3] == 0xfd));
+}
+
+/* copy the `len` bytes at `off` in fd to the current offset of out */
+static int copy_range(int out, int fd, off_t off, off_t len)
+{
+	off_t end = off + len;
 
-	if (write(sockfd, request2, len) < (ssize_t)len) {
-		close(sockfd);
-		FAIL("write()");
+	while (off < end) {
+		ssize_t r = sendfile(out, fd, &off, (size_t)(end - off));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			return 1;
+		}
 	}
+	return 0;
+}
 
-	f = fdopen(sockfd, "r");
-	if (!f) {
-		close(sockfd);
-		FAIL("fdopen()");
+/*
+ * get_instance_id() - fetch the instance-id of the machine into id
+ * - id is left empty if the provider has none or it can't be had.
+ */
+static void get_instance_id(struct http_conn *conn, const char *path, char *id, size_t size)
+{
+	struct http_body body;
+
+	id[0] = 0;
+	if (!path || http_get(conn, path, &body) != 1) {
+		return;
 	}
 
-	/* parse/discard the header and body */
-	result = parse_headers(f, &cl);
-	if (result == 0) {
-		/* error - exit */
-		fclose(f);
-		close(out);
-		FAIL("parse_headers()");
+	char line[256];
+	if (http_body_getline(conn, &body, line, sizeof(line)) > 0) {
+		http_header_value(id, size, line);
 	}
+	/* skip anything after the first line */
+	while (http_body_getline(conn, &body, line, sizeof(line)) > 0)
+		;
+	if (!conn->keep_alive) {
+		http_close(conn);
+	}
+}
 
-	/* don't write part #2 if 404 or some non-error */
-	if ((result != 2) && (write_lines(out, f, cl, "hostname: ") != 0)) {
-		close(out);
-		fclose(f);
-		unlink(outpath);
-		FAIL("write_lines()");
+static struct option opts[] = {
+	{ "persist", no_argument, NULL, 'p' },
+	{ "timing",  no_argument, NULL, 't' },
+	{ "help",    no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[]) {
+	int conf = -1;
+	bool detect = false;
+	bool persist = false;
+	bool timing = false;
+	char *outpath;
+	int c;
+
+	(void) now_us();
+
+	while ((c = getopt_long(argc, argv, "pth", opts, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			persist = true;
+			break;
+		case 't':
+			timing = true;
+			break;
+		case 'h':
+			fprintf(stderr, "Usage: ucd-userdata-fetch [--persist] [--timing] <cloud service provider name>\n"
+				"  -p, --persist  also save the user-data to " USER_DATA_PATH "/<name>-user-data\n"
+				"  -t, --timing   also save the request timings to " USER_DATA_PATH "/<name>-fetch-timing.json\n"
+				"Known cloud service provider names:\n");
+			for (int i = 0; i < MAX_CONFIGS; i++)
+				fprintf(stderr, "      - %s\n", config[i].name);
+			fprintf(stderr, "      - auto (detect the cloud service provider)\n");
+			exit(EXIT_SUCCESS);
+		default:
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	/* cleanup */
-	fclose(f);
+	if (argc - optind != 1) {
+		FAIL("No cloud service provider passed as argument, unable to continue\n");
+	}
+	const char *name = argv[optind];
 
-	/* reopen socket */
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd < 0) {
-		FAIL("socket()");
+	if ((strcmp(name, "auto") == 0) ||
+	    (strcmp(name, "test-auto") == 0)) {
+		detect = true;
 	}
 
-	n = 0;
-	for (;;) {
-		int r = connect(sockfd, (struct sockaddr *)&server, sizeof(server));
-		if (r == 0) {
+	for (int i = 0; i < MAX_CONFIGS; i++) {
+		if (strcmp(name, config[i].name) == 0) {
+			conf = i;
 			break;
 		}
-		if ((errno != EAGAIN) && (errno != ENETUNREACH) && (errno != ETIMEDOUT)) {
-			FAIL("connect()");
+	}
+
+	if (conf == -1 && !detect) {
+		fprintf(stderr, "Unknown cloud service provider name: %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	/* report how long each request took, whichever way this ends */
+	char *timing_path = NULL;
+	if (timing) {
+		int ret;
+		if ((conf >= 0) ? is_test(conf) : (strcmp(name, "auto") != 0)) {
+			ret = asprintf(&timing_path, "%s-fetch-timing.json", name);
+		} else {
+			ret = asprintf(&timing_path, "%s/%s-fetch-timing.json", USER_DATA_PATH, name);
 		}
-		nanosleep(&ts, NULL);
-		if (++n > 200) { /* 10 secs */
-			FAIL("timeout in connect()");
+		if (ret < 0) {
+			FAIL("asprintf()");
 		}
 	}
+	/*
+	 * One deadline covers the name lookup, every connect, and every
+	 * request retried because the service was busy or stalled.
+	 */
+	static struct retry retry;
+	srandom((unsigned int)(getpid() ^ now_ms()));
+	retry_init(&retry, FETCH_TIMEOUT);
+	http_timing_init(name, timing_path, &retry);
+
+	static struct endpoint server;
+	static struct http_conn conn;
+
+	if (detect) {
+		conf = detect_provider(strcmp(name, "auto") != 0, &conn, &server, &retry);
+		if (conf < 0) {
+			FAIL("detect_provider()");
+		}
+		fprintf(stderr, "Detected cloud service provider: %s\n", config[conf].name);
+		goto connected;
+	}
 
-user_data:
-	/* next, get user-data */
-	if (!config[conf].request_userdata_path)
-		goto finish;
+	/* Do we need to look up a hostname? */
+	if (!endpoint_literal(&server, config[conf].ip, config[conf].port)) {
+		/* the test templates bring their own nameserver */
+		const char *dns_server = is_test(conf) ? getenv("UCD_DNS_SERVER") : NULL;
+		if (!resolve(&server, config[conf].ip, config[conf].port, dns_server, &retry)) {
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if (asprintf(&request3, "GET %s HTTP/1.1\r\nhost: %s \r\nConnection: keep-alive\r\n\r\n",
-			config[conf].request_userdata_path, config[conf].ip) < 0) {
-		FAIL("asprintf");
+	conn.server = &server;
+	conn.host = config[conf].ip;
+	conn.retry = &retry;
+	http_connect(&conn);
+
+connected:
+	conn.pipeline = true;
+
+	/* what the last run got, so unchanged user-data isn't fetched again */
+	char *cachepath;
+	int ret;
+	if (is_test(conf)) {
+		ret = asprintf(&cachepath, "%s-fetch-cache", name);
+	} else {
+		ret = asprintf(&cachepath, "%s/%s-fetch-cache", USER_DATA_PATH, name);
+	}
+	if (ret < 0) {
+		FAIL("asprintf()");
 	}
-	len = strlen(request3);
+	static struct fetch_cache cache;
+	cache_load(&cache, cachepath);
+	if ((cache.fd >= 0) && (cache.etag[0] || cache.last_modified[0])) {
+		conn.if_path = config[conf].request_userdata_path;
+		snprintf(conn.if_headers, sizeof(conn.if_headers), "%s%s%s%s%s%s",
+			 cache.etag[0] ? "If-None-Match: " : "", cache.etag,
+			 cache.etag[0] ? "\r\n" : "",
+			 cache.last_modified[0] ? "If-Modified-Since: " : "", cache.last_modified,
+			 cache.last_modified[0] ? "\r\n" : "");
+	}
+
+	/* Send all requests up front; the responses arrive in this order */
+	const char *paths[4];
+	int count = 0;
+	/* after detection, the ssh key request is already on its way */
+	if (conn.pending == 0)
+		paths[count++] = config[conf].request_sshkey_path;
+	if (config[conf].request_hostname_path)
+		paths[count++] = config[conf].request_hostname_path;
+	if (config[conf].request_userdata_path)
+		paths[count++] = config[conf].request_userdata_path;
+	if (config[conf].request_instance_id_path)
+		paths[count++] = config[conf].request_instance_id_path;
+	http_pipeline(&conn, paths, count);
 
-	if (write(sockfd, request3, len) < (ssize_t)len) {
-		close(sockfd);
-		FAIL("write()");
+	/* First, request the OpenSSH pubkey */
+	struct http_body body;
+	int result = http_get(&conn, config[conf].request_sshkey_path, &body);
+	if (result != 1) {
+		http_close(&conn);
+		FAIL("parse_headers()");
 	}
 
-	f = fdopen(sockfd, "r");
-	if (!f) {
-		close(sockfd);
-		FAIL("fdopen()");
+	int out = -1;
+	(void) mkdir(USER_DATA_PATH, 0);
+	/* named after the argument, so `auto` keeps writing to the same file */
+	if (asprintf(&outpath, "%s/%s-user-data", USER_DATA_PATH, name) < 0) {
+		http_close(&conn);
+		FAIL("asprintf()");
+	}
+	/* Special case for testing -- can't use/don't need privileged directory */
+	if (is_test(conf)) {
+		if (asprintf(&outpath, "%s-user-data", name) < 0) {
+			http_close(&conn);
+			FAIL("asprintf()");
+		}
 	}
 
-	/* parse/discard the header and body */
-	result = parse_headers(f, &cl);
-	if (result == 0) {
-		/* error - exit */
-		fclose(f);
-		close(out);
-		FAIL("parse_headers()");
+	/*
+	 * Hand the user-data to ucd in memory: the memfd is inherited across
+	 * exec, so ucd never has to go to the root filesystem for it.
+	 */
+	if (!is_test(conf)) {
+		out = memfd_create("user-data", 0);
+		if (out < 0) {
+			perror("memfd_create(), falling back to a file");
+		}
+	}
+	bool memfd = (out >= 0);
+
+	if (!memfd) {
+		(void) unlink(outpath);
+		/* read-write, so the last byte written can be checked */
+		out = open(outpath, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		if (out < 0) {
+			http_close(&conn);
+			FAIL("open()");
+		}
 	}
 
-	/* don't write part #2 if 404 or some non-error */
-	if ((result != 2) && (write_lines(out, f, cl, NULL) != 0)) {
+	/* the prefixed sections are small, collect them for one writev() */
+	static struct out_buf ob;
+	ob.fd = out;
+
+	/* Insert cloud-config header above SSH key. */
+	(void) out_add(&ob, config[conf].cloud_config_header,
+			strlen(config[conf].cloud_config_header), false);
+
+	/* Write out SSH keys */
+	if (write_lines(&ob, &conn, &body, "  - ") != 0) {
 		close(out);
-		fclose(f);
+		http_close(&conn);
 		unlink(outpath);
 		FAIL("write_lines()");
 	}
 
+	/* next, get hostname, on the same connection */
+	if (config[conf].request_hostname_path) {
+		result = http_get(&conn, config[conf].request_hostname_path, &body);
+		if (result == 0) {
+			/* error - exit */
+			http_close(&conn);
+			close(out);
+			FAIL("parse_headers()");
+		}
+
+		/* don't write part #2 if 404 or some non-error */
+		if ((result != 2) && (write_lines(&ob, &conn, &body, "hostname: ") != 0)) {
+			close(out);
+			http_close(&conn);
+			unlink(outpath);
+			FAIL("write_lines()");
+		}
+	}
+
+	if (out_flush(&ob) != 0) {
+		close(out);
+		http_close(&conn);
+		unlink(outpath);
+		FAIL("writev()");
+	}
+
+	/* next, get user-data, which can be large: stream it as is */
+	static struct http_body ud;
+	off_t ud_start = lseek(out, 0, SEEK_CUR);
+	if (config[conf].request_userdata_path) {
+		result = http_get(&conn, config[conf].request_userdata_path, &ud);
+		if (result == 0) {
+			/* error - exit */
+			http_close(&conn);
+			close(out);
+			FAIL("parse_headers()");
+		}
+
+		if (ud.status == 304) {
+			/* not modified: use the body we got last time */
+			if (!ud.etag[0] && !ud.last_modified[0]) {
+				strcpy(ud.etag, cache.etag);
+				strcpy(ud.last_modified, cache.last_modified);
+			}
+			if (copy_range(out, cache.fd, cache.body, cache.body_len) != 0) {
+				close(out);
+				http_close(&conn);
+				unlink(outpath);
+				FAIL("sendfile()");
+			}
+		/* don't write part #3 if 404 or some non-error */
+		} else if ((result != 2) && (http_stream_body(out, &conn, &ud) != 0)) {
+			close(out);
+			http_close(&conn);
+			unlink(outpath);
+			FAIL("http_stream_body()");
+		}
+	}
+	off_t ud_end = lseek(out, 0, SEEK_CUR);
+
+	/*
+	 * Compressed user-data can't be appended to the text above: it is
+	 * moved to a document of its own, which ucd decompresses as it
+	 * reads it.
+	 */
+	int zout = -1;
+	char *zpath;
+	if (asprintf(&zpath, "%s-compressed", outpath) < 0) {
+		FAIL("asprintf()");
+	}
+	if (is_compressed(out, ud_start, ud_end - ud_start)) {
+		if (memfd) {
+			zout = memfd_create("user-data-compressed", 0);
+		} else {
+			(void) unlink(zpath);
+			zout = open(zpath, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+		}
+		if ((zout < 0) ||
+		    (copy_range(zout, out, ud_start, ud_end - ud_start) != 0) ||
+		    (ftruncate(out, ud_start) != 0) ||
+		    (lseek(out, ud_start, SEEK_SET) < 0)) {
+			close(out);
+			http_close(&conn);
+			unlink(outpath);
+			FAIL("compressed user-data");
+		}
+	} else if (ud_end > ud_start) {
+		/* Make sure the file ends with a newline */
+		char c;
+		if ((pread(out, &c, 1, ud_end - 1) != 1) ||
+		    ((c != '\n') && (write(out, "\n", 1) != 1))) {
+			close(out);
+			http_close(&conn);
+			unlink(outpath);
+			FAIL("write()");
+		}
+		ud_end = lseek(out, 0, SEEK_CUR);
+	}
+
+	/* last, the instance-id, which tells whether this is the same machine */
+	char instance_id[128];
+	get_instance_id(&conn, config[conf].request_instance_id_path, instance_id, sizeof(instance_id));
+
 	/* cleanup */
-	close(out);
-	fclose(f);
+	http_close(&conn);
+	retry_free(&retry);
+
+	/*
+	 * Same instance, same output: everything in it was applied already,
+	 * skip running ucd over it again.
+	 */
+	unsigned long long hash = FNV_OFFSET;
+	if ((hash_output(out, &hash) != 0) || ((zout >= 0) && (hash_output(zout, &hash) != 0))) {
+		close(out);
+		unlink(outpath);
+		FAIL("pread()");
+	}
+	if (instance_id[0] && (strcmp(instance_id, cache.instance_id) == 0) && (hash == cache.hash)) {
+		fprintf(stderr, "User data of instance %s unchanged, not running ucd\n", instance_id);
+		close(out);
+		return 0;
+	}
 
-finish:
+	http_timing_report();
+
+	char fdarg[16];
+	char zfdarg[16];
+	snprintf(fdarg, sizeof(fdarg), "%d", out);
+	snprintf(zfdarg, sizeof(zfdarg), "%d", zout);
+	char *const file_argv[] = { BINDIR "/ucd", "-u", outpath, zout >= 0 ? "-u" : NULL, zpath, NULL };
+	char *const fd_argv[] = { BINDIR "/ucd", "--user-data-fd", fdarg,
+				  zout >= 0 ? "--user-data-fd" : NULL, zfdarg, NULL };
+
+	if (memfd && persist) {
+		(void) persist_copy(out, outpath, NULL, 0, lseek(out, 0, SEEK_END));
+		if (zout >= 0) {
+			(void) persist_copy(zout, zpath, NULL, 0, lseek(zout, 0, SEEK_END));
+		}
+	}
 
 	/* Don't run ucd for the test template */
-	if (strcmp(config[conf].name, "test") != 0) {
-		(void) execl(BINDIR "/ucd", BINDIR "/ucd", "-u", outpath, (char *)NULL);
-		FAIL("exec()");
+	int status = is_test(conf) ? 0 : run_ucd(memfd ? fd_argv : file_argv);
+	if (status != 0) {
+		/* not cached: the next boot applies it again */
+		fprintf(stderr, "ucd failed, user data of instance %s not marked as applied\n", instance_id);
+		return EXIT_FAILURE;
 	}
 
+	/* only now is the user data known to be applied */
+	char *header;
+	if (asprintf(&header, "instance-id %s\netag %s\nlast-modified %s\nhash %016llx\n\n",
+			instance_id, ud.etag, ud.last_modified, hash) < 0) {
+		FAIL("asprintf()");
+	}
+	pid_t pid;
+	if (zout >= 0) {
+		pid = persist_copy(zout, cachepath, header, 0, ud_end - ud_start);
+	} else {
+		pid = persist_copy(out, cachepath, header, ud_start, ud_end - ud_start);
+	}
+	if (pid > 0) {
+		(void) waitpid(pid, NULL, 0);
+	}
+	free(header);
+	close(out);
+	if (zout >= 0) {
+		close(zout);
+	}
 	return 0;
 }
@@ -36,10 +36,14 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 
 #include "lib.h"
+#include "decompress.h"
 #include "interpreters.h"
 #include "handlers.h"
 
@@ -47,21 +51,32 @@
 
 gboolean userdata_process_file(const gchar* filename) {
 	char shebang[LINE_MAX] = { 0 };
+	gboolean result = false;
 
-	FILE *userdata_file = fopen(filename, "rb");
-	if (!userdata_file) {
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		LOG(MOD "File not found '%s'\n", filename);
 		return false;
 	}
 
-	LOG(MOD "Looking for shebang file %s\n", filename);
-	if (!fgets(shebang, LINE_MAX, userdata_file)) {
-		LOG(MOD "Empty userdata file or read error '%s'\n", filename);
+	/*
+	 * Pipes and sockets can't be opened again from the start once the
+	 * shebang is read: whatever is in them is processed as it arrives.
+	 */
+	struct stat st;
+	bool seekable = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+
+	/* gzip or zstd compressed user data is recognized by its magic bytes */
+	struct decompress* stream = decompress_open(fd);
+	if (!stream) {
+		LOG(MOD "Unsupported compressed userdata file '%s'\n", filename);
 		return false;
 	}
 
-	if (fclose(userdata_file) == EOF) {
-		LOG(MOD "Cannot close file '%s'\n", filename);
+	LOG(MOD "Looking for shebang file %s\n", filename);
+	if (decompress_peek_line(stream, shebang, LINE_MAX) <= 0) {
+		LOG(MOD "Empty userdata file or read error '%s'\n", filename);
+		decompress_close(stream);
 		return false;
 	}
 
@@ -70,10 +85,30 @@ gboolean userdata_process_file(const gchar* filename) {
 	/* built-in interpreters */
 	for (int i = 0; interpreter_structs[i] != NULL; ++i) {
 		if (g_str_has_prefix(shebang, interpreter_structs[i]->shebang)) {
-			return interpreter_structs[i]->handler(filename) != EXIT_SUCCESS ? false : true;
+			int r;
+			if (seekable && decompress_format(stream) == DECOMPRESS_NONE) {
+				/* plain files are handed over as they are */
+				r = interpreter_structs[i]->handler(filename);
+			} else {
+				r = interpreter_structs[i]->stream_handler(stream, filename);
+			}
+			result = r != EXIT_SUCCESS ? false : true;
+			decompress_close(stream);
+			return result;
 		}
 	}
 
 	LOG(MOD "No interpreter found for %s\n", shebang);
+	decompress_close(stream);
 	return false;
 }
+
+gchar* userdata_fd_path(int fd) {
+	/*
+	 * The interpreters work on file names: use the /proc path of the
+	 * descriptor. It is named by our pid rather than "self", so it
+	 * remains valid in the child processes they spawn, which don't
+	 * inherit the descriptor.
+	 */
+	return g_strdup_printf("/proc/%d/fd/%d", (int)getpid(), fd);
+}
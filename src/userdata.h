@@ -37,3 +37,4 @@
 #include <glib.h>
 
 gboolean userdata_process_file(const gchar* filename);
+gchar* userdata_fd_path(int fd);
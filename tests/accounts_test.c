@@ -0,0 +1,303 @@
+/***
+ Copyright © 2015 Intel Corporation
+
+ Author: Julio Montes <julio.montes@intel.com>
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <check.h>
+#include <glib.h>
+
+#include "accounts.h"
+
+/* a system root with a few accounts, in a new directory */
+static gchar* make_root(void) {
+	gchar* root = g_strdup("/tmp/test_accounts-XXXXXX");
+	ck_assert(mkdtemp(root) != NULL);
+
+	gchar* etc = g_build_filename(root, "etc", NULL);
+	ck_assert(mkdir(etc, 0755) == 0);
+	const gchar* files[][2] = {
+		{ "passwd", "root:x:0:0:root:/root:/bin/bash\n# comment\nold:x:1000:1000::/home/old:/bin/sh\n" },
+		{ "shadow", "root:*:19000::::::\nold:!:19000:0:99999:7:::\n" },
+		{ "group", "root:x:0:\nwheel:x:10:root\nold:x:1000:\n" },
+		{ "gshadow", "root:::\nwheel:::root\nold:!::\n" },
+		{ "subuid", "old:100000:65536\n" },
+		{ "login.defs", "UID_MIN 1000\nUID_MAX 60000\nCREATE_HOME no\n" },
+	};
+	for (size_t i = 0; i < G_N_ELEMENTS(files); i++) {
+		gchar* path = g_build_filename(etc, files[i][0], NULL);
+		ck_assert(g_file_set_contents(path, files[i][1], -1, NULL));
+		ck_assert(chmod(path, g_str_has_suffix(path, "shadow") ? 0600 : 0644) == 0);
+		g_free(path);
+	}
+	g_free(etc);
+	return root;
+}
+
+static gchar* read_file(const gchar* root, const gchar* name) {
+	gchar* contents = NULL;
+	gchar* path = g_build_filename(root, "etc", name, NULL);
+	ck_assert(g_file_get_contents(path, &contents, NULL, NULL));
+	g_free(path);
+	return contents;
+}
+
+static void remove_root(gchar* root) {
+	gchar* command = g_strdup_printf("rm -rf '%s'", root);
+	ck_assert(system(command) == 0);
+	g_free(command);
+	g_free(root);
+}
+
+START_TEST(test_accounts_add_user)
+{
+	gchar* root = make_root();
+	struct accounts* a = accounts_open(root);
+	ck_assert(a != NULL);
+
+	ck_assert(accounts_add_group(a, "docker", false));
+	/* like groupadd -f */
+	ck_assert(accounts_add_group(a, "docker", false));
+
+	struct account_user user = ACCOUNT_USER_INIT;
+	user.name = "alice";
+	user.gecos = "Alice";
+	user.shell = "/bin/bash";
+	user.password = "$6$salt$hash";
+	user.groups = "wheel,docker,missing";
+	ck_assert(accounts_add_user(a, &user));
+	ck_assert(accounts_has_user(a, "alice"));
+	/* users can't be added twice, nor can they have a colon in a field */
+	ck_assert(!accounts_add_user(a, &user));
+	user.name = "bob";
+	user.gecos = "Bob:Smith";
+	ck_assert(!accounts_add_user(a, &user));
+	ck_assert(!accounts_has_user(a, "bob"));
+
+	ck_assert(accounts_lock_password(a, "alice"));
+	ck_assert(accounts_set_expire(a, "alice", 1));
+	ck_assert(accounts_set_password(a, "root", "!"));
+	ck_assert(!accounts_add_member(a, "wheel", "nobody"));
+
+	/* nothing is written before the commit */
+	gchar* passwd = read_file(root, "passwd");
+	ck_assert(strstr(passwd, "alice") == NULL);
+	g_free(passwd);
+
+	ck_assert(accounts_commit(a));
+	accounts_close(a);
+
+	passwd = read_file(root, "passwd");
+	ck_assert_str_eq(passwd, "root:x:0:0:root:/root:/bin/bash\n# comment\n"
+		"old:x:1000:1000::/home/old:/bin/sh\n"
+		"alice:x:1001:1002:Alice:/home/alice:/bin/bash\n");
+	gchar* group = read_file(root, "group");
+	ck_assert_str_eq(group, "root:x:0:\nwheel:x:10:root,alice\nold:x:1000:\n"
+		"docker:x:1001:alice\nalice:x:1002:\n");
+	gchar* gshadow = read_file(root, "gshadow");
+	ck_assert_str_eq(gshadow, "root:::\nwheel:::root,alice\nold:!::\n"
+		"docker:!::alice\nalice:!::\n");
+	gchar* shadow = read_file(root, "shadow");
+	gchar** lines = g_strsplit(shadow, "\n", -1);
+	ck_assert_str_eq(lines[0], "root:!:19000::::::");
+	ck_assert(g_str_has_prefix(lines[2], "alice:!$6$salt$hash:"));
+	ck_assert(g_str_has_suffix(lines[2], ":1:"));
+	gchar* subuid = read_file(root, "subuid");
+	ck_assert_str_eq(subuid, "old:100000:65536\nalice:165536:65536\n");
+
+	/* the old files are kept, and the modes too */
+	gchar* backup = read_file(root, "passwd-");
+	ck_assert(strstr(backup, "alice") == NULL);
+	struct stat st;
+	gchar* path = g_build_filename(root, "etc", "shadow", NULL);
+	ck_assert(stat(path, &st) == 0);
+	ck_assert_int_eq(st.st_mode & 0777, 0600);
+	/* no subgid file, so no subordinate gids */
+	g_free(path);
+	path = g_build_filename(root, "etc", "subgid", NULL);
+	ck_assert(access(path, F_OK) != 0);
+
+	g_free(path);
+	g_free(backup);
+	g_free(subuid);
+	g_strfreev(lines);
+	g_free(shadow);
+	g_free(gshadow);
+	g_free(group);
+	g_free(passwd);
+	remove_root(root);
+}
+END_TEST
+
+START_TEST(test_accounts_system_user)
+{
+	gchar* root = make_root();
+	struct accounts* a = accounts_open(root);
+	ck_assert(a != NULL);
+
+	/* system ids are taken from the top of their range */
+	struct account_user user = ACCOUNT_USER_INIT;
+	user.name = "daemon";
+	user.system = true;
+	user.user_group = 0;
+	user.primary_group = "wheel";
+	ck_assert(accounts_add_user(a, &user));
+	ck_assert(accounts_add_group(a, "sys", true));
+
+	ck_assert(accounts_commit(a));
+	accounts_close(a);
+
+	gchar* passwd = read_file(root, "passwd");
+	ck_assert(strstr(passwd, "\ndaemon:x:999:10::/home/daemon:\n") != NULL);
+	gchar* group = read_file(root, "group");
+	ck_assert(strstr(group, "\nsys:x:999:\n") != NULL);
+	/* system users get no subordinate ids */
+	gchar* subuid = read_file(root, "subuid");
+	ck_assert_str_eq(subuid, "old:100000:65536\n");
+
+	g_free(subuid);
+	g_free(group);
+	g_free(passwd);
+	remove_root(root);
+}
+END_TEST
+
+START_TEST(test_accounts_unchanged)
+{
+	gchar* root = make_root();
+	struct accounts* a = accounts_open(root);
+	ck_assert(a != NULL);
+
+	/* files without changes are left alone */
+	ck_assert(accounts_add_group(a, "wheel", false));
+	ck_assert(accounts_commit(a));
+	accounts_close(a);
+
+	gchar* path = g_build_filename(root, "etc", "group-", NULL);
+	ck_assert(access(path, F_OK) != 0);
+	g_free(path);
+	remove_root(root);
+}
+END_TEST
+
+START_TEST(test_accounts_stateless)
+{
+	gchar* root = make_root();
+	const gchar* names[] = { "passwd", "shadow", "group", "gshadow" };
+
+	/* the accounts only in the defaults, as on a stateless first boot */
+	gchar* defaults = g_build_filename(root, "usr", "share", "defaults", "etc", NULL);
+	ck_assert(g_mkdir_with_parents(defaults, 0755) == 0);
+	for (size_t i = 0; i < G_N_ELEMENTS(names); i++) {
+		gchar* from = g_build_filename(root, "etc", names[i], NULL);
+		gchar* to = g_build_filename(defaults, names[i], NULL);
+		ck_assert(rename(from, to) == 0);
+		g_free(to);
+		g_free(from);
+	}
+
+	struct accounts* a = accounts_open(root);
+	ck_assert(a != NULL);
+	struct account_user user = ACCOUNT_USER_INIT;
+	user.name = "alice";
+	user.groups = "wheel";
+	ck_assert(accounts_has_user(a, "old"));
+	ck_assert(accounts_add_user(a, &user));
+	ck_assert(accounts_commit(a));
+	accounts_close(a);
+
+	/* the result goes to /etc, the defaults are left as they were */
+	gchar* passwd = read_file(root, "passwd");
+	ck_assert_str_eq(passwd, "root:x:0:0:root:/root:/bin/bash\n# comment\n"
+		"old:x:1000:1000::/home/old:/bin/sh\n"
+		"alice:x:1001:1001::/home/alice:\n");
+	gchar* group = read_file(root, "group");
+	ck_assert(strstr(group, "\nwheel:x:10:root,alice\n") != NULL);
+	gchar* shadow = read_file(root, "shadow");
+	ck_assert(g_str_has_prefix(shadow, "root:*:19000::::::\n"));
+	struct stat st;
+	gchar* path = g_build_filename(root, "etc", "shadow", NULL);
+	ck_assert(stat(path, &st) == 0);
+	ck_assert_int_eq(st.st_mode & 0777, 0600);
+	g_free(path);
+	gchar* contents = NULL;
+	path = g_build_filename(defaults, "passwd", NULL);
+	ck_assert(g_file_get_contents(path, &contents, NULL, NULL));
+	ck_assert(strstr(contents, "alice") == NULL);
+
+	g_free(contents);
+	g_free(path);
+	g_free(shadow);
+	g_free(group);
+	g_free(passwd);
+	g_free(defaults);
+	remove_root(root);
+}
+END_TEST
+
+Suite* make_accounts_suite(void) {
+	Suite *s;
+	TCase *tc_accounts;
+
+	s = suite_create("accounts");
+
+	tc_accounts = tcase_create("tc_accounts");
+	tcase_add_test(tc_accounts, test_accounts_add_user);
+	tcase_add_test(tc_accounts, test_accounts_system_user);
+	tcase_add_test(tc_accounts, test_accounts_unchanged);
+	tcase_add_test(tc_accounts, test_accounts_stateless);
+
+	suite_add_tcase(s, tc_accounts);
+
+	return s;
+}
+
+int main(void) {
+	int number_failed;
+	Suite* s;
+	SRunner* sr;
+
+	s = make_accounts_suite();
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
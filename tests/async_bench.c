@@ -0,0 +1,336 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+/*
+ * async_bench: stress and latency of async_task
+ *
+ * Pushes N closures (default 2000) with async_task_run() and starts M
+ * children (default 200) with async_task_exec(), from P threads at once
+ * (default 4); half of the children are started by the closures, from the
+ * pool's threads. Then it checks that async_task_finish() returns, and
+ * that each closure and each child ran exactly once, with no child left
+ * to reap. Before that, another M children are started and awaited, a
+ * few at a time. Prints, in microseconds:
+ *
+ *   start    from async_task_run() to the closure running, by priority
+ *   reap     from a child exiting to async_task_await() returning
+ *
+ * and how many tasks went through per second, from the first push to
+ * async_task_finish() returning. The log lines of async_task are
+ * discarded while timing. Exits with 1 if any check fails, and is
+ * killed if async_task_finish() hangs.
+ *
+ * usage: async_bench [N [M [P]]]
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "async_task.h"
+
+/* children started and awaited at a time */
+#define AWAIT_BATCH 16
+/* seconds async_task_finish() and the rest get, before SIGALRM kills us */
+#define WATCHDOG 120
+
+struct closure {
+	int index;
+	enum async_task_priority priority;
+	long long pushed;
+	long long started;
+	int runs;
+	/* child this closure starts itself, or -1 */
+	int child;
+};
+
+static struct {
+	const char *self;
+	const char *log;
+	struct closure *closures;
+	int closures_count;
+	int children_count;
+	int producers;
+} bench;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* run as a child: note index and when it exits in the log file */
+static int child(const char *log, const char *index)
+{
+	char line[64];
+	int fd = open(log, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+	int n = snprintf(line, sizeof(line), "%s %lld\n", index, now_ns());
+	/* one write with O_APPEND: lines of children exiting at once don't mix */
+	bool written = write(fd, line, (size_t)n) == n;
+	close(fd);
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool exec_child(int index)
+{
+	gchar *command = g_strdup_printf("%s child %s %d", bench.self, bench.log, index);
+	bool started = async_task_exec(command, ASYNC_TASK_NORMAL);
+	g_free(command);
+	return started;
+}
+
+static gpointer run_closure(gpointer data)
+{
+	struct closure *c = data;
+	c->started = now_ns();
+	g_atomic_int_inc(&c->runs);
+	if (c->child >= 0) {
+		exec_child(c->child);
+	}
+	return NULL;
+}
+
+/* push every producers-th closure, starting from the one at data */
+static gpointer produce(gpointer data)
+{
+	for (int i = GPOINTER_TO_INT(data); i < bench.closures_count; i += bench.producers) {
+		struct closure *c = &bench.closures[i];
+		c->pushed = now_ns();
+		if (!async_task_run(run_closure, c, c->priority)) {
+			fprintf(stdout, "closure %d not pushed\n", i);
+		}
+		if (i < bench.children_count && i % 2 == 0) {
+			exec_child(i);
+		}
+	}
+	return NULL;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, long long *samples, int count)
+{
+	long long sum = 0;
+
+	if (count == 0) {
+		return;
+	}
+	qsort(samples, (size_t)count, sizeof(*samples), compare);
+	for (int i = 0; i < count; i++) {
+		sum += samples[i];
+	}
+	printf("%-20s %6d  mean %9.1f  p50 %9.1f  p99 %9.1f  max %9.1f\n", name, count,
+	       (double)sum / count / 1000.0, (double)samples[count / 2] / 1000.0,
+	       (double)samples[count * 99 / 100] / 1000.0, (double)samples[count - 1] / 1000.0);
+}
+
+/* exit times of the children in the log, by index; false if any is missing or doubled */
+static bool read_log(long long *exited, int count)
+{
+	bool ok = true;
+	int index;
+	long long ns;
+
+	FILE *f = fopen(bench.log, "r");
+	if (!f) {
+		printf("cannot read %s: %s\n", bench.log, strerror(errno));
+		return false;
+	}
+	while (fscanf(f, "%d %lld", &index, &ns) == 2) {
+		if (index < 0 || index >= count) {
+			printf("unknown child %d\n", index);
+			ok = false;
+		} else if (exited[index]) {
+			printf("child %d ran twice\n", index);
+			ok = false;
+		} else {
+			exited[index] = ns;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+/* start and await children first..first+count-1; returns exit to await times */
+static long long *reap_bench(int first, int count)
+{
+	long long *awaited = g_new0(long long, count);
+	struct async_task *tasks[AWAIT_BATCH];
+
+	for (int i = 0; i < count; i += AWAIT_BATCH) {
+		int batch = MIN(AWAIT_BATCH, count - i);
+		for (int j = 0; j < batch; j++) {
+			gchar *index = g_strdup_printf("%d", first + i + j);
+			const gchar *argv[] = { bench.self, "child", bench.log, index, NULL };
+			tasks[j] = async_task_spawn(argv, ASYNC_TASK_NORMAL);
+			g_free(index);
+		}
+		for (int j = 0; j < batch; j++) {
+			if (tasks[j] && async_task_await(tasks[j]) == 0) {
+				awaited[i + j] = now_ns();
+			}
+		}
+	}
+	return awaited;
+}
+
+int main(int argc, char *argv[])
+{
+	char log[] = "/tmp/async_bench-XXXXXX";
+	bool ok = true;
+
+	if (argc == 4 && strcmp(argv[1], "child") == 0) {
+		return child(argv[2], argv[3]);
+	}
+
+	bench.closures_count = argc > 1 ? atoi(argv[1]) : 2000;
+	bench.children_count = argc > 2 ? atoi(argv[2]) : 200;
+	bench.producers = argc > 3 ? atoi(argv[3]) : 4;
+	bench.children_count = MIN(bench.children_count, bench.closures_count);
+	int logfd = mkstemp(log);
+	int stderr_fd = dup(STDERR_FILENO);
+	/* children run the same binary; argv[0] may not be a path to it */
+	bench.self = realpath("/proc/self/exe", NULL);
+	if (bench.closures_count <= 0 || bench.children_count < 0 || bench.producers <= 0 ||
+	    logfd < 0 || stderr_fd < 0 || !bench.self) {
+		fprintf(stderr, "usage: async_bench [N [M [P]]]\n");
+		return EXIT_FAILURE;
+	}
+	close(logfd);
+	bench.log = log;
+
+	bench.closures = g_new0(struct closure, bench.closures_count);
+	for (int i = 0; i < bench.closures_count; i++) {
+		bench.closures[i].index = i;
+		bench.closures[i].priority = i % 4 == 0 ? ASYNC_TASK_CRITICAL :
+		                             i % 8 == 7 ? ASYNC_TASK_BACKGROUND : ASYNC_TASK_NORMAL;
+		bench.closures[i].child = i < bench.children_count && i % 2 == 1 ? i : -1;
+	}
+
+	int quiet = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	fflush(stderr);
+	dup2(quiet, STDERR_FILENO);
+	alarm(WATCHDOG);
+
+	async_task_init(0);
+
+	/* awaited children are numbered after the rest */
+	long long *awaited = reap_bench(bench.children_count, bench.children_count);
+
+	long long start = now_ns();
+	GThread **threads = g_new0(GThread *, bench.producers);
+	for (int p = 0; p < bench.producers; p++) {
+		threads[p] = g_thread_new("producer", produce, GINT_TO_POINTER(p));
+	}
+	for (int p = 0; p < bench.producers; p++) {
+		g_thread_join(threads[p]);
+	}
+	async_task_finish();
+	long long end = now_ns();
+	bool late = async_task_run(run_closure, &bench.closures[0], ASYNC_TASK_NORMAL);
+
+	alarm(0);
+	dup2(stderr_fd, STDERR_FILENO);
+	close(quiet);
+
+	/* everything ran once, and was waited for */
+	long long *exited = g_new0(long long, 2 * bench.children_count);
+	ok = read_log(exited, 2 * bench.children_count);
+	for (int i = 0; i < 2 * bench.children_count; i++) {
+		if (!exited[i]) {
+			printf("child %d lost\n", i);
+			ok = false;
+		}
+	}
+	for (int i = 0; i < bench.closures_count; i++) {
+		if (bench.closures[i].runs != 1) {
+			printf("closure %d ran %d times\n", i, bench.closures[i].runs);
+			ok = false;
+		}
+	}
+	int status;
+	if (waitpid(-1, &status, WNOHANG) != -1 || errno != ECHILD) {
+		printf("children left to reap\n");
+		ok = false;
+	}
+	if (late) {
+		printf("closure run after async_task_finish()\n");
+		ok = false;
+	}
+
+	static const char *names[] = { "start critical", "start normal", "start background" };
+	long long *samples = g_new0(long long, bench.closures_count);
+	for (int priority = ASYNC_TASK_CRITICAL; priority <= ASYNC_TASK_BACKGROUND; priority++) {
+		int count = 0;
+		for (int i = 0; i < bench.closures_count; i++) {
+			struct closure *c = &bench.closures[i];
+			if ((int)c->priority == priority && c->runs) {
+				samples[count++] = c->started - c->pushed;
+			}
+		}
+		report(names[priority], samples, count);
+	}
+	int count = 0;
+	for (int i = 0; i < bench.children_count; i++) {
+		if (awaited[i] && exited[bench.children_count + i]) {
+			samples[count++] = awaited[i] - exited[bench.children_count + i];
+		}
+	}
+	report("reap", samples, count);
+	printf("%-20s %.0f tasks/s\n", "total",
+	       (double)(bench.closures_count + bench.children_count) * 1e9 / (double)(end - start));
+	printf("%s\n", ok ? "ok" : "FAILED");
+
+	unlink(log);
+	g_free(samples);
+	g_free(exited);
+	g_free(awaited);
+	g_free(threads);
+	g_free(bench.closures);
+	free((char *)bench.self);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+#
+# Stand-in DNS server for fetch_test.
+#
+# Answers A and AAAA queries for a single name over UDP, and records how
+# many queries of each type it got, so the test can check that both are
+# asked for.
+#
+# usage: dns_server.py <address> <port> <stats file> <name> <address>...
+#
+# The addresses given are returned in A or AAAA answers by their family;
+# any other name gets NXDOMAIN.
+
+import ipaddress
+import socket
+import struct
+import sys
+
+address, port, stats_file, name = sys.argv[1], int(sys.argv[2]), sys.argv[3], sys.argv[4]
+records = {1: [], 28: []}
+for a in sys.argv[5:]:
+    ip = ipaddress.ip_address(a)
+    records[1 if ip.version == 4 else 28].append(ip.packed)
+stats = {"queries_A": 0, "queries_AAAA": 0}
+
+
+def parse_question(msg):
+    labels, pos = [], 12
+    while msg[pos]:
+        labels.append(msg[pos + 1:pos + 1 + msg[pos]].decode())
+        pos += msg[pos] + 1
+    qtype, = struct.unpack("!H", msg[pos + 1:pos + 3])
+    return ".".join(labels), qtype, msg[12:pos + 5]
+
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.bind((address, port))
+while True:
+    msg, peer = sock.recvfrom(512)
+    qid, = struct.unpack("!H", msg[:2])
+    qname, qtype, question = parse_question(msg)
+
+    if qtype in records:
+        stats["queries_A" if qtype == 1 else "queries_AAAA"] += 1
+        with open(stats_file, "w") as f:
+            for k, v in stats.items():
+                f.write("%s=%d\n" % (k, v))
+
+    answers = records.get(qtype, []) if qname.rstrip(".") == name else []
+    rcode = 0 if qname.rstrip(".") == name else 3
+    reply = struct.pack("!HHHHHH", qid, 0x8180 | rcode, 1, len(answers), 0, 0) + question
+    for rdata in answers:
+        # name is a pointer to the question
+        reply += struct.pack("!HHHIH", 0xc00c, qtype, 1, 60, len(rdata)) + rdata
+    sock.sendto(reply, peer)
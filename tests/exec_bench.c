@@ -0,0 +1,117 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+
+/*
+ * exec_bench: cost of running one command with exec_task()
+ *
+ * Runs /bin/true N times (default 200) in each of the ways a module can
+ * run a command, and prints the mean wall time per command:
+ *
+ *   argv     exec_task_argv(), spawned directly
+ *   plain    exec_task() with a plain command line, split and spawned
+ *   shell    exec_task() with shell syntax, run by SHELL_PATH -c
+ *
+ * The log lines of exec_task() are discarded while timing.
+ *
+ * usage: exec_bench [N]
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "lib.h"
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const gchar* true_argv[] = { "/bin/true", NULL };
+
+static bool run_argv(void)
+{
+	return exec_task_argv(true_argv);
+}
+
+static bool run_plain(void)
+{
+	return exec_task("/bin/true");
+}
+
+static bool run_shell(void)
+{
+	return exec_task("/bin/true;");
+}
+
+static void bench(const char *name, bool (*run)(void), int count, int log)
+{
+	int quiet = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	int failed = 0;
+
+	fflush(stderr);
+	dup2(quiet, STDERR_FILENO);
+	long long start = now_ns();
+	for (int i = 0; i < count; i++) {
+		if (!run()) {
+			failed++;
+		}
+	}
+	long long end = now_ns();
+	dup2(log, STDERR_FILENO);
+	close(quiet);
+
+	printf("%-8s %8.1f us/command%s\n", name, (double)(end - start) / count / 1000.0,
+	       failed ? " (failures)" : "");
+}
+
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 200;
+	int log = dup(STDERR_FILENO);
+
+	if (count <= 0 || log < 0) {
+		fprintf(stderr, "usage: exec_bench [N]\n");
+		return EXIT_FAILURE;
+	}
+
+	bench("argv", run_argv, count, log);
+	bench("plain", run_plain, count, log);
+	bench("shell", run_shell, count, log);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,366 @@
+/***
+ Copyright © 2019 Intel Corporation
+
+ This file is part of micro-config-drive.
+
+ micro-config-drive is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ micro-config-drive is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with micro-config-drive. If not, see <http://www.gnu.org/licenses/>.
+
+ In addition, as a special exception, the copyright holders give
+ permission to link the code of portions of this program with the
+ OpenSSL library under certain conditions as described in each
+ individual source file, and distribute linked combinations
+ including the two.
+ You must obey the GNU General Public License in all respects
+ for all of the code used other than OpenSSL.  If you modify
+ file(s) with this exception, you may extend this exception to your
+ version of the file(s), but you are not obligated to do so.  If you
+ do not wish to do so, delete this exception statement from your
+ version.  If you delete this exception statement from all source
+ files in the program, then also delete it here.
+***/
+
+/*
+ * fetch_mock: stand-in metadata service for benchmarking ucd-data-fetch
+ *
+ * Serves the files of a directory over HTTP/1.1 with keep-alive, one
+ * connection at a time, and can make itself slow or unreliable in the
+ * ways a metadata service under load is:
+ *
+ *   -a MS      wait MS before accepting each connection
+ *   -t MS      wait MS before answering each request (time to first byte)
+ *   -c BYTES   send bodies BYTES at a time ...
+ *   -i MS      ... waiting MS between them
+ *   -r N       reset the first N connections when their first request arrives
+ *   -e N       answer the first N requests with an error status ...
+ *   -s STATUS  ... STATUS (default 503); 429 comes with a Retry-After
+ *   -n         send an ETag with each file, and answer requests that have
+ *              If-None-Match or If-Modified-Since with 304 Not Modified,
+ *              with the Content-Length of the file but no body
+ *   -o FILE    keep counters of connections, requests, resets, errors and
+ *              304s in FILE
+ *
+ * "listening" is printed once connections can be made.
+ *
+ * usage: fetch_mock [options] <address> <port> <directory>
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#define FAIL(err) do { perror(err); exit(EXIT_FAILURE); } while(0)
+
+#define REQUEST_SIZE 8192
+
+struct options {
+	int accept_delay;
+	int ttfb;
+	size_t chunk;
+	int interval;
+	int resets;
+	int errors;
+	int status;
+	int not_modified;
+	const char *stats;
+};
+
+static struct {
+	int connections;
+	int requests;
+	int resets;
+	int errors;
+	int not_modified;
+} stats;
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void write_stats(const struct options *opt)
+{
+	if (!opt->stats) {
+		return;
+	}
+	/* renamed into place, so a kill never leaves the file half written */
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opt->stats);
+	FILE *f = fopen(tmp, "w");
+	if (!f) {
+		FAIL("fopen()");
+	}
+	fprintf(f, "connections=%d\nrequests=%d\nresets=%d\nerrors=%d\nnot_modified=%d\n",
+		stats.connections, stats.requests, stats.resets, stats.errors, stats.not_modified);
+	fclose(f);
+	if (rename(tmp, opt->stats) < 0) {
+		FAIL("rename()");
+	}
+}
+
+static int send_all(int fd, const char *buf, size_t len, int flags)
+{
+	while (len > 0) {
+		ssize_t w = send(fd, buf, len, MSG_NOSIGNAL | flags);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		} else if (w <= 0) {
+			return -1;
+		}
+		buf += w;
+		len -= (size_t)w;
+	}
+	return 0;
+}
+
+/* send len bytes of file to the client, trickled if asked to */
+static int send_body(int fd, int file, off_t len, const struct options *opt)
+{
+	off_t off = 0;
+
+	while (off < len) {
+		size_t n = (size_t)(len - off);
+		if (opt->chunk && n > opt->chunk) {
+			n = opt->chunk;
+		}
+		if (opt->chunk && off > 0) {
+			sleep_ms(opt->interval);
+		}
+		ssize_t w = sendfile(fd, file, &off, n);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		} else if (w <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * respond() - answer one request line
+ * - only GET is served, and only files right in dir.
+ * - returns 0 if the connection can be kept open, -1 otherwise.
+ */
+static int respond(int fd, int dir, char *request, const struct options *opt)
+{
+	char method[8];
+	char path[256];
+	char header[384];
+	char etag[64] = "";
+	int file = -1;
+	off_t len = 0;
+	int status = 200;
+
+	stats.requests++;
+
+	if (sscanf(request, "%7s %255s", method, path) != 2 || strcmp(method, "GET") != 0) {
+		status = 400;
+	} else if (stats.errors < opt->errors) {
+		stats.errors++;
+		status = opt->status;
+	} else if (path[0] != '/' || strchr(&path[1], '/') || path[1] == '.' || path[1] == 0) {
+		status = 404;
+	} else {
+		file = openat(dir, &path[1], O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (file < 0 || fstat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+			status = 404;
+		} else {
+			len = st.st_size;
+			if (opt->not_modified) {
+				snprintf(etag, sizeof(etag), "ETag: \"%lld-%lld\"\r\n",
+					 (long long)st.st_size, (long long)st.st_mtime);
+				if (strcasestr(request, "\r\nIf-None-Match:") ||
+				    strcasestr(request, "\r\nIf-Modified-Since:")) {
+					status = 304;
+					stats.not_modified++;
+				}
+			}
+		}
+	}
+	write_stats(opt);
+
+	sleep_ms(opt->ttfb);
+
+	int n = snprintf(header, sizeof(header),
+			 "HTTP/1.1 %d %s\r\nContent-Length: %lld\r\n%s%s\r\n", status,
+			 status == 200 ? "OK" : status == 304 ? "Not Modified" :
+			 status == 404 ? "Not Found" : "Error",
+			 (long long)len, status == 429 ? "Retry-After: 0\r\n" : "", etag);
+	/* the Content-Length of a 304 is that of the file it stands for */
+	bool body = status != 304;
+	/* the header goes out together with the start of the body */
+	int result = send_all(fd, header, (size_t)n, body && len > 0 ? MSG_MORE : 0);
+	if (result == 0 && body && file >= 0) {
+		result = send_body(fd, file, len, opt);
+	}
+	if (file >= 0) {
+		close(file);
+	}
+	return status == 400 ? -1 : result;
+}
+
+/* serve the requests of one connection, in order, until the client hangs up */
+static void serve(int fd, int dir, const struct options *opt)
+{
+	char buf[REQUEST_SIZE + 1];
+	size_t len = 0;
+
+	for (;;) {
+		/* a request ends with an empty line */
+		buf[len] = 0;
+		char *end = strstr(buf, "\r\n\r\n");
+		if (end) {
+			end += 4;
+			/* headers of the requests pipelined after it are not its own */
+			end[-1] = 0;
+			if (respond(fd, dir, buf, opt) != 0) {
+				return;
+			}
+			len -= (size_t)(end - buf);
+			memmove(buf, end, len);
+			continue;
+		}
+
+		if (len == REQUEST_SIZE) {
+			return;
+		}
+		ssize_t r = recv(fd, &buf[len], REQUEST_SIZE - len, 0);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		} else if (r <= 0) {
+			return;
+		}
+		len += (size_t)r;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: fetch_mock [-a ms] [-t ms] [-c bytes] [-i ms] [-r n] [-e n] [-s status]\n"
+		"                  [-n] [-o stats] <address> <port> <directory>\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct options opt = { .status = 503 };
+	int c;
+
+	while ((c = getopt(argc, argv, "a:t:c:i:r:e:s:no:")) != -1) {
+		switch (c) {
+		case 'a':
+			opt.accept_delay = atoi(optarg);
+			break;
+		case 't':
+			opt.ttfb = atoi(optarg);
+			break;
+		case 'c':
+			opt.chunk = (size_t)atol(optarg);
+			break;
+		case 'i':
+			opt.interval = atoi(optarg);
+			break;
+		case 'r':
+			opt.resets = atoi(optarg);
+			break;
+		case 'e':
+			opt.errors = atoi(optarg);
+			break;
+		case 's':
+			opt.status = atoi(optarg);
+			break;
+		case 'n':
+			opt.not_modified = 1;
+			break;
+		case 'o':
+			opt.stats = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind != 3) {
+		usage();
+	}
+
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)atoi(argv[optind + 1])) };
+	if (inet_pton(AF_INET, argv[optind], &addr.sin_addr) != 1) {
+		usage();
+	}
+	int dir = open(argv[optind + 2], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir < 0) {
+		FAIL("open()");
+	}
+
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if ((lfd < 0) ||
+	    (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) ||
+	    (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+	    (listen(lfd, 16) < 0)) {
+		FAIL("listen()");
+	}
+	write_stats(&opt);
+	/* clients hanging up mid-body are expected */
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("listening\n");
+	fflush(stdout);
+
+	for (;;) {
+		sleep_ms(opt.accept_delay);
+
+		int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			FAIL("accept()");
+		}
+		stats.connections++;
+
+		if (stats.resets < opt.resets) {
+			char buf[REQUEST_SIZE];
+			while (recv(fd, buf, sizeof(buf), 0) < 0 && errno == EINTR)
+				;
+			/* a zero linger time makes close() send a RST */
+			struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+			(void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+			stats.resets++;
+		} else {
+			/* trickled chunks must not wait for the client's ACKs */
+			(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			serve(fd, dir, &opt);
+		}
+		write_stats(&opt);
+		close(fd);
+	}
+}
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+#
+# Stand-in metadata service for fetch_test.
+#
+# Serves the files in the current directory over HTTP/1.1 with keep-alive,
+# and records how many TCP connections it accepted and how many requests
+# arrived pipelined (i.e. while an earlier one was still unanswered), so
+# the test can check how ucd-data-fetch talks to the server. Responses
+# carry an ETag, and requests with a matching If-None-Match get a 304,
+# counted as not_modified.
+#
+# usage: fetch_server.py <address> <port> <stats file> [http10|chunked]
+#
+# With "http10", the server speaks HTTP/1.0 and closes the connection
+# after every response, like a server that doesn't support pipelining.
+# With "chunked", bodies are sent with chunked transfer encoding, in
+# chunks small enough that lines are split across them.
+
+import http.server
+import os
+import sys
+import threading
+
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    chunk_size = 0
+
+    def setup(self):
+        super().setup()
+        self.server.count("connections")
+
+    def end_headers(self):
+        if self.etag:
+            self.send_header("ETag", self.etag)
+        super().end_headers()
+
+    def do_GET(self):
+        # peek without blocking for a request queued behind this one
+        self.connection.setblocking(False)
+        try:
+            if self.rfile.peek(1):
+                self.server.count("pipelined")
+        except OSError:
+            pass
+        self.connection.setblocking(True)
+        self.etag = None
+        try:
+            st = os.stat(self.translate_path(self.path))
+            self.etag = '"%x-%x"' % (st.st_mtime_ns, st.st_size)
+        except OSError:
+            pass
+        if self.etag and self.headers.get("If-None-Match") == self.etag:
+            self.server.count("not_modified")
+            self.send_response(304)
+            self.end_headers()
+            return
+        try:
+            if self.chunk_size:
+                self.send_chunked()
+            else:
+                super().do_GET()
+        except (BrokenPipeError, ConnectionResetError):
+            # a losing auto-detection probe is cancelled mid-response
+            pass
+
+    def send_chunked(self):
+        try:
+            with open(self.translate_path(self.path), "rb") as f:
+                data = f.read()
+        except OSError:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Transfer-Encoding", "chunked")
+        self.end_headers()
+        for i in range(0, len(data), self.chunk_size):
+            chunk = data[i:i + self.chunk_size]
+            self.wfile.write(b"%x\r\n%s\r\n" % (len(chunk), chunk))
+        self.wfile.write(b"0\r\n\r\n")
+
+
+class Server(http.server.ThreadingHTTPServer):
+    def count(self, key):
+        with self.lock:
+            self.stats[key] += 1
+            with open(self.stats_file, "w") as f:
+                for k, v in self.stats.items():
+                    f.write("%s=%d\n" % (k, v))
+
+
+address, port, stats_file = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+if sys.argv[4:] == ["http10"]:
+    Handler.protocol_version = "HTTP/1.0"
+elif sys.argv[4:] == ["chunked"]:
+    Handler.chunk_size = 7
+
+server = Server((address, port), Handler)
+server.lock = threading.Lock()
+server.stats = {"connections": 0, "pipelined": 0, "not_modified": 0}
+server.stats_file = stats_file
+server.serve_forever()
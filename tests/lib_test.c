@@ -32,15 +32,21 @@
  files in the program, then also delete it here.
 ***/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+#include <sched.h>
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include <check.h>
 
@@ -70,6 +76,62 @@ START_TEST(test_lib_exec_task)
 }
 END_TEST
 
+START_TEST(test_lib_exec_task_argv)
+{
+	char dir[] = "/tmp/test_lib_exec_task_argv-XXXXXX";
+	char line[LINE_MAX] = { 0 };
+
+	ck_assert(mkdtemp(dir) != NULL);
+
+	/* arguments are passed as they are, quotes and spaces included */
+	gchar* path = g_strdup_printf("%s/it's a test", dir);
+	const gchar* argv[] = { "touch", path, NULL };
+	ck_assert(exec_task_argv(argv) == true);
+	ck_assert(access(path, F_OK) == 0);
+	ck_assert(remove(path) == 0);
+
+	/* failures are reported, with or without a shell */
+	const gchar* fail[] = { "false", NULL };
+	ck_assert(exec_task_argv(fail) == false);
+	const gchar* missing[] = { "/nonexistent/command", NULL };
+	ck_assert(exec_task_argv(missing) == false);
+	ck_assert(exec_task("false") == false);
+	g_free(path);
+	path = g_strdup_printf("%s/noexec", dir);
+	ck_assert(g_file_set_contents(path, "#!/bin/sh\n", -1, NULL));
+	ck_assert(exec_task(path) == false);
+	ck_assert(remove(path) == 0);
+
+	/* more output than a pipe holds, in lines or not, is streamed through */
+	const gchar* output[] = { "head", "-c", "400000", "/dev/zero", NULL };
+	ck_assert(exec_task_argv(output) == true);
+	ck_assert(exec_task("seq 20000") == true);
+
+	/* commands past their deadline are stopped, with whatever they started */
+	struct exec_limits limits = { .timeout = 1 };
+	time_t start = time(NULL);
+	ck_assert(exec_task_limits("sleep 30 & sleep 30", &limits) == false);
+	ck_assert(time(NULL) - start < 10);
+	limits.memory = 64 << 20;
+	ck_assert(exec_task_limits("true", &limits) == true);
+	/* in place before the command runs its first instruction */
+	limits.cpu = 7;
+	ck_assert(exec_task_limits("test $(ulimit -t) = 7 && test $(ulimit -v) = 65536", &limits) == true);
+	ck_assert(exec_task_limits("/nonexistent/command", &limits) == false);
+
+	/* builtins and shell syntax still go through the shell */
+	snprintf(line, LINE_MAX, "cd %s && touch builtin", dir);
+	ck_assert(exec_task(line) == true);
+	g_free(path);
+	path = g_strdup_printf("%s/builtin", dir);
+	ck_assert(access(path, F_OK) == 0);
+	ck_assert(remove(path) == 0);
+
+	ck_assert(rmdir(dir) == 0);
+	g_free(path);
+}
+END_TEST
+
 START_TEST(test_lib_write_file)
 {
 	int fd;
@@ -132,16 +194,139 @@ START_TEST(test_lib_chown_path)
 }
 END_TEST
 
+/* /proc files take one write, not the rename g_file_set_contents() does */
+static bool write_proc(const gchar* path, const gchar* text) {
+	int fd = open(path, O_WRONLY);
+	bool result = fd >= 0 && write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+	if (fd >= 0) {
+		close(fd);
+	}
+	return result;
+}
+
+/* a UTS namespace of our own, so the name of the system stays as it is */
+static bool unshare_uts(void) {
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	gchar* map;
+	bool result;
+
+	if (unshare(CLONE_NEWUTS) == 0) {
+		return true;
+	}
+	/* without privileges, a user namespace brings the right to set the name */
+	if (unshare(CLONE_NEWUSER | CLONE_NEWUTS) != 0) {
+		return false;
+	}
+	map = g_strdup_printf("%d %d 1\n", uid, uid);
+	result = write_proc("/proc/self/setgroups", "deny") &&
+		write_proc("/proc/self/uid_map", map);
+	g_free(map);
+	map = g_strdup_printf("%d %d 1\n", gid, gid);
+	result = result && write_proc("/proc/self/gid_map", map);
+	g_free(map);
+	return result;
+}
+
+/* the checks of test_lib_set_hostname, in its namespace: the exit status is the failed one */
+static int set_hostname_checks(const gchar* root) {
+	char name[HOST_NAME_MAX + 1] = { 0 };
+	gchar* contents = NULL;
+	gchar* long_label = NULL;
+	gchar* path = g_build_filename(root, "etc", "hosts", NULL);
+
+	if (!g_file_set_contents(path, "127.0.0.1 localhost\n127.0.1.1 old\n", -1, NULL)) {
+		return 1;
+	}
+	if (!set_hostname("node1.example.com", root)) {
+		return 2;
+	}
+	if (gethostname(name, sizeof(name)) != 0 || strcmp(name, "node1.example.com") != 0) {
+		return 3;
+	}
+	if (!g_file_get_contents(path, &contents, NULL, NULL) ||
+	    strcmp(contents, "127.0.0.1 localhost\n127.0.1.1\tnode1.example.com node1\n") != 0) {
+		return 4;
+	}
+	g_free(contents);
+	g_free(path);
+	path = g_build_filename(root, "etc", "hostname", NULL);
+	if (!g_file_get_contents(path, &contents, NULL, NULL) ||
+	    strcmp(contents, "node1.example.com\n") != 0) {
+		return 5;
+	}
+	g_free(contents);
+	/* names are cleaned up like hostnamectl does, unless nothing is left */
+	if (!set_hostname("-My Host_1..", root) ||
+	    gethostname(name, sizeof(name)) != 0 || strcmp(name, "my-host1") != 0) {
+		return 6;
+	}
+	if (!g_file_get_contents(path, &contents, NULL, NULL) || strcmp(contents, "my-host1\n") != 0) {
+		return 7;
+	}
+	if (set_hostname("..!", root)) {
+		return 8;
+	}
+	/* no label ends in a dash, or has more than 63 bytes */
+	if (!set_hostname("a-.b", root) ||
+	    gethostname(name, sizeof(name)) != 0 || strcmp(name, "a.b") != 0) {
+		return 9;
+	}
+	long_label = g_strnfill(70, 'x');
+	if (!set_hostname(long_label, root) ||
+	    gethostname(name, sizeof(name)) != 0 || strspn(name, "x") != 63 || name[63] != 0) {
+		return 10;
+	}
+	g_free(long_label);
+	g_free(contents);
+	g_free(path);
+	return 0;
+}
+
+START_TEST(test_lib_set_hostname)
+{
+	char dir[] = "/tmp/test_lib_set_hostname-XXXXXX";
+	int status;
+
+	ck_assert(mkdtemp(dir) != NULL);
+	gchar* etc = g_build_filename(dir, "etc", NULL);
+	ck_assert(mkdir(etc, 0755) == 0);
+
+	pid_t pid = fork();
+	ck_assert(pid != -1);
+	if (pid == 0) {
+		if (!unshare_uts()) {
+			_exit(100);
+		}
+		_exit(set_hostname_checks(dir));
+	}
+	ck_assert(waitpid(pid, &status, 0) == pid);
+	ck_assert(WIFEXITED(status));
+	if (WEXITSTATUS(status) == 100) {
+		fprintf(stderr, "test_lib_set_hostname: no UTS namespace, skipped\n");
+	} else {
+		ck_assert_int_eq(WEXITSTATUS(status), 0);
+	}
+
+	gchar* command = g_strdup_printf("rm -rf '%s'", dir);
+	ck_assert(system(command) == 0);
+	g_free(command);
+	g_free(etc);
+}
+END_TEST
+
 Suite* make_lib_suite(void) {
 	Suite *s;
 	TCase *tc_exec_task;
 	TCase *tc_write_file;
 	TCase *tc_chown_path;
+	TCase *tc_set_hostname;
 
 	s = suite_create("lib");
 
 	tc_exec_task = tcase_create("tc_exec_task");
 	tcase_add_test(tc_exec_task, test_lib_exec_task);
+	tcase_add_test(tc_exec_task, test_lib_exec_task_argv);
 
 	tc_write_file = tcase_create("tc_write_file");
 	tcase_add_test(tc_write_file, test_lib_write_file);
@@ -149,9 +334,13 @@ Suite* make_lib_suite(void) {
 	tc_chown_path = tcase_create("tc_chown_path");
 	tcase_add_test(tc_chown_path, test_lib_chown_path);
 
+	tc_set_hostname = tcase_create("tc_set_hostname");
+	tcase_add_test(tc_set_hostname, test_lib_set_hostname);
+
 	suite_add_tcase(s, tc_exec_task);
 	suite_add_tcase(s, tc_write_file);
 	suite_add_tcase(s, tc_chown_path);
+	suite_add_tcase(s, tc_set_hostname);
 
 	return s;
 }
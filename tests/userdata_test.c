@@ -35,10 +35,14 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <check.h>
 #include <glib.h>
+#include <zlib.h>
 
 #include "userdata.h"
 
@@ -80,6 +84,106 @@ START_TEST(test_userdata_process_file)
 }
 END_TEST
 
+START_TEST(test_userdata_process_gzip_file)
+{
+	int fd_script;
+	int fd_script_outfile;
+	char script_file[] = "/tmp/test_userdata_process_gzip_file-XXXXXX";
+	char script_outfile[] = "/tmp/test_userdata_process_gzip_file-XXXXXX";
+	char *text = "this is a compressed test!";
+	GString* script_text = g_string_new("#!/bin/bash\n");
+	FILE* file;
+	gzFile gz;
+	char line[LINE_MAX] = { 0 };
+
+	fd_script_outfile = mkstemp(script_outfile);
+	ck_assert(fd_script_outfile != -1);
+
+	/* big enough to span several reads of the decompressed stream */
+	for (int i = 0; i < 10000; ++i) {
+		g_string_append_printf(script_text, "# padding line %d\n", i);
+	}
+	g_string_append_printf(script_text, "echo -n '%s' > %s\n", text, script_outfile);
+
+	fd_script = mkstemp(script_file);
+	ck_assert(fd_script != -1);
+	gz = gzdopen(fd_script, "wb");
+	ck_assert(gz != NULL);
+	ck_assert(gzwrite(gz, script_text->str, (unsigned)script_text->len) == (int)script_text->len);
+	g_string_free(script_text, true);
+	ck_assert(gzclose(gz) == Z_OK);
+	ck_assert(userdata_process_file(script_file) == true);
+	ck_assert(remove(script_file) != -1);
+
+	file = fdopen(fd_script_outfile, "r");
+	ck_assert(file != NULL);
+	fgets(line, LINE_MAX, file);
+	ck_assert_str_eq(line, text);
+	ck_assert(fclose(file) != EOF);
+	ck_assert(remove(script_outfile) != -1);
+}
+END_TEST
+
+START_TEST(test_userdata_process_pipe)
+{
+	char dir[] = "/tmp/test_userdata_process_pipe-XXXXXX";
+	int fds[2];
+	int status;
+	char line[LINE_MAX] = { 0 };
+	FILE* file;
+
+	ck_assert(mkdtemp(dir) != NULL);
+	gchar* first = g_strdup_printf("%s/first", dir);
+	gchar* second = g_strdup_printf("%s/second", dir);
+	gchar* head = g_strdup_printf("#cloud-config\nwrite_files:\n"
+		"  - path: %s\n    content: first\n"
+		"no_such_block: 1\n", first);
+	gchar* tail = g_strdup_printf("write_files:\n"
+		"  - path: %s\n    content: second\n", second);
+
+	ck_assert(pipe(fds) == 0);
+	pid_t pid = fork();
+	ck_assert(pid >= 0);
+	if (pid == 0) {
+		/* the first block has to be applied before the rest is sent */
+		close(fds[0]);
+		int found = 0;
+		if (write(fds[1], head, strlen(head)) != (ssize_t)strlen(head)) {
+			_exit(2);
+		}
+		for (int i = 0; i < 500 && !found; i++) {
+			found = access(first, F_OK) == 0;
+			usleep(10000);
+		}
+		if (write(fds[1], tail, strlen(tail)) != (ssize_t)strlen(tail)) {
+			_exit(2);
+		}
+		_exit(found ? 0 : 1);
+	}
+	close(fds[1]);
+
+	gchar* path = g_strdup_printf("/proc/self/fd/%d", fds[0]);
+	ck_assert(userdata_process_file(path) == true);
+	close(fds[0]);
+	ck_assert(waitpid(pid, &status, 0) == pid);
+	ck_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	file = fopen(second, "r");
+	ck_assert(file != NULL);
+	fgets(line, LINE_MAX, file);
+	ck_assert_str_eq(line, "second");
+	ck_assert(fclose(file) != EOF);
+
+	ck_assert(remove(first) != -1);
+	ck_assert(remove(second) != -1);
+	ck_assert(rmdir(dir) != -1);
+	g_free(path);
+	g_free(head);
+	g_free(tail);
+	g_free(first);
+	g_free(second);
+}
+END_TEST
 
 Suite* make_userdata_suite(void) {
 	Suite *s;
@@ -89,6 +193,8 @@ Suite* make_userdata_suite(void) {
 
 	tc_process_file = tcase_create("tc_process_file");
 	tcase_add_test(tc_process_file, test_userdata_process_file);
+	tcase_add_test(tc_process_file, test_userdata_process_gzip_file);
+	tcase_add_test(tc_process_file, test_userdata_process_pipe);
 
 	suite_add_tcase(s, tc_process_file);
 